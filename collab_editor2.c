@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -9,21 +11,526 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <openssl/sha.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <fnmatch.h>
+#include <zlib.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <elf.h>
 
 #define PORT 8080
 #define WS_PORT 8081
 #define BUFFER_SIZE 65536
 #define MAX_CLIENTS 50
+#define MAX_REQUEST_SIZE (256L * 1024 * 1024)
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Allocation accounting, turned on with --mem-accounting. Every allocation in
+// this file goes through mem_alloc() and friends with the subsystem it is
+// for. With accounting on, each block starts with a MemHeader holding its
+// size, subsystem and call site. Live bytes and high-water marks per
+// subsystem go to /admin/metrics, and what is still allocated, by call site,
+// is printed at shutdown. With it off, these are plain malloc calls. The flag
+// is read before anything is allocated and never changes afterwards.
+enum { MEM_OTHER, MEM_CONNECTIONS, MEM_FRAMES, MEM_DOCUMENTS, MEM_HISTORY, MEM_INDEXES, MEM_HTTP, MEM_TAGS };
+static const char* mem_tag_names[MEM_TAGS] = {"other", "connections", "frames", "documents", "history", "indexes", "http"};
+
+#define MEM_SITES 4096
+#define MEM_NO_SITE UINT32_MAX
+
+typedef struct {
+    uint64_t size;
+    uint32_t tag;
+    uint32_t site;
+} MemHeader;
+
+typedef struct {
+    long live_bytes;
+    long live_blocks;
+    long peak_bytes;
+    unsigned long allocations;
+} MemGauge;
+
+typedef struct {
+    uintptr_t caller;
+    long live_bytes;
+    long live_blocks;
+} MemSite;
+
+static int mem_accounting = 0;
+static MemGauge mem_gauges[MEM_TAGS];
+static MemSite mem_sites[MEM_SITES];
+
+// Slot of the calling code in mem_sites, claimed on first use
+static uint32_t mem_site(uintptr_t caller) {
+    uint32_t slot = (uint32_t)(((uint64_t)caller * 0x9E3779B97F4A7C15ULL) >> 52) & (MEM_SITES - 1);
+    for (int probe = 0; probe < MEM_SITES; probe++, slot = (slot + 1) & (MEM_SITES - 1)) {
+        uintptr_t current = __atomic_load_n(&mem_sites[slot].caller, __ATOMIC_ACQUIRE);
+        if (current == 0 && __atomic_compare_exchange_n(&mem_sites[slot].caller, &current, caller, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return slot;
+        }
+        if (current == caller) return slot;
+    }
+    return MEM_NO_SITE;
+}
+
+static void mem_account(int tag, uint32_t site, long bytes, long blocks) {
+    MemGauge* gauge = &mem_gauges[tag];
+    long live = __atomic_add_fetch(&gauge->live_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gauge->live_blocks, blocks, __ATOMIC_RELAXED);
+    if (blocks > 0) __atomic_add_fetch(&gauge->allocations, 1, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&gauge->peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&gauge->peak_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    if (site != MEM_NO_SITE) {
+        __atomic_add_fetch(&mem_sites[site].live_bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mem_sites[site].live_blocks, blocks, __ATOMIC_RELAXED);
+    }
+}
+
+static void* mem_track(MemHeader* header, int tag, size_t size, void* caller) {
+    if (!header) return NULL;
+    *header = (MemHeader){size, tag, mem_site((uintptr_t)caller)};
+    mem_account(tag, header->site, size, 1);
+    return header + 1;
+}
+
+// Kept out of line so __builtin_return_address(0) is the allocating code
+__attribute__((noinline)) void* mem_alloc(int tag, size_t size) {
+    if (!mem_accounting) return malloc(size);
+    return mem_track(malloc(sizeof(MemHeader) + size), tag, size, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) void* mem_calloc(int tag, size_t count, size_t size) {
+    if (!mem_accounting) return calloc(count, size);
+    if (size && count > (SIZE_MAX - sizeof(MemHeader)) / size) return NULL;
+    return mem_track(calloc(1, sizeof(MemHeader) + count * size), tag, count * size, __builtin_return_address(0));
+}
+
+// A block keeps the subsystem and call site it was first allocated with
+__attribute__((noinline)) void* mem_realloc(int tag, void* ptr, size_t size) {
+    if (!mem_accounting) return realloc(ptr, size);
+    if (!ptr) return mem_track(malloc(sizeof(MemHeader) + size), tag, size, __builtin_return_address(0));
+    MemHeader old = ((MemHeader*)ptr)[-1];
+    MemHeader* header = realloc((MemHeader*)ptr - 1, sizeof(MemHeader) + size);
+    if (!header) return NULL;
+    header->size = size;
+    mem_account(old.tag, old.site, (long)size - (long)old.size, 0);
+    return header + 1;
+}
+
+__attribute__((noinline)) char* mem_strndup(int tag, const char* s, size_t n) {
+    n = strnlen(s, n);
+    char* copy = mem_accounting ? mem_track(malloc(sizeof(MemHeader) + n + 1), tag, n + 1, __builtin_return_address(0)) : malloc(n + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+__attribute__((noinline)) char* mem_strdup(int tag, const char* s) {
+    size_t n = strlen(s);
+    char* copy = mem_accounting ? mem_track(malloc(sizeof(MemHeader) + n + 1), tag, n + 1, __builtin_return_address(0)) : malloc(n + 1);
+    if (copy) memcpy(copy, s, n + 1);
+    return copy;
+}
+
+void mem_free(void* ptr) {
+    if (!ptr) return;
+    if (!mem_accounting) {
+        free(ptr);
+        return;
+    }
+    MemHeader* header = (MemHeader*)ptr - 1;
+    mem_account(header->tag, header->site, -(long)header->size, -1);
+    free(header);
+}
+
+// Moves a block to the subsystem that now owns it, such as a storage read
+// that becomes a document
+static void mem_retag(void* ptr, int tag) {
+    if (!ptr || !mem_accounting) return;
+    MemHeader* header = (MemHeader*)ptr - 1;
+    if ((int)header->tag == tag) return;
+    mem_account(header->tag, MEM_NO_SITE, -(long)header->size, -1);
+    mem_account(tag, MEM_NO_SITE, header->size, 1);
+    header->tag = tag;
+}
+
+// Events counted in the current and the previous whole second. Only one
+// thread at a time counts (the owner, or whoever holds the owner's lock);
+// /admin/state reads meters without locking.
+typedef struct {
+    long long second;
+    long current;
+    long previous;
+} RateMeter;
+
+static void rate_count(RateMeter* meter, long long now, long n) {
+    long long second = now / 1000;
+    if (second != meter->second) {
+        __atomic_store_n(&meter->previous, second == meter->second + 1 ? meter->current : 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&meter->current, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&meter->second, second, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&meter->current, meter->current + n, __ATOMIC_RELAXED);
+}
+
+// Events in the last whole second
+static long rate_read(const RateMeter* meter, long long now) {
+    long long second = __atomic_load_n(&meter->second, __ATOMIC_RELAXED);
+    if (second == now / 1000) return __atomic_load_n(&meter->previous, __ATOMIC_RELAXED);
+    if (second == now / 1000 - 1) return __atomic_load_n(&meter->current, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Per-thread records: the trace spans below and the flight recorder's recent
+// events. A thread writes only its own ThreadRing, so recording takes no
+// lock. Rings of exited threads are handed to new ones and never freed,
+// which lets the crash handler walk them without locking.
+#define TRACE_RING_SPANS 2048
+#define FLIGHT_RING_EVENTS 256
+#define THREAD_ALTSTACK (64 * 1024)
+
+typedef struct {
+    uint64_t trace;
+    long long start_us;
+    long dur_us;
+    long arg;
+    char name[24];
+} TraceSpan;
+
+// A flight recorder entry: what happened (a FLIGHT_* kind), on which socket,
+// a size or count, and the first bytes of the message or path involved
+typedef struct {
+    long long time_us;
+    int kind;
+    int fd;
+    long value;
+    char detail[40];
+} FlightEvent;
+
+// Durations by power of two: counts[i] holds those under 2^i microseconds,
+// the last bucket everything longer
+#define LATENCY_BUCKETS 24
+
+typedef struct {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long total;
+    unsigned long long sum_us;
+} LatencyHistogram;
+
+// The locks timed by lock_acquire(); per-client and per-document locks are
+// each counted as one class
+enum { LOCK_CLIENTS, LOCK_CLIENT, LOCK_DOCUMENTS, LOCK_DOCUMENT, LOCK_FS_INDEX, LOCK_KV_STORE, LOCK_CLASSES };
+static const char* lock_names[LOCK_CLASSES] = {"clients", "client", "documents", "document", "fs_index", "kv_store"};
+
+#define LOCK_HOLD_MAX 8
+#define STALL_STACK_DEPTH 32
+
+typedef struct {
+    pthread_mutex_t* mutex;
+    int lock_class;
+    long long since_us;
+} LockHold;
+
+enum {
+    FLIGHT_CONNECT = 1,
+    FLIGHT_DISCONNECT,
+    FLIGHT_RECV,
+    FLIGHT_MESSAGE,
+    FLIGHT_SEND,
+    FLIGHT_HTTP,
+    FLIGHT_LOAD,
+    FLIGHT_STORE,
+    FLIGHT_KINDS
+};
+
+typedef struct ThreadRing {
+    TraceSpan spans[TRACE_RING_SPANS];
+    unsigned long next;
+    FlightEvent events[FLIGHT_RING_EVENTS];
+    unsigned long event_next;
+    pid_t tid;
+    int in_use;
+    long long acquired_us;
+    char role[16];
+    // What the thread is doing now; always a string literal
+    const char* state;
+    char* altstack;
+    // For the stall watchdog: when the thread last stopped waiting (0 while
+    // it waits), the tracked locks it holds or is waiting for, and the stack
+    // captured when it was found stalled
+    long long busy_since_us;
+    long long stall_reported_us;
+    LockHold holds[LOCK_HOLD_MAX];
+    int hold_count;
+    LockHold waiting;
+    uintptr_t stall_pcs[STALL_STACK_DEPTH];
+    int stall_depth;
+    LatencyHistogram busy;
+    LatencyHistogram lock_wait[LOCK_CLASSES];
+    LatencyHistogram lock_hold[LOCK_CLASSES];
+    struct ThreadRing* next_ring;
+} ThreadRing;
+
+static ThreadRing* thread_rings = NULL;
+static pthread_mutex_t thread_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_once = PTHREAD_ONCE_INIT;
+static __thread ThreadRing* thread_ring_self = NULL;
+
+static void thread_ring_release(void* ring) {
+    __atomic_store_n(&((ThreadRing*)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void thread_ring_key_create(void) {
+    pthread_key_create(&thread_ring_key, thread_ring_release);
+}
+
+// The calling thread's ring. Its first call also gives the thread an
+// alternate signal stack, so a stack overflow still reaches the crash handler.
+static ThreadRing* thread_ring(void) {
+    if (thread_ring_self) return thread_ring_self;
+    pthread_once(&thread_ring_once, thread_ring_key_create);
+    pthread_mutex_lock(&thread_rings_mutex);
+    ThreadRing* ring = thread_rings;
+    while (ring && ring->in_use) ring = ring->next_ring;
+    if (!ring) {
+        ring = mem_calloc(MEM_OTHER, 1, sizeof(ThreadRing));
+        ring->altstack = mem_alloc(MEM_OTHER, THREAD_ALTSTACK);
+        ring->next_ring = thread_rings;
+        thread_rings = ring;
+    }
+    ring->in_use = 1;
+    ring->tid = gettid();
+    ring->acquired_us = ring->busy_since_us = now_us();
+    strcpy(ring->role, "thread");
+    ring->state = "running";
+    ring->hold_count = 0;
+    pthread_mutex_unlock(&thread_rings_mutex);
+    pthread_setspecific(thread_ring_key, ring);
+    stack_t stack = {.ss_sp = ring->altstack, .ss_size = THREAD_ALTSTACK};
+    sigaltstack(&stack, NULL);
+    thread_ring_self = ring;
+    return ring;
+}
+
+// Names the calling thread in crash dumps
+static void thread_role(const char* role) {
+    ThreadRing* ring = thread_ring();
+    snprintf(ring->role, sizeof(ring->role), "%s", role);
+}
+
+static void histogram_add(LatencyHistogram* histogram, long long us) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (1LL << bucket)) bucket++;
+    histogram->counts[bucket]++;
+    histogram->total++;
+    histogram->sum_us += us;
+}
+
+// The thread is working on state; the watchdog reports it if it takes too long
+static void thread_state(const char* state) {
+    ThreadRing* ring = thread_ring();
+    ring->state = state;
+    if (!ring->busy_since_us) __atomic_store_n(&ring->busy_since_us, now_us(), __ATOMIC_RELEASE);
+}
+
+// The thread is about to block waiting for work in state, ending a busy spell
+static void thread_wait(const char* state) {
+    ThreadRing* ring = thread_ring();
+    ring->state = state;
+    if (ring->busy_since_us) {
+        histogram_add(&ring->busy, now_us() - ring->busy_since_us);
+        __atomic_store_n(&ring->busy_since_us, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void lock_held(ThreadRing* ring, pthread_mutex_t* mutex, int lock_class, long long now) {
+    if (ring->hold_count < LOCK_HOLD_MAX) {
+        ring->holds[ring->hold_count] = (LockHold){mutex, lock_class, now};
+        __atomic_store_n(&ring->hold_count, ring->hold_count + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// pthread_mutex_lock for the major locks, timing the wait and the hold
+static void lock_acquire(pthread_mutex_t* mutex, int lock_class) {
+    ThreadRing* ring = thread_ring();
+    if (pthread_mutex_trylock(mutex) == 0) {
+        histogram_add(&ring->lock_wait[lock_class], 0);
+        lock_held(ring, mutex, lock_class, now_us());
+        return;
+    }
+    long long start = now_us();
+    ring->waiting = (LockHold){mutex, lock_class, start};
+    pthread_mutex_lock(mutex);
+    ring->waiting.mutex = NULL;
+    long long now = now_us();
+    histogram_add(&ring->lock_wait[lock_class], now - start);
+    lock_held(ring, mutex, lock_class, now);
+}
+
+static int lock_try(pthread_mutex_t* mutex, int lock_class) {
+    if (pthread_mutex_trylock(mutex) != 0) return -1;
+    ThreadRing* ring = thread_ring();
+    histogram_add(&ring->lock_wait[lock_class], 0);
+    lock_held(ring, mutex, lock_class, now_us());
+    return 0;
+}
+
+static void lock_release(pthread_mutex_t* mutex) {
+    ThreadRing* ring = thread_ring();
+    for (int i = ring->hold_count - 1; i >= 0; i--) {
+        if (ring->holds[i].mutex != mutex) continue;
+        histogram_add(&ring->lock_hold[ring->holds[i].lock_class], now_us() - ring->holds[i].since_us);
+        memmove(&ring->holds[i], &ring->holds[i + 1], (ring->hold_count - i - 1) * sizeof(LockHold));
+        __atomic_store_n(&ring->hold_count, ring->hold_count - 1, __ATOMIC_RELEASE);
+        break;
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+static void flight_event(int kind, int fd, long value, const char* detail, long detail_len) {
+    ThreadRing* ring = thread_ring();
+    FlightEvent* event = &ring->events[ring->event_next % FLIGHT_RING_EVENTS];
+    event->time_us = now_us();
+    event->kind = kind;
+    event->fd = fd;
+    event->value = value;
+    if (detail_len > (long)sizeof(event->detail)) detail_len = sizeof(event->detail);
+    memcpy(event->detail, detail, detail_len);
+    memset(event->detail + detail_len, 0, sizeof(event->detail) - detail_len);
+    __atomic_store_n(&ring->event_next, ring->event_next + 1, __ATOMIC_RELEASE);
+}
+
+// Message tracing. A sampled inbound WebSocket message gets a trace ID that
+// the handling thread carries in trace_current; the frames it queues carry it
+// on to the outbound scheduler. Spans go to the recording thread's ring.
+// GET /admin/trace exports whatever the rings still hold.
+
+// Fraction of messages traced (1% by default), scaled to 2^32 - 1; set by
+// --trace-rate and /admin/trace?rate=
+static uint32_t trace_threshold = 42949673;
+static uint64_t trace_last_id = 0;
+static __thread uint64_t trace_current = 0;
+static __thread uint64_t trace_random = 0;
+
+// Decides whether the message about to be handled is traced
+static void trace_begin(void) {
+    if (!trace_random) trace_random = (uint64_t)now_us() ^ ((uint64_t)gettid() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    trace_random ^= trace_random << 13;
+    trace_random ^= trace_random >> 7;
+    trace_random ^= trace_random << 17;
+    uint32_t threshold = __atomic_load_n(&trace_threshold, __ATOMIC_RELAXED);
+    trace_current = threshold && (uint32_t)trace_random <= threshold ? __atomic_add_fetch(&trace_last_id, 1, __ATOMIC_RELAXED) : 0;
+}
+
+static void trace_end(void) {
+    trace_current = 0;
+}
+
+// Start time for a span, or 0 when the current message is not traced
+static long long trace_now(void) {
+    return trace_current ? now_us() : 0;
+}
+
+static void trace_record(uint64_t trace, const char* name, long long start_us, long long end_us, long arg) {
+    ThreadRing* ring = thread_ring();
+    TraceSpan* span = &ring->spans[ring->next % TRACE_RING_SPANS];
+    span->trace = trace;
+    span->start_us = start_us;
+    span->dur_us = end_us - start_us;
+    span->arg = arg;
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    __atomic_store_n(&ring->next, ring->next + 1, __ATOMIC_RELEASE);
+}
+
+// Ends a span of the current message that began at start_us (from trace_now)
+static void trace_span(const char* name, long long start_us) {
+    if (trace_current) trace_record(trace_current, name, start_us, now_us(), -1);
+}
+
+// An encoded WebSocket frame, shared by every client it is queued for
+typedef struct Frame {
+    int refs;
+    long len;
+    // Trace of the message that produced this frame, or 0
+    uint64_t trace;
+    // Document whose update this is; its size counts toward that room's budget
+    // until the last queue lets go of it
+    struct Document* room;
+    char data[];
+} Frame;
+
+typedef struct OutFrame {
+    Frame* frame;
+    long long queued_us;
+    struct OutFrame* next;
+} OutFrame;
+
+// Frames wait here until the outbound scheduler writes them; out_sent is how
+// much of the first one is already on the wire
+#define CLIENT_QUEUE_LIMIT (64L << 20)
 
 typedef struct Client {
     int socket;
+    struct Tenant* tenant;
     char username[64];
     char current_file[256];
     int cursor_pos;
     char color[16];
     int active;
+    // Permission bits for perms_file, so checking a message is a bit test
+    int perms;
+    char perms_file[256];
+    // A read-only follower of current_file on a GET /api/stream response: it
+    // only gets that document's updates, as Server-Sent Events
+    int follower;
+    // Whose undo history this connection's edits go into: the authenticated
+    // user, or without authentication (where names are only claimed) the
+    // connection itself
+    char undo_key[64];
+    OutFrame* out_head;
+    OutFrame* out_tail;
+    long out_sent;
+    long out_queued;
+    int out_frames;
+    // Traffic counters for /admin/state: inbound ones are kept by the client's
+    // thread, outbound ones by the outbound scheduler
+    long long connected_ms;
+    long long last_active_ms;
+    long msgs_in;
+    long bytes_in;
+    RateMeter in_rate;
+    long msgs_out;
+    long bytes_out;
+    RateMeter out_rate;
     pthread_mutex_t lock;
     struct Client* next;
 } Client;
@@ -33,504 +540,7511 @@ pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 const char* colors[] = {"#FF6B6B", "#4ECDC4", "#45B7D1", "#FFA07A", "#98D8C8", "#F7DC6F", "#BB8FCE", "#85C1E2", "#FF69B4", "#20B2AA"};
 
-void add_client(Client* client) {
-    pthread_mutex_lock(&clients_mutex);
-    client->next = clients;
-    clients = client;
-    client->active = 1;
-    strcpy(client->color, colors[rand() % 10]);
-    pthread_mutex_init(&client->lock, NULL);
-    pthread_mutex_unlock(&clients_mutex);
-    printf("Client added: %s (socket %d)\n", client->username, client->socket);
+// Polynomial hash of a document under two ~2^26 primes. Small enough for exact
+// double arithmetic in the browser, and a splice can update it without
+// rehashing the whole document.
+typedef struct {
+    uint32_t h1;
+    uint32_t h2;
+} DocHash;
+
+#define DOC_HASH_P1 67108859u
+#define DOC_HASH_P2 67108837u
+#define DOC_HASH_B1 16777619u
+#define DOC_HASH_B2 31337u
+#define DOC_HASH_HISTORY 64
+
+// Undo entry: replacing [offset, offset + inserted) with removed restores the
+// text the edit overwrote. Entries are shifted, clipped, split or dropped as
+// other users edit.
+typedef struct UndoOp {
+    long offset;
+    long inserted;
+    char* removed;
+    long removed_len;
+    long long time_ms;
+    struct UndoOp* next;
+} UndoOp;
+
+// One user's undo and redo stacks for one document, newest entry first. key is
+// the owner's Client undo_key.
+typedef struct UndoStack {
+    char key[64];
+    UndoOp* undo;
+    UndoOp* redo;
+    long bytes;
+    struct UndoStack* next;
+} UndoStack;
+
+#define UNDO_MAX_DEPTH 256
+#define UNDO_USER_BYTES (1L << 20)
+#define UNDO_DOC_BYTES (8L << 20)
+#define UNDO_COALESCE_MS 1000
+
+// Per-document state shared by every request touching the same file.
+// revision bumps whenever the content changes and backs ETag / If-Match.
+// content is the live document: it starts as the file on disk and takes
+// collaborators' edits; dirty means it is ahead of what is persisted.
+typedef struct Document {
+    char name[256];
+    uint64_t persisted_hash;
+    long persisted_size;
+    int hash_known;
+    long revision;
+    char* content;
+    long length;
+    long capacity;
+    int dirty;
+    struct timespec disk_mtime;
+    DocHash live_hash;
+    struct {
+        long revision;
+        DocHash hash;
+    } hash_history[DOC_HASH_HISTORY];
+    int hash_history_next;
+    UndoStack* undo_stacks;
+    long undo_bytes;
+    // A document nobody has touched for DOC_IDLE_MS is kept deflated in packed
+    // (content is NULL, length still the raw size) until it is next loaded
+    unsigned char* packed;
+    long packed_len;
+    long long last_access_ms;
+    // Bytes charged to the tenant's memory quota, see document_account
+    long accounted;
+    long ops;
+    RateMeter op_rate;
+    // Room accounting, see room_bytes: presence entries counted by the last
+    // room_enforce and update frames not yet sent to every subscriber
+    int members;
+    long queued_bytes;
+    // Newest revision sent to followers, see follow_snapshot
+    long streamed_revision;
+    struct Tenant* tenant;
+    pthread_mutex_t lock;
+    struct Document* next;
+} Document;
+
+// Chat history of one room (the file its members have open). Messages are
+// newline-terminated JSON records appended to numbered segment files under
+// <tenant chat dir>/<room hash>/. The index file is mapped into memory: slot 0 holds the
+// message count and slot i + 1 locates message i as segment << 32 | offset, so
+// any page of history is found without scanning the log.
+typedef struct ChatRoom {
+    char name[256];
+    char dir[192];
+    int index_fd;
+    uint64_t* index;
+    long index_slots;
+    int segment_fd;
+    uint32_t segment;
+    long segment_size;
+    pthread_mutex_t lock;
+    struct ChatRoom* next;
+} ChatRoom;
+
+#define CHAT_SEGMENT_BYTES (4L * 1024 * 1024)
+#define CHAT_INDEX_SLOTS 1024
+#define CHAT_MAX_TEXT 4096
+#define CHAT_PAGE_LIMIT 200
+
+// In-memory index of the files tree. Children are kept sorted by name, so a
+// lookup is a binary search per path component. A directory's size, file
+// count and mtime cover everything below it.
+typedef struct FsNode {
+    char* name;
+    int is_dir;
+    long size;
+    long files;
+    time_t mtime;
+    long mtime_nsec;  // files: with mtime, the full st_mtim
+    uint64_t hash;  // xxh64 of the content at this size and mtime, 0 if unknown
+    unsigned seen;  // last index generation that confirmed the node
+    struct FsNode* parent;
+    struct FsNode** children;
+    int child_count;
+    int child_capacity;
+} FsNode;
+
+// A per-second allowance; a rate of 0 means unlimited. Up to one second's
+// worth accumulates while idle.
+typedef struct {
+    double rate;
+    double tokens;
+    long long refilled_ms;
+} TokenBucket;
+
+// Counters behind the compression figures of GET /api/workspace. packed_* are
+// idle documents held deflated in memory right now; stored_* are document
+// bytes saved through a backend that packs values, over all time.
+typedef struct {
+    long packed_docs;
+    long packed_raw_bytes;
+    long packed_bytes;
+    long unpacks;
+    long long unpack_us;
+    long long unpack_max_us;
+    long stored_raw_bytes;
+    long stored_bytes;
+} CompressionStats;
+
+// A workspace: its own files root, document registry, chat rooms, file index
+// and roster. Tenants are read from ./tenants/config at startup and never
+// freed. Quotas cover all of a tenant's clients together: WebSocket
+// connections, bytes of live documents and undo history, outbound WebSocket
+// bandwidth (paid by the outbound scheduler) and CPU time spent handling its
+// requests and messages.
+typedef struct Tenant {
+    char name[64];
+    char chat_dir[128];
+    char index_path[144];
+    // Documents are stored through storage. The filesystem backend reaches
+    // every file through root_fd (./files for the default tenant); others keep
+    // their state in store.
+    const struct StorageBackend* storage;
+    int root_fd;
+    void* store;
+    Document* documents;
+    pthread_mutex_t documents_mutex;
+    ChatRoom* chat_rooms;
+    pthread_mutex_t chat_rooms_mutex;
+    FsNode fs_root;
+    pthread_mutex_t fs_index_mutex;
+    // Index generation and change count (guarded by fs_index_mutex); the
+    // snapshot on disk matches fs_changes == fs_snapshot_changes
+    unsigned fs_generation;
+    long fs_changes;
+    long fs_snapshot_changes;
+    int fs_reconciling;
+    // Comma-separated users allowed in when authentication is on; "*" is anyone
+    char members[512];
+    int max_connections;
+    long max_doc_bytes;
+    int connections;
+    long doc_bytes;
+    TokenBucket bandwidth;
+    TokenBucket cpu;
+    pthread_mutex_t quota_lock;
+    // Preset deflate dictionary trained on the tenant's own small documents
+    // (NULL if there were too few); stats are guarded by quota_lock
+    unsigned char* dict;
+    long dict_len;
+    CompressionStats compression;
+    struct Tenant* next;
+} Tenant;
+
+Tenant* tenants = NULL;
+
+#define DEFAULT_TENANT "default"
+
+// A range of a document's new content that differs from what is stored
+typedef struct {
+    long offset;
+    long len;
+} StorageRange;
+
+// Where a tenant's documents are persisted. Paths are already validated. stat
+// and read fill st_size and st_mtim, and read returns a malloc'd NUL-terminated
+// copy. write stores content as the whole document; ranges, when count > 0,
+// are the only parts of it that changed, which a backend may use to write less.
+// Functions returning int return 0 on success and -1 with errno set.
+typedef struct StorageBackend {
+    const char* name;
+    int (*open)(Tenant* tenant, const char* files_dir);
+    int (*stat)(Tenant* tenant, const char* path, struct stat* st);
+    char* (*read)(Tenant* tenant, const char* path, long* len, struct stat* st);
+    int (*write)(Tenant* tenant, const char* path, const char* content, long len, const StorageRange* ranges, int count);
+    int (*remove)(Tenant* tenant, const char* path);
+    // Adds every stored document to the tenant's file index
+    void (*scan)(Tenant* tenant);
+    // Set if documents are stored deflated with the tenant's dictionary, which
+    // then has to be stored with them under DICT_KEY
+    int packs_values;
+} StorageBackend;
+
+// Reserved key for the dictionary; validated paths never start with \001
+#define DICT_KEY "\001dictionary"
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
 }
 
-void remove_client(int socket) {
-    pthread_mutex_lock(&clients_mutex);
-    Client** curr = &clients;
-    while (*curr) {
-        if ((*curr)->socket == socket) {
-            Client* temp = *curr;
-            *curr = (*curr)->next;
-            printf("Client removed: %s (socket %d)\n", temp->username, temp->socket);
-            pthread_mutex_destroy(&temp->lock);
-            close(temp->socket);
-            free(temp);
-            break;
+static uint64_t xxh_read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t xxh_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 (little-endian hosts), used to recognise saves that would not change the file
+uint64_t xxh64(const void* input, size_t len, uint64_t seed) {
+    const unsigned char* p = input;
+    const unsigned char* end = p + len;
+    uint64_t h64;
+    
+    if (len >= 32) {
+        const unsigned char* limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, xxh_read64(p)); p += 8;
+            v2 = xxh64_round(v2, xxh_read64(p)); p += 8;
+            v3 = xxh64_round(v3, xxh_read64(p)); p += 8;
+            v4 = xxh64_round(v4, xxh_read64(p)); p += 8;
+        } while (p <= limit);
+        h64 = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h64 = xxh64_merge_round(h64, v1);
+        h64 = xxh64_merge_round(h64, v2);
+        h64 = xxh64_merge_round(h64, v3);
+        h64 = xxh64_merge_round(h64, v4);
+    } else {
+        h64 = seed + XXH_PRIME64_5;
+    }
+    
+    h64 += (uint64_t)len;
+    while (p + 8 <= end) {
+        h64 ^= xxh64_round(0, xxh_read64(p));
+        h64 = xxh_rotl64(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h64 ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h64 = xxh_rotl64(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h64 ^= (*p) * XXH_PRIME64_5;
+        h64 = xxh_rotl64(h64, 11) * XXH_PRIME64_1;
+        p++;
+    }
+    
+    h64 ^= h64 >> 33;
+    h64 *= XXH_PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= XXH_PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+Document* get_document(Tenant* tenant, const char* name) {
+    lock_acquire(&tenant->documents_mutex, LOCK_DOCUMENTS);
+    Document* doc = tenant->documents;
+    while (doc && strcmp(doc->name, name) != 0) doc = doc->next;
+    if (!doc) {
+        doc = mem_calloc(MEM_DOCUMENTS, 1, sizeof(Document));
+        snprintf(doc->name, sizeof(doc->name), "%s", name);
+        doc->revision = 1;
+        doc->tenant = tenant;
+        pthread_mutex_init(&doc->lock, NULL);
+        doc->next = tenant->documents;
+        tenant->documents = doc;
+    }
+    lock_release(&tenant->documents_mutex);
+    return doc;
+}
+
+static uint32_t mod_pow(uint64_t base, uint64_t exp, uint32_t p) {
+    uint64_t result = 1;
+    base %= p;
+    while (exp) {
+        if (exp & 1) result = result * base % p;
+        base = base * base % p;
+        exp >>= 1;
+    }
+    return (uint32_t)result;
+}
+
+static uint32_t poly_hash(const unsigned char* s, long n, uint32_t base, uint32_t p) {
+    uint64_t h = 0;
+    for (long i = 0; i < n; i++) h = (h * base + s[i]) % p;
+    return (uint32_t)h;
+}
+
+// H(x || y) = H(x) * B^|y| + H(y). Rehashes whichever of the prefix or suffix is
+// shorter, recovering the other from the old hash, so the cost is the edit size
+// plus min(prefix, suffix) rather than the whole document.
+static uint32_t poly_splice(uint32_t old, const unsigned char* s, long n, long offset, long remove,
+                            const unsigned char* text, long text_len, uint32_t base, uint32_t p) {
+    long suffix_len = n - offset - remove;
+    uint64_t pre, suf;
+    uint64_t mid = poly_hash(s + offset, remove, base, p);
+    if (offset <= suffix_len) {
+        pre = poly_hash(s, offset, base, p);
+        uint64_t pre_mid = (pre * mod_pow(base, remove, p) + mid) % p;
+        suf = (old + p - pre_mid * mod_pow(base, suffix_len, p) % p) % p;
+    } else {
+        suf = poly_hash(s + offset + remove, suffix_len, base, p);
+        uint64_t mid_suf = (mid * mod_pow(base, suffix_len, p) + suf) % p;
+        uint32_t inv_base = mod_pow(base, p - 2, p);
+        pre = (old + p - mid_suf) % p * mod_pow(inv_base, remove + suffix_len, p) % p;
+    }
+    uint64_t ins = poly_hash(text, text_len, base, p);
+    uint64_t h = pre * mod_pow(base, text_len + suffix_len, p) % p;
+    h = (h + ins * mod_pow(base, suffix_len, p)) % p;
+    return (uint32_t)((h + suf) % p);
+}
+
+DocHash doc_hash(const char* s, long n) {
+    DocHash h = {
+        poly_hash((const unsigned char*)s, n, DOC_HASH_B1, DOC_HASH_P1),
+        poly_hash((const unsigned char*)s, n, DOC_HASH_B2, DOC_HASH_P2)
+    };
+    return h;
+}
+
+void doc_hash_format(DocHash h, char* out) {
+    sprintf(out, "%07x%07x", h.h1, h.h2);
+}
+
+// Caller holds doc->lock. Remembers the hash of the current revision so
+// clients reporting a recent revision can be checked in O(1).
+void document_record_revision(Document* doc) {
+    int slot = doc->hash_history_next++ % DOC_HASH_HISTORY;
+    doc->hash_history[slot].revision = doc->revision;
+    doc->hash_history[slot].hash = doc->live_hash;
+}
+
+int document_hash_at(Document* doc, long revision, DocHash* out) {
+    for (int i = 0; i < DOC_HASH_HISTORY && i < doc->hash_history_next; i++) {
+        if (doc->hash_history[i].revision == revision) {
+            *out = doc->hash_history[i].hash;
+            return 0;
         }
-        curr = &(*curr)->next;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    return -1;
+}
+
+// Caller holds doc->lock. Brings the tenant's memory total in line with what
+// the document holds now: its live buffer and undo history.
+void document_account(Document* doc) {
+    long held = doc->capacity + doc->packed_len + doc->undo_bytes;
+    __atomic_add_fetch(&doc->tenant->doc_bytes, held - doc->accounted, __ATOMIC_RELAXED);
+    doc->accounted = held;
+}
+
+// Caller holds doc->lock. Makes the live buffer hold len bytes and the NUL.
+// Returns -1, with the document untouched, if it cannot be allocated.
+int document_grow(Document* doc, long len) {
+    if (len + 1 <= doc->capacity) return 0;
+    long capacity = len + len / 2 + 1;
+    char* content = mem_realloc(MEM_DOCUMENTS, doc->content, capacity);
+    if (!content) return -1;
+    doc->content = content;
+    doc->capacity = capacity;
+    return 0;
+}
+
+// Caller holds doc->lock and has grown the buffer to hold the result (see
+// document_grow), so a splice cannot fail halfway. Replaces [offset, offset +
+// remove) of the live buffer with text, updating the rolling hash incrementally.
+void document_splice(Document* doc, long offset, long remove, const char* text, long text_len) {
+    const unsigned char* s = (const unsigned char*)doc->content;
+    const unsigned char* t = (const unsigned char*)text;
+    doc->live_hash.h1 = poly_splice(doc->live_hash.h1, s, doc->length, offset, remove, t, text_len, DOC_HASH_B1, DOC_HASH_P1);
+    doc->live_hash.h2 = poly_splice(doc->live_hash.h2, s, doc->length, offset, remove, t, text_len, DOC_HASH_B2, DOC_HASH_P2);
+    
+    long new_len = doc->length + text_len - remove;
+    memmove(doc->content + offset + text_len, doc->content + offset + remove, doc->length - offset - remove);
+    memcpy(doc->content + offset, text, text_len);
+    doc->length = new_len;
+    doc->content[new_len] = '\0';
+    document_account(doc);
+    __atomic_store_n(&doc->ops, doc->ops + 1, __ATOMIC_RELAXED);
+    rate_count(&doc->op_rate, now_ms(), 1);
+}
+
+// Raw deflate of data primed with the tenant's dictionary. Returns a malloc'd
+// buffer, or NULL if the result would not be smaller than the input.
+unsigned char* tenant_deflate(Tenant* tenant, const char* data, long len, int level, long* out_len) {
+    z_stream z = {0};
+    if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    if (tenant->dict) deflateSetDictionary(&z, tenant->dict, tenant->dict_len);
+    long cap = deflateBound(&z, len);
+    unsigned char* out = mem_alloc(MEM_OTHER, cap);
+    z.next_in = (unsigned char*)data;
+    z.avail_in = len;
+    z.next_out = out;
+    z.avail_out = cap;
+    int rc = deflate(&z, Z_FINISH);
+    *out_len = cap - z.avail_out;
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END || *out_len >= len) {
+        mem_free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Inverse of tenant_deflate. Returns a malloc'd NUL-terminated buffer of
+// raw_len bytes, or NULL if data is corrupt.
+char* tenant_inflate(Tenant* tenant, const unsigned char* data, long len, long raw_len) {
+    z_stream z = {0};
+    if (inflateInit2(&z, -15) != Z_OK) return NULL;
+    if (tenant->dict) inflateSetDictionary(&z, tenant->dict, tenant->dict_len);
+    char* out = mem_alloc(MEM_OTHER, raw_len + 1);
+    z.next_in = (unsigned char*)data;
+    z.avail_in = len;
+    z.next_out = (unsigned char*)out;
+    z.avail_out = raw_len;
+    int rc = inflate(&z, Z_FINISH);
+    long got = raw_len - z.avail_out;
+    inflateEnd(&z);
+    if (rc != Z_STREAM_END || got != raw_len) {
+        mem_free(out);
+        return NULL;
+    }
+    out[raw_len] = '\0';
+    return out;
+}
+
+#define DOC_IDLE_MS (60 * 1000)
+#define DOC_PACK_MIN 1024
+#define DOC_PACK_INTERVAL 10
+
+// Caller holds doc->lock
+static void document_drop_packed(Document* doc) {
+    if (!doc->packed) return;
+    CompressionStats* stats = &doc->tenant->compression;
+    pthread_mutex_lock(&doc->tenant->quota_lock);
+    stats->packed_docs--;
+    stats->packed_raw_bytes -= doc->length;
+    stats->packed_bytes -= doc->packed_len;
+    pthread_mutex_unlock(&doc->tenant->quota_lock);
+    mem_free(doc->packed);
+    doc->packed = NULL;
+    doc->packed_len = 0;
+}
+
+// Caller holds doc->lock. Swaps the live buffer for its deflated form and
+// returns 1, or 0 if it does not compress.
+static int document_pack(Document* doc) {
+    long packed_len;
+    unsigned char* packed = tenant_deflate(doc->tenant, doc->content, doc->length, Z_DEFAULT_COMPRESSION, &packed_len);
+    if (!packed) return 0;
+    doc->packed = packed;
+    mem_retag(packed, MEM_DOCUMENTS);
+    doc->packed_len = packed_len;
+    mem_free(doc->content);
+    doc->content = NULL;
+    doc->capacity = 0;
+    CompressionStats* stats = &doc->tenant->compression;
+    pthread_mutex_lock(&doc->tenant->quota_lock);
+    stats->packed_docs++;
+    stats->packed_raw_bytes += doc->length;
+    stats->packed_bytes += packed_len;
+    pthread_mutex_unlock(&doc->tenant->quota_lock);
+    document_account(doc);
+    return 1;
+}
+
+// Caller holds doc->lock. Restores the live buffer of a packed document.
+static void document_unpack(Document* doc) {
+    if (!doc->packed) return;
+    long long start = now_us();
+    char* content = tenant_inflate(doc->tenant, doc->packed, doc->packed_len, doc->length);
+    long long took = now_us() - start;
+    document_drop_packed(doc);
+    if (!content) {
+        // Only memory corruption gets here; the stored copy is reloaded instead
+        printf("Could not unpack %s; reloading it\n", doc->name);
+        doc->length = 0;
+        doc->dirty = 0;
+        document_account(doc);
+        return;
+    }
+    doc->content = content;
+    mem_retag(content, MEM_DOCUMENTS);
+    doc->capacity = doc->length + 1;
+    CompressionStats* stats = &doc->tenant->compression;
+    pthread_mutex_lock(&doc->tenant->quota_lock);
+    stats->unpacks++;
+    stats->unpack_us += took;
+    if (took > stats->unpack_max_us) stats->unpack_max_us = took;
+    pthread_mutex_unlock(&doc->tenant->quota_lock);
+    document_account(doc);
+}
+
+static long undo_op_size(UndoOp* op) {
+    return sizeof(UndoOp) + op->removed_len;
+}
+
+static void undo_free_list(UndoStack* stack, Document* doc, UndoOp* op) {
+    while (op) {
+        UndoOp* next = op->next;
+        stack->bytes -= undo_op_size(op);
+        doc->undo_bytes -= undo_op_size(op);
+        mem_free(op->removed);
+        mem_free(op);
+        op = next;
+    }
+}
+
+static void undo_push(UndoStack* stack, Document* doc, UndoOp** list, UndoOp* op) {
+    op->next = *list;
+    *list = op;
+    stack->bytes += undo_op_size(op);
+    doc->undo_bytes += undo_op_size(op);
+}
+
+static UndoOp* undo_pop(UndoStack* stack, Document* doc, UndoOp** list) {
+    UndoOp* op = *list;
+    if (!op) return NULL;
+    *list = op->next;
+    stack->bytes -= undo_op_size(op);
+    doc->undo_bytes -= undo_op_size(op);
+    return op;
+}
+
+// Drops the oldest undo entry of the stack, or the redo entries once there are
+// no undo entries left. Returns 0 when the stack is empty.
+static int undo_drop_oldest(UndoStack* stack, Document* doc) {
+    UndoOp** tail = stack->undo ? &stack->undo : &stack->redo;
+    if (!*tail) return 0;
+    if (tail == &stack->redo) {
+        undo_free_list(stack, doc, stack->redo);
+        stack->redo = NULL;
+        return 1;
+    }
+    while ((*tail)->next) tail = &(*tail)->next;
+    undo_free_list(stack, doc, *tail);
+    *tail = NULL;
+    return 1;
+}
+
+// Drops the oldest history of whichever user holds the most until the
+// document's history fits in limit bytes
+static void undo_shrink(Document* doc, long limit) {
+    while (doc->undo_bytes > limit) {
+        UndoStack* largest = doc->undo_stacks;
+        for (UndoStack* s = doc->undo_stacks; s; s = s->next) {
+            if (s->bytes > largest->bytes) largest = s;
+        }
+        if (!largest || !undo_drop_oldest(largest, doc)) break;
+    }
+}
+
+// Enforces the per-user depth and byte limits on stack, then the per-document
+// byte limit
+static void undo_trim(Document* doc, UndoStack* stack) {
+    int depth = 0;
+    for (UndoOp* op = stack->undo; op; op = op->next) depth++;
+    while (depth > UNDO_MAX_DEPTH || stack->bytes > UNDO_USER_BYTES) {
+        if (!undo_drop_oldest(stack, doc)) break;
+        if (depth > 0) depth--;
+    }
+    undo_shrink(doc, UNDO_DOC_BYTES);
+}
+
+UndoStack* undo_stack_for(Document* doc, const char* key) {
+    UndoStack* stack = doc->undo_stacks;
+    while (stack && strcmp(stack->key, key) != 0) stack = stack->next;
+    if (!stack) {
+        stack = mem_calloc(MEM_HISTORY, 1, sizeof(UndoStack));
+        snprintf(stack->key, sizeof(stack->key), "%s", key);
+        stack->next = doc->undo_stacks;
+        doc->undo_stacks = stack;
+    }
+    return stack;
+}
+
+// Caller holds doc->lock. Forgets all history, e.g. when the file is replaced
+// underneath the live buffer and old offsets mean nothing.
+void undo_clear(Document* doc) {
+    while (doc->undo_stacks) {
+        UndoStack* stack = doc->undo_stacks;
+        doc->undo_stacks = stack->next;
+        undo_free_list(stack, doc, stack->undo);
+        undo_free_list(stack, doc, stack->redo);
+        mem_free(stack);
+    }
+}
+
+// Moves one entry across someone else's splice of [offset, offset + remove) by
+// text_len bytes. Text of ours the splice overwrote is no longer ours to
+// remove, so the entry shrinks to what survives. Returns 0 when the splice
+// covers the entry, which is then dropped, and 2 when it lands inside our
+// text: the entry keeps the part before it and *tail_offset, *tail_len get
+// the part after it, to be removed by an entry of its own.
+static int undo_op_transform(UndoOp* op, long offset, long remove, long text_len, long* tail_offset, long* tail_len) {
+    long start = op->offset, end = op->offset + op->inserted;
+    if (offset + remove <= start) {
+        op->offset += text_len - remove;
+        return 1;
+    }
+    if (offset >= end) return 1;
+    if (offset <= start && offset + remove >= end) return 0;
+    if (offset <= start) {
+        // Overwrites our beginning: what is left follows their text
+        op->offset = offset + text_len;
+        op->inserted = end - (offset + remove);
+        return 1;
+    }
+    op->inserted = offset - start;
+    if (offset + remove >= end) return 1;
+    *tail_offset = offset + text_len;
+    *tail_len = end - (offset + remove);
+    return 2;
+}
+
+static void undo_transform_list(UndoStack* stack, Document* doc, UndoOp** list,
+                                long offset, long remove, long text_len) {
+    while (*list) {
+        UndoOp* op = *list;
+        long tail_offset, tail_len;
+        int kept = undo_op_transform(op, offset, remove, text_len, &tail_offset, &tail_len);
+        if (kept == 2) {
+            // The tail lies after op's text, so it is undone first and op's
+            // offset still holds when op's turn comes
+            UndoOp* tail = mem_calloc(MEM_HISTORY, 1, sizeof(UndoOp));
+            tail->offset = tail_offset;
+            tail->inserted = tail_len;
+            tail->removed = mem_alloc(MEM_HISTORY, 1);
+            tail->time_ms = op->time_ms;
+            undo_push(stack, doc, list, tail);
+            list = &op->next;
+            continue;
+        }
+        if (kept) {
+            list = &op->next;
+            continue;
+        }
+        *list = op->next;
+        op->next = NULL;
+        undo_free_list(stack, doc, op);
+    }
+}
+
+// Caller holds doc->lock, before the splice is applied. author (an undo key)'s own
+// entries are already relative to their edit order; everyone else's are transformed.
+void undo_transform(Document* doc, const char* author, long offset, long remove, long text_len) {
+    for (UndoStack* stack = doc->undo_stacks; stack; stack = stack->next) {
+        if (author && strcmp(stack->key, author) == 0) continue;
+        undo_transform_list(stack, doc, &stack->undo, offset, remove, text_len);
+        undo_transform_list(stack, doc, &stack->redo, offset, remove, text_len);
+    }
+}
+
+// Caller holds doc->lock, before the splice is applied. Pushes the inverse of
+// author's edit, merging it into the previous entry when it continues a run of
+// typing or backspacing. A new edit invalidates author's redo history.
+void undo_record(Document* doc, const char* author, long offset, long remove, const char* text, long text_len) {
+    UndoStack* stack = undo_stack_for(doc, author);
+    undo_free_list(stack, doc, stack->redo);
+    stack->redo = NULL;
+    
+    if (sizeof(UndoOp) + remove > UNDO_USER_BYTES) {
+        // Too large to keep: treat it like anyone else's edit
+        undo_transform_list(stack, doc, &stack->undo, offset, remove, text_len);
+        return;
+    }
+    
+    long long now = now_ms();
+    UndoOp* top = stack->undo;
+    if (top && now - top->time_ms < UNDO_COALESCE_MS &&
+        !memchr(doc->content + offset, '\n', remove) && !memchr(text, '\n', text_len)) {
+        if (remove == 0 && top->removed_len == 0 && offset == top->offset + top->inserted) {
+            top->inserted += text_len;
+            top->time_ms = now;
+            return;
+        }
+        if (text_len == 0 && top->inserted == 0 && offset + remove == top->offset) {
+            top->removed = mem_realloc(MEM_HISTORY, top->removed, top->removed_len + remove);
+            memmove(top->removed + remove, top->removed, top->removed_len);
+            memcpy(top->removed, doc->content + offset, remove);
+            top->removed_len += remove;
+            top->offset = offset;
+            top->time_ms = now;
+            stack->bytes += remove;
+            doc->undo_bytes += remove;
+            undo_trim(doc, stack);
+            return;
+        }
+    }
+    
+    UndoOp* op = mem_calloc(MEM_HISTORY, 1, sizeof(UndoOp));
+    op->offset = offset;
+    op->inserted = text_len;
+    op->removed = mem_alloc(MEM_HISTORY, remove ? remove : 1);
+    memcpy(op->removed, doc->content + offset, remove);
+    op->removed_len = remove;
+    op->time_ms = now;
+    undo_push(stack, doc, &stack->undo, op);
+    undo_trim(doc, stack);
+}
+
+// Caller holds doc->lock. Applies the newest entry of key's undo (or redo)
+// stack and pushes its inverse onto the other stack. Returns 0 if there was
+// nothing to apply and -1, leaving the entry on its stack, if the buffer could
+// not grow.
+int document_undo(Document* doc, const char* key, int redo) {
+    UndoStack* stack = undo_stack_for(doc, key);
+    UndoOp** list = redo ? &stack->redo : &stack->undo;
+    UndoOp* op = undo_pop(stack, doc, list);
+    if (!op) return 0;
+    if (op->offset + op->inserted > doc->length) {
+        mem_free(op->removed);
+        mem_free(op);
+        return 0;
+    }
+    if (document_grow(doc, doc->length - op->inserted + op->removed_len) != 0) {
+        undo_push(stack, doc, list, op);
+        return -1;
+    }
+    
+    UndoOp* inverse = mem_calloc(MEM_HISTORY, 1, sizeof(UndoOp));
+    inverse->offset = op->offset;
+    inverse->inserted = op->removed_len;
+    inverse->removed = mem_alloc(MEM_HISTORY, op->inserted ? op->inserted : 1);
+    memcpy(inverse->removed, doc->content + op->offset, op->inserted);
+    inverse->removed_len = op->inserted;
+    
+    undo_transform(doc, key, op->offset, op->inserted, op->removed_len);
+    document_splice(doc, op->offset, op->inserted, op->removed, op->removed_len);
+    doc->revision++;
+    document_record_revision(doc);
+    undo_push(stack, doc, redo ? &stack->undo : &stack->redo, inverse);
+    undo_trim(doc, stack);
+    document_account(doc);
+    mem_free(op->removed);
+    mem_free(op);
+    return 1;
+}
+
+// Caller holds doc->lock. Makes the live buffer equal to text by splicing only
+// the range between the common prefix and suffix. Returns 1 if anything changed,
+// 0 if not, and -1, with nothing changed, if the buffer could not grow.
+// author, when known, can later undo the edit.
+int document_replace(Document* doc, const char* text, long len, const char* author) {
+    long max = doc->length < len ? doc->length : len;
+    long start = 0;
+    while (start < max && doc->content[start] == text[start]) start++;
+    long old_end = doc->length, new_end = len;
+    while (old_end > start && new_end > start && doc->content[old_end - 1] == text[new_end - 1]) {
+        old_end--;
+        new_end--;
+    }
+    if (start == old_end && start == new_end) return 0;
+    if (document_grow(doc, len) != 0) return -1;
+    
+    undo_transform(doc, author, start, old_end - start, new_end - start);
+    if (author) undo_record(doc, author, start, old_end - start, text + start, new_end - start);
+    document_splice(doc, start, old_end - start, text + start, new_end - start);
+    doc->revision++;
+    document_record_revision(doc);
+    return 1;
+}
+
+// Per-room memory budget in bytes, set in MiB with --room-budget; 0 leaves
+// rooms limited only by their workspace's quota
+static long room_budget = 256L << 20;
+
+// Caller holds doc->lock. Makes room in the tenant's memory quota for doc to
+// grow by growth bytes, dropping the cached buffers (and undo history) of the
+// tenant's other clean documents if needed; they reload from disk on next use.
+// Returns -1 if the quota would still be exceeded, or if the buffer alone
+// would outgrow the room budget.
+int document_reserve(Document* doc, long growth) {
+    Tenant* tenant = doc->tenant;
+    if (room_budget && growth > 0 && doc->capacity + growth > room_budget) {
+        printf("Room %s/%s: %ld bytes would exceed the room budget\n", tenant->name, doc->name, doc->capacity + growth);
+        return -1;
+    }
+    long limit = tenant->max_doc_bytes;
+    if (!limit || growth <= 0 || __atomic_load_n(&tenant->doc_bytes, __ATOMIC_RELAXED) + growth <= limit) return 0;
+    
+    lock_acquire(&tenant->documents_mutex, LOCK_DOCUMENTS);
+    for (Document* other = tenant->documents; other; other = other->next) {
+        if (__atomic_load_n(&tenant->doc_bytes, __ATOMIC_RELAXED) + growth <= limit) break;
+        // Busy documents are skipped, which also keeps this from deadlocking on doc->lock order
+        if (other == doc || lock_try(&other->lock, LOCK_DOCUMENT) != 0) continue;
+        if (!other->dirty && (other->content || other->packed)) {
+            document_drop_packed(other);
+            mem_free(other->content);
+            other->content = NULL;
+            other->length = other->capacity = 0;
+            undo_clear(other);
+            document_account(other);
+        }
+        lock_release(&other->lock);
+    }
+    lock_release(&tenant->documents_mutex);
+    return __atomic_load_n(&tenant->doc_bytes, __ATOMIC_RELAXED) + growth <= limit ? 0 : -1;
+}
+
+// A file path is relative, '/'-separated, and has no empty, "." or ".."
+// components, so it cannot name anything outside the root
+int valid_path(const char* path) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= 256 || path[0] == '/' || path[len - 1] == '/') return 0;
+    const char* p = path;
+    while (*p) {
+        size_t n = strcspn(p, "/");
+        if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.')) return 0;
+        for (size_t i = 0; i < n; i++) {
+            if ((unsigned char)p[i] < 0x20 || p[i] == '\\') return 0;
+        }
+        p += n;
+        if (*p == '/') p++;
+    }
+    return 1;
+}
+
+// Opens the directory holding the last component of path, one component at a
+// time with O_NOFOLLOW so a symlink cannot lead out of the root. Missing
+// directories are created when create is set. Returns the directory fd (to be
+// released with root_release) and points *leaf at the last component.
+static int root_parent(Tenant* tenant, const char* path, int create, const char** leaf) {
+    if (!valid_path(path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int dir = tenant->root_fd;
+    const char* p = path;
+    const char* slash;
+    while ((slash = strchr(p, '/'))) {
+        char name[256];
+        memcpy(name, p, slash - p);
+        name[slash - p] = '\0';
+        int next = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (next < 0 && errno == ENOENT && create && mkdirat(dir, name, 0755) == 0) {
+            next = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        }
+        if (dir != tenant->root_fd) close(dir);
+        if (next < 0) return -1;
+        dir = next;
+        p = slash + 1;
+    }
+    *leaf = p;
+    return dir;
+}
+
+static void root_release(Tenant* tenant, int dir) {
+    int saved = errno;
+    if (dir != tenant->root_fd) close(dir);
+    errno = saved;
+}
+
+int root_open(Tenant* tenant, const char* path, int flags, mode_t mode) {
+    const char* leaf;
+    int dir = root_parent(tenant, path, flags & O_CREAT, &leaf);
+    if (dir < 0) return -1;
+    int fd = openat(dir, leaf, flags | O_NOFOLLOW, mode);
+    root_release(tenant, dir);
+    return fd;
+}
+
+// Like stat(), but only regular files count as existing
+int root_stat(Tenant* tenant, const char* path, struct stat* st) {
+    const char* leaf;
+    int dir = root_parent(tenant, path, 0, &leaf);
+    if (dir < 0) return -1;
+    int rc = fstatat(dir, leaf, st, AT_SYMLINK_NOFOLLOW);
+    root_release(tenant, dir);
+    if (rc == 0 && !S_ISREG(st->st_mode)) {
+        errno = ENOENT;
+        return -1;
+    }
+    return rc;
+}
+
+int root_unlink(Tenant* tenant, const char* path) {
+    const char* leaf;
+    int dir = root_parent(tenant, path, 0, &leaf);
+    if (dir < 0) return -1;
+    int rc = unlinkat(dir, leaf, 0);
+    root_release(tenant, dir);
+    return rc;
+}
+
+// Caller holds the tenant's fs_index_mutex. Binary search for name among dir's
+// children; *pos is where it is or would be inserted.
+static FsNode* fs_find_child(FsNode* dir, const char* name, size_t len, int* pos) {
+    int lo = 0, hi = dir->child_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strncmp(dir->children[mid]->name, name, len);
+        if (cmp == 0 && dir->children[mid]->name[len] != '\0') cmp = 1;
+        if (cmp == 0) {
+            *pos = mid;
+            return dir->children[mid];
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return NULL;
+}
+
+static FsNode* fs_add_child(FsNode* dir, const char* name, size_t len, int is_dir, int pos) {
+    if (dir->child_count == dir->child_capacity) {
+        dir->child_capacity = dir->child_capacity ? dir->child_capacity * 2 : 8;
+        dir->children = mem_realloc(MEM_INDEXES, dir->children, dir->child_capacity * sizeof(FsNode*));
+    }
+    memmove(&dir->children[pos + 1], &dir->children[pos], (dir->child_count - pos) * sizeof(FsNode*));
+    FsNode* node = mem_calloc(MEM_INDEXES, 1, sizeof(FsNode));
+    node->name = mem_strndup(MEM_INDEXES, name, len);
+    node->is_dir = is_dir;
+    node->parent = dir;
+    dir->children[pos] = node;
+    dir->child_count++;
+    return node;
+}
+
+// Caller holds the tenant's fs_index_mutex. Walks path ("" is root) from root,
+// creating missing nodes when created is non-NULL (and then set if the last one
+// was new); the last component is a directory if leaf_dir.
+static FsNode* fs_walk(FsNode* root, const char* path, int* created, int leaf_dir) {
+    FsNode* node = root;
+    const char* p = path;
+    while (*p) {
+        size_t n = strcspn(p, "/");
+        int last = p[n] == '\0';
+        int pos;
+        FsNode* child = fs_find_child(node, p, n, &pos);
+        if (!child) {
+            if (!created) return NULL;
+            child = fs_add_child(node, p, n, last ? leaf_dir : 1, pos);
+            if (last) *created = 1;
+        }
+        if (!last && !child->is_dir) return NULL;
+        node = child;
+        p += n;
+        if (*p == '/') p++;
+    }
+    return node;
+}
+
+static void fs_propagate(FsNode* node, long size_delta, long files_delta, time_t mtime) {
+    for (FsNode* dir = node->parent; dir; dir = dir->parent) {
+        dir->size += size_delta;
+        dir->files += files_delta;
+        if (mtime > dir->mtime) dir->mtime = mtime;
+    }
+}
+
+// Records that the file at path now has the given size and mtime
+void fs_index_update(Tenant* tenant, const char* path, long size, struct timespec mtime) {
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    int created = 0;
+    FsNode* node = fs_walk(&tenant->fs_root, path, &created, 0);
+    if (node && !node->is_dir) {
+        fs_propagate(node, size - node->size, created, mtime.tv_sec);
+        if (node->size != size || node->mtime != mtime.tv_sec || node->mtime_nsec != mtime.tv_nsec) {
+            node->hash = 0;
+            tenant->fs_changes++;
+        }
+        node->size = size;
+        node->mtime = mtime.tv_sec;
+        node->mtime_nsec = mtime.tv_nsec;
+        node->seen = tenant->fs_generation;
+    }
+    lock_release(&tenant->fs_index_mutex);
+}
+
+// Records the content hash of the file at path, if the index still has it
+// at that size and mtime. As in git's racy-clean check, a file modified in the
+// current second is left unknown: a later write within the same timestamp
+// granularity would not change its size or mtime.
+void fs_index_set_hash(Tenant* tenant, const char* path, long size, struct timespec mtime, uint64_t hash) {
+    if (mtime.tv_sec >= time(NULL)) return;
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    FsNode* node = fs_walk(&tenant->fs_root, path, NULL, 0);
+    if (node && !node->is_dir && node->size == size && node->mtime == mtime.tv_sec &&
+        node->mtime_nsec == mtime.tv_nsec && node->hash != hash) {
+        node->hash = hash;
+        tenant->fs_changes++;
+    }
+    lock_release(&tenant->fs_index_mutex);
+}
+
+// Looks up the recorded hash of the file at path at that size and mtime.
+// Returns -1 if there is none.
+int fs_index_get_hash(Tenant* tenant, const char* path, long size, struct timespec mtime, uint64_t* hash) {
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    FsNode* node = fs_walk(&tenant->fs_root, path, NULL, 0);
+    int found = node && !node->is_dir && node->hash && node->size == size &&
+        node->mtime == mtime.tv_sec && node->mtime_nsec == mtime.tv_nsec;
+    if (found) *hash = node->hash;
+    lock_release(&tenant->fs_index_mutex);
+    return found ? 0 : -1;
+}
+
+void fs_index_mkdir(Tenant* tenant, const char* path, time_t mtime) {
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    int created = 0;
+    FsNode* node = fs_walk(&tenant->fs_root, path, &created, 1);
+    if (node && node->mtime < mtime) node->mtime = mtime;
+    if (node) node->seen = tenant->fs_generation;
+    tenant->fs_changes += created;
+    lock_release(&tenant->fs_index_mutex);
+}
+
+void fs_index_remove(Tenant* tenant, const char* path) {
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    FsNode* node = fs_walk(&tenant->fs_root, path, NULL, 0);
+    if (node && !node->is_dir) {
+        fs_propagate(node, -node->size, -1, time(NULL));
+        FsNode* dir = node->parent;
+        int pos;
+        fs_find_child(dir, node->name, strlen(node->name), &pos);
+        memmove(&dir->children[pos], &dir->children[pos + 1], (dir->child_count - pos - 1) * sizeof(FsNode*));
+        dir->child_count--;
+        mem_free(node->name);
+        mem_free(node);
+        tenant->fs_changes++;
+    }
+    lock_release(&tenant->fs_index_mutex);
+}
+
+// Caller holds the tenant's fs_index_mutex. Drops the nodes under dir that
+// the given generation did not see, keeping directories with anything left in
+// them. Returns the number of files dropped.
+static long fs_index_sweep(FsNode* dir, unsigned generation) {
+    long dropped = 0;
+    int kept = 0;
+    for (int i = 0; i < dir->child_count; i++) {
+        FsNode* node = dir->children[i];
+        if (node->is_dir) dropped += fs_index_sweep(node, generation);
+        if (node->seen == generation || node->child_count > 0) {
+            dir->children[kept++] = node;
+            continue;
+        }
+        if (!node->is_dir) {
+            fs_propagate(node, -node->size, -1, 0);
+            dropped++;
+        }
+        mem_free(node->children);
+        mem_free(node->name);
+        mem_free(node);
+    }
+    dir->child_count = kept;
+    return dropped;
+}
+
+// Builds the index from disk at startup. dir is consumed.
+void fs_index_scan(Tenant* tenant, int dir, const char* prefix) {
+    DIR* d = fdopendir(dir);
+    if (!d) {
+        close(dir);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] ? "/" : "", entry->d_name);
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || !valid_path(path)) continue;
+        struct stat st;
+        if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            fs_index_mkdir(tenant, path, st.st_mtime);
+            int sub = openat(dirfd(d), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub >= 0) fs_index_scan(tenant, sub, path);
+        } else if (S_ISREG(st.st_mode)) {
+            fs_index_update(tenant, path, st.st_size, st.st_mtim);
+        }
+    }
+    closedir(d);
+}
+
+int pwrite_all(int fd, const char* data, long len, long offset) {
+    while (len > 0) {
+        long written = pwrite(fd, data, len, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int fs_storage_open(Tenant* tenant, const char* files_dir) {
+    mkdir(files_dir, 0755);
+    tenant->root_fd = open(files_dir, O_RDONLY | O_DIRECTORY);
+    return tenant->root_fd < 0 ? -1 : 0;
+}
+
+static char* fs_storage_read(Tenant* tenant, const char* path, long* len, struct stat* st) {
+    flight_event(FLIGHT_LOAD, -1, 0, path, strlen(path));
+    int fd = root_open(tenant, path, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+    char* content = mem_alloc(MEM_OTHER, st->st_size + 1);
+    long got = 0;
+    while (got < st->st_size) {
+        long n = read(fd, content + got, st->st_size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    content[got] = '\0';
+    *len = got;
+    return content;
+}
+
+static int fs_storage_write(Tenant* tenant, const char* path, const char* content, long len,
+                            const StorageRange* ranges, int count) {
+    flight_event(FLIGHT_STORE, -1, len, path, strlen(path));
+    int fd = root_open(tenant, path, O_WRONLY | O_CREAT | (count ? 0 : O_TRUNC), 0644);
+    if (fd < 0) return -1;
+    int ok = 1;
+    if (count == 0) {
+        ok = pwrite_all(fd, content, len, 0) == 0;
+    } else {
+        for (int i = 0; i < count && ok; i++) {
+            ok = pwrite_all(fd, content + ranges[i].offset, ranges[i].len, ranges[i].offset) == 0;
+        }
+        ok = ok && ftruncate(fd, len) == 0;
+    }
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return ok ? 0 : -1;
+}
+
+static void fs_storage_scan(Tenant* tenant) {
+    fs_index_scan(tenant, dup(tenant->root_fd), "");
+}
+
+// One file per document under the tenant's files directory
+const StorageBackend fs_storage = {
+    "fs", fs_storage_open, root_stat, fs_storage_read, fs_storage_write, root_unlink, fs_storage_scan, 0
+};
+
+// Log-structured key-value store in one memory-mapped file (<files dir>.kv).
+// Every save appends a record, and the newest record for a key wins; removal
+// appends a tombstone. An in-memory hash table maps each live key to its
+// record, so opening a document is a lookup and a copy out of the mapping and
+// listing never touches the disk. A torn record at the tail (bad checksum) ends
+// the log on open. Once dead records are most of a large file, the live ones
+// are rewritten into a fresh file. Documents of KV_DEFLATE_MIN bytes or more
+// are stored deflated with the tenant's dictionary (KV_MAGIC_DEFLATE), their
+// value being the raw length as 8 bytes followed by the deflate stream.
+#define KV_MAGIC 0x314C564Bu
+#define KV_MAGIC_DEFLATE 0x324C564Bu
+#define KV_DEFLATE_MIN 128
+#define KV_DEFLATE_LEVEL 3
+#define KV_MAP_RESERVE (64L << 20)
+#define KV_COMPACT_MIN (16L << 20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len;
+    int64_t value_len;  // -1 for a tombstone
+    int64_t mtime_ns;
+    uint64_t checksum;  // xxh64 of the value, seeded with that of the key
+} KvRecord;
+
+typedef struct KvEntry {
+    char* key;
+    uint64_t hash;
+    long offset;
+    long value_len;
+    long stored_len;
+    int deflated;
+    struct timespec mtime;
+    struct KvEntry* next;
+} KvEntry;
+
+typedef struct {
+    char path[256];
+    int fd;
+    char* map;
+    long map_size;
+    long end;
+    long live_bytes;
+    KvEntry** buckets;
+    long bucket_count;
+    long entries;
+    pthread_mutex_t lock;
+} KvStore;
+
+static long kv_record_size(long key_len, long value_len) {
+    return (sizeof(KvRecord) + key_len + (value_len > 0 ? value_len : 0) + 7) & ~7L;
+}
+
+// Caller holds store->lock
+static KvEntry** kv_slot(KvStore* store, const char* key, uint64_t hash) {
+    KvEntry** slot = &store->buckets[hash & (store->bucket_count - 1)];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) slot = &(*slot)->next;
+    return slot;
+}
+
+// Caller holds store->lock. Points key at rec, the record at offset holding
+// a value_len byte document, or drops it for a tombstone.
+static void kv_index(KvStore* store, const char* key, long offset, const KvRecord* rec, long value_len) {
+    uint64_t hash = xxh64(key, strlen(key), 0);
+    KvEntry** slot = kv_slot(store, key, hash);
+    KvEntry* entry = *slot;
+    if (entry) store->live_bytes -= kv_record_size(strlen(key), entry->stored_len);
+    if (rec->value_len < 0) {
+        if (entry) {
+            *slot = entry->next;
+            mem_free(entry->key);
+            mem_free(entry);
+            store->entries--;
+        }
+        return;
+    }
+    if (!entry) {
+        if (store->entries >= store->bucket_count) {
+            long count = store->bucket_count * 2;
+            KvEntry** buckets = mem_calloc(MEM_INDEXES, count, sizeof(KvEntry*));
+            for (long i = 0; i < store->bucket_count; i++) {
+                while (store->buckets[i]) {
+                    KvEntry* moved = store->buckets[i];
+                    store->buckets[i] = moved->next;
+                    moved->next = buckets[moved->hash & (count - 1)];
+                    buckets[moved->hash & (count - 1)] = moved;
+                }
+            }
+            mem_free(store->buckets);
+            store->buckets = buckets;
+            store->bucket_count = count;
+            slot = kv_slot(store, key, hash);
+        }
+        entry = mem_calloc(MEM_INDEXES, 1, sizeof(KvEntry));
+        entry->key = mem_strdup(MEM_INDEXES, key);
+        entry->hash = hash;
+        *slot = entry;
+        store->entries++;
+    }
+    entry->offset = offset;
+    entry->value_len = value_len;
+    entry->stored_len = rec->value_len;
+    entry->deflated = rec->magic == KV_MAGIC_DEFLATE;
+    entry->mtime.tv_sec = rec->mtime_ns / 1000000000;
+    entry->mtime.tv_nsec = rec->mtime_ns % 1000000000;
+    store->live_bytes += kv_record_size(strlen(key), rec->value_len);
+}
+
+// Caller holds store->lock. Maps the file so that size bytes are reachable;
+// the mapping may extend past the end of the file, which is only read below it.
+static int kv_map(KvStore* store, long size) {
+    if (store->map && size <= store->map_size) return 0;
+    long map_size = size + size / 2 > KV_MAP_RESERVE ? size + size / 2 : KV_MAP_RESERVE;
+    char* map = store->map ? mremap(store->map, store->map_size, map_size, MREMAP_MAYMOVE)
+                           : mmap(NULL, map_size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) return -1;
+    store->map = map;
+    store->map_size = map_size;
+    return 0;
+}
+
+static int kv_storage_open(Tenant* tenant, const char* files_dir) {
+    KvStore* store = mem_calloc(MEM_INDEXES, 1, sizeof(KvStore));
+    snprintf(store->path, sizeof(store->path), "%s.kv", files_dir);
+    store->fd = open(store->path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (store->fd < 0 || fstat(store->fd, &st) != 0 || kv_map(store, st.st_size) != 0) {
+        int saved = errno;
+        if (store->fd >= 0) close(store->fd);
+        mem_free(store);
+        errno = saved;
+        return -1;
+    }
+    store->bucket_count = 1024;
+    store->buckets = mem_calloc(MEM_INDEXES, store->bucket_count, sizeof(KvEntry*));
+    pthread_mutex_init(&store->lock, NULL);
+    
+    long offset = 0;
+    while (offset + (long)sizeof(KvRecord) <= st.st_size) {
+        KvRecord rec;
+        memcpy(&rec, store->map + offset, sizeof(rec));
+        long size = kv_record_size(rec.key_len, rec.value_len);
+        int deflated = rec.magic == KV_MAGIC_DEFLATE;
+        if ((rec.magic != KV_MAGIC && !deflated) || rec.key_len == 0 || rec.key_len >= 256 ||
+            rec.value_len < (deflated ? 8 : -1) || offset + size > st.st_size) {
+            break;
+        }
+        const char* key = store->map + offset + sizeof(KvRecord);
+        long value_len = rec.value_len > 0 ? rec.value_len : 0;
+        if (xxh64(key + rec.key_len, value_len, xxh64(key, rec.key_len, 0)) != rec.checksum) break;
+        char name[256];
+        memcpy(name, key, rec.key_len);
+        name[rec.key_len] = '\0';
+        int64_t raw_len = rec.value_len;
+        if (deflated) memcpy(&raw_len, key + rec.key_len, sizeof(raw_len));
+        kv_index(store, name, offset, &rec, raw_len);
+        offset += size;
+    }
+    if (offset < st.st_size) {
+        printf("%s: discarding %ld bytes after the last complete record\n", store->path, (long)st.st_size - offset);
+        if (ftruncate(store->fd, offset) != 0) printf("%s: truncate failed: %s\n", store->path, strerror(errno));
+    }
+    store->end = offset;
+    tenant->store = store;
+    return 0;
+}
+
+static int kv_storage_stat(Tenant* tenant, const char* path, struct stat* st) {
+    KvStore* store = tenant->store;
+    lock_acquire(&store->lock, LOCK_KV_STORE);
+    KvEntry* entry = *kv_slot(store, path, xxh64(path, strlen(path), 0));
+    if (entry) {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFREG | 0644;
+        st->st_size = entry->value_len;
+        st->st_mtim = entry->mtime;
+    }
+    lock_release(&store->lock);
+    if (!entry) errno = ENOENT;
+    return entry ? 0 : -1;
+}
+
+static char* kv_storage_read(Tenant* tenant, const char* path, long* len, struct stat* st) {
+    flight_event(FLIGHT_LOAD, -1, 0, path, strlen(path));
+    KvStore* store = tenant->store;
+    lock_acquire(&store->lock, LOCK_KV_STORE);
+    KvEntry* entry = *kv_slot(store, path, xxh64(path, strlen(path), 0));
+    char* content = NULL;
+    if (entry) {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFREG | 0644;
+        st->st_size = entry->value_len;
+        st->st_mtim = entry->mtime;
+        const char* value = store->map + entry->offset + sizeof(KvRecord) + strlen(path);
+        if (entry->deflated) {
+            content = tenant_inflate(tenant, (const unsigned char*)value + 8, entry->stored_len - 8, entry->value_len);
+        } else {
+            content = mem_alloc(MEM_OTHER, entry->value_len + 1);
+            memcpy(content, value, entry->value_len);
+            content[entry->value_len] = '\0';
+        }
+        *len = entry->value_len;
+    }
+    lock_release(&store->lock);
+    if (!entry) errno = ENOENT;
+    else if (!content) errno = EIO;
+    return content;
+}
+
+// Caller holds store->lock. Copies the live records into a fresh file and
+// swaps it in; on any failure the old file stays in use.
+static void kv_compact(KvStore* store) {
+    char tmp_path[272];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    long* offsets = mem_alloc(MEM_OTHER, store->entries * sizeof(long));
+    long offset = 0, n = 0;
+    int ok = 1;
+    for (long i = 0; i < store->bucket_count && ok; i++) {
+        for (KvEntry* entry = store->buckets[i]; entry && ok; entry = entry->next) {
+            long size = kv_record_size(strlen(entry->key), entry->stored_len);
+            ok = pwrite_all(fd, store->map + entry->offset, size, offset) == 0;
+            offsets[n++] = offset;
+            offset += size;
+        }
+    }
+    long map_size = offset + offset / 2 > KV_MAP_RESERVE ? offset + offset / 2 : KV_MAP_RESERVE;
+    char* map = ok && fsync(fd) == 0 ? mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED || rename(tmp_path, store->path) != 0) {
+        printf("%s: compaction failed: %s\n", store->path, strerror(errno));
+        if (map != MAP_FAILED) munmap(map, map_size);
+        close(fd);
+        unlink(tmp_path);
+        mem_free(offsets);
+        return;
+    }
+    n = 0;
+    for (long i = 0; i < store->bucket_count; i++) {
+        for (KvEntry* entry = store->buckets[i]; entry; entry = entry->next) entry->offset = offsets[n++];
+    }
+    mem_free(offsets);
+    munmap(store->map, store->map_size);
+    close(store->fd);
+    store->fd = fd;
+    store->map = map;
+    store->map_size = map_size;
+    printf("%s: compacted %ld bytes to %ld\n", store->path, store->end, offset);
+    store->end = offset;
+}
+
+// Caller holds store->lock. Appends a record (value NULL for a tombstone);
+// a deflated value starts with the raw length.
+static int kv_append(KvStore* store, const char* key, const char* value, long value_len, int deflated) {
+    long key_len = strlen(key);
+    long size = kv_record_size(key_len, value ? value_len : -1);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    KvRecord rec = {deflated ? KV_MAGIC_DEFLATE : KV_MAGIC, key_len, value ? value_len : -1, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec, 0};
+    rec.checksum = xxh64(value ? value : "", value ? value_len : 0, xxh64(key, key_len, 0));
+    
+    char pad[8] = {0};
+    long offset = store->end;
+    long tail = size - sizeof(rec) - key_len - (value ? value_len : 0);
+    if (kv_map(store, offset + size) != 0 ||
+        pwrite_all(store->fd, (const char*)&rec, sizeof(rec), offset) != 0 ||
+        pwrite_all(store->fd, key, key_len, offset + sizeof(rec)) != 0 ||
+        (value && pwrite_all(store->fd, value, value_len, offset + sizeof(rec) + key_len) != 0) ||
+        pwrite_all(store->fd, pad, tail, offset + size - tail) != 0) {
+        return -1;
+    }
+    store->end += size;
+    int64_t raw_len = rec.value_len;
+    if (deflated) memcpy(&raw_len, value, sizeof(raw_len));
+    kv_index(store, key, offset, &rec, raw_len);
+    if (store->end > KV_COMPACT_MIN && store->live_bytes < store->end / 2) kv_compact(store);
+    return 0;
+}
+
+static int kv_storage_write(Tenant* tenant, const char* path, const char* content, long len,
+                            const StorageRange* ranges, int count) {
+    (void)ranges;
+    (void)count;
+    flight_event(FLIGHT_STORE, -1, len, path, strlen(path));
+    // Deflated outside the lock; reserved keys such as the dictionary stay raw
+    char* packed = NULL;
+    long packed_len = 0;
+    if (len >= KV_DEFLATE_MIN && path[0] != '\001') {
+        unsigned char* stream = tenant_deflate(tenant, content, len, KV_DEFLATE_LEVEL, &packed_len);
+        if (stream) {
+            packed = mem_alloc(MEM_OTHER, packed_len + 8);
+            int64_t raw_len = len;
+            memcpy(packed, &raw_len, 8);
+            memcpy(packed + 8, stream, packed_len);
+            packed_len += 8;
+            mem_free(stream);
+        }
+    }
+    KvStore* store = tenant->store;
+    lock_acquire(&store->lock, LOCK_KV_STORE);
+    int rc = packed ? kv_append(store, path, packed, packed_len, 1) : kv_append(store, path, content, len, 0);
+    lock_release(&store->lock);
+    mem_free(packed);
+    if (rc == 0 && path[0] != '\001') {
+        pthread_mutex_lock(&tenant->quota_lock);
+        tenant->compression.stored_raw_bytes += len;
+        tenant->compression.stored_bytes += packed ? packed_len : len;
+        pthread_mutex_unlock(&tenant->quota_lock);
+    }
+    return rc;
+}
+
+static int kv_storage_remove(Tenant* tenant, const char* path) {
+    KvStore* store = tenant->store;
+    lock_acquire(&store->lock, LOCK_KV_STORE);
+    int rc = -1;
+    if (*kv_slot(store, path, xxh64(path, strlen(path), 0))) rc = kv_append(store, path, NULL, 0, 0);
+    else errno = ENOENT;
+    lock_release(&store->lock);
+    return rc;
+}
+
+static void kv_storage_scan(Tenant* tenant) {
+    KvStore* store = tenant->store;
+    lock_acquire(&store->lock, LOCK_KV_STORE);
+    for (long i = 0; i < store->bucket_count; i++) {
+        for (KvEntry* entry = store->buckets[i]; entry; entry = entry->next) {
+            if (entry->key[0] != '\001') fs_index_update(tenant, entry->key, entry->value_len, entry->mtime);
+        }
+    }
+    lock_release(&store->lock);
+}
+
+const StorageBackend kv_storage = {
+    "kv", kv_storage_open, kv_storage_stat, kv_storage_read, kv_storage_write, kv_storage_remove, kv_storage_scan, 1
+};
+
+// Chosen with --storage at startup; every tenant uses the same backend
+const StorageBackend* storage_backend = &fs_storage;
+
+// Caller holds doc->lock. Hashes the on-disk copy only when its size could match.
+// The hash of what was last loaded or written is reused only while the file
+// still has that size and exact st_mtim (see disk_mtime); otherwise the index
+// or the file itself decides.
+int document_matches_disk(Document* doc, const char* path, uint64_t hash, long len) {
+    const StorageBackend* storage = doc->tenant->storage;
+    struct stat st;
+    if (storage->stat(doc->tenant, path, &st) != 0 || st.st_size != len) return 0;
+    if (doc->hash_known && doc->persisted_size == st.st_size &&
+        st.st_mtim.tv_sec == doc->disk_mtime.tv_sec && st.st_mtim.tv_nsec == doc->disk_mtime.tv_nsec) {
+        return doc->persisted_hash == hash;
+    }
+    
+    uint64_t disk_hash;
+    if (fs_index_get_hash(doc->tenant, path, st.st_size, st.st_mtim, &disk_hash) == 0) return disk_hash == hash;
+    
+    long got;
+    char* disk = storage->read(doc->tenant, path, &got, &st);
+    if (!disk) return 0;
+    disk_hash = xxh64(disk, got, 0);
+    mem_free(disk);
+    return got == len && disk_hash == hash;
+}
+
+// Caller holds doc->lock. Loads the file into doc->content, reusing the cached
+// copy unless the file changed on disk. Returns -1 if the file does not exist
+// and -2, leaving the document as it was, if it would not fit the budgets.
+int document_load(Document* doc, const char* path) {
+    doc->last_access_ms = now_ms();
+    document_unpack(doc);
+    if (doc->dirty && doc->content) return 0;
+    
+    struct stat st;
+    if (doc->tenant->storage->stat(doc->tenant, path, &st) != 0) {
+        mem_free(doc->content);
+        doc->content = NULL;
+        doc->length = doc->capacity = 0;
+        undo_clear(doc);
+        document_account(doc);
+        return -1;
+    }
+    
+    if (doc->content && st.st_size == doc->length &&
+        st.st_mtim.tv_sec == doc->disk_mtime.tv_sec && st.st_mtim.tv_nsec == doc->disk_mtime.tv_nsec) {
+        return 0;
+    }
+    
+    if (document_reserve(doc, st.st_size + 1 - doc->capacity) != 0) return -2;
+    long size;
+    char* content = doc->tenant->storage->read(doc->tenant, path, &size, &st);
+    if (!content) return -1;
+    
+    uint64_t hash = xxh64(content, size, 0);
+    int reloaded = doc->hash_known && (doc->persisted_hash != hash || doc->persisted_size != size);
+    if (reloaded) {
+        doc->revision++;
+        fs_index_update(doc->tenant, path, size, st.st_mtim);
+    }
+    fs_index_set_hash(doc->tenant, path, size, st.st_mtim, hash);
+    mem_free(doc->content);
+    doc->content = content;
+    mem_retag(content, MEM_DOCUMENTS);
+    doc->length = size;
+    undo_clear(doc);
+    doc->capacity = size + 1;
+    doc->persisted_hash = hash;
+    doc->persisted_size = size;
+    doc->hash_known = 1;
+    doc->disk_mtime = st.st_mtim;
+    doc->live_hash = doc_hash(content, size);
+    if (reloaded || doc->hash_history_next == 0) document_record_revision(doc);
+    document_account(doc);
+    return 0;
+}
+
+// Caller holds doc->lock. Like document_load, but a file that does not exist
+// yet gets an empty live buffer so edits can start before the first save.
+// Returns -1 if the file exists but would not fit the budgets.
+int document_ensure(Document* doc, const char* path) {
+    int loaded = document_load(doc, path);
+    if (loaded == 0) return 0;
+    if (loaded == -2) return -1;
+    doc->content = mem_calloc(MEM_DOCUMENTS, 1, 1);
+    doc->length = 0;
+    doc->capacity = 1;
+    doc->live_hash = doc_hash("", 0);
+    document_record_revision(doc);
+    document_account(doc);
+    return 0;
+}
+
+// Caller holds doc->lock. Records what was just written so the next
+// document_load does not mistake our own write for an external change.
+void document_persisted(Document* doc, const char* path, uint64_t hash) {
+    struct stat st;
+    if (doc->tenant->storage->stat(doc->tenant, path, &st) == 0) {
+        doc->disk_mtime = st.st_mtim;
+        fs_index_update(doc->tenant, path, st.st_size, st.st_mtim);
+        fs_index_set_hash(doc->tenant, path, st.st_size, st.st_mtim, hash);
+    }
+    doc->persisted_hash = hash;
+    doc->persisted_size = doc->length;
+    doc->hash_known = 1;
+    doc->dirty = 0;
+}
+
+static void bucket_refill(TokenBucket* bucket, long long now) {
+    if (bucket->rate > 0) {
+        bucket->tokens += bucket->rate * (now - bucket->refilled_ms) / 1000.0;
+        if (bucket->tokens > bucket->rate) bucket->tokens = bucket->rate;
+    }
+    bucket->refilled_ms = now;
+}
+
+// Counts a new WebSocket connection against the tenant. Returns -1 when it is
+// already at its limit.
+int tenant_connect(Tenant* tenant) {
+    pthread_mutex_lock(&tenant->quota_lock);
+    int ok = !tenant->max_connections || tenant->connections < tenant->max_connections;
+    if (ok) tenant->connections++;
+    pthread_mutex_unlock(&tenant->quota_lock);
+    return ok ? 0 : -1;
+}
+
+static long long thread_cpu_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Waits until the tenant has CPU time left, then returns the calling thread's
+// CPU clock for tenant_cpu_end. Only the over-budget tenant's own request
+// threads wait, so its load does not queue in front of anyone else's.
+long long tenant_cpu_begin(Tenant* tenant) {
+    pthread_mutex_lock(&tenant->quota_lock);
+    bucket_refill(&tenant->cpu, now_ms());
+    while (tenant->cpu.rate > 0 && tenant->cpu.tokens < 0) {
+        long wait_ms = (long)(-tenant->cpu.tokens * 1000 / tenant->cpu.rate) + 1;
+        pthread_mutex_unlock(&tenant->quota_lock);
+        usleep(wait_ms * 1000);
+        pthread_mutex_lock(&tenant->quota_lock);
+        bucket_refill(&tenant->cpu, now_ms());
+    }
+    pthread_mutex_unlock(&tenant->quota_lock);
+    return thread_cpu_us();
+}
+
+void tenant_cpu_end(Tenant* tenant, long long start_us) {
+    pthread_mutex_lock(&tenant->quota_lock);
+    if (tenant->cpu.rate > 0) tenant->cpu.tokens -= thread_cpu_us() - start_us;
+    pthread_mutex_unlock(&tenant->quota_lock);
+}
+
+// Every DOC_PACK_INTERVAL seconds, deflates the live buffers of documents no
+// one has opened or edited for DOC_IDLE_MS. Documents held by a request are
+// skipped, and the CPU spent is charged to each document's tenant.
+void* idle_packer(void* arg) {
+    (void)arg;
+    thread_role("packer");
+    while (1) {
+        thread_wait("sleep");
+        sleep(DOC_PACK_INTERVAL);
+        thread_state("pack");
+        for (Tenant* tenant = tenants; tenant; tenant = tenant->next) {
+            long long cpu_start = thread_cpu_us();
+            long long now = now_ms();
+            // Documents are only ever added at the head and never freed
+            lock_acquire(&tenant->documents_mutex, LOCK_DOCUMENTS);
+            Document* doc = tenant->documents;
+            lock_release(&tenant->documents_mutex);
+            int packed = 0;
+            for (; doc; doc = doc->next) {
+                if (lock_try(&doc->lock, LOCK_DOCUMENT) != 0) continue;
+                if (doc->content && doc->length >= DOC_PACK_MIN && now - doc->last_access_ms >= DOC_IDLE_MS) {
+                    packed += document_pack(doc);
+                }
+                lock_release(&doc->lock);
+            }
+            tenant_cpu_end(tenant, cpu_start);
+            if (packed) printf("Workspace %s: packed %d idle documents\n", tenant->name, packed);
+        }
+    }
+    return NULL;
+}
+
+void add_client(Client* client) {
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    client->next = clients;
+    clients = client;
+    client->active = 1;
+    strcpy(client->color, colors[rand() % 10]);
+    pthread_mutex_init(&client->lock, NULL);
+    lock_release(&clients_mutex);
+    printf("Client added: %s (socket %d, workspace %s)\n", client->username, client->socket, client->tenant->name);
+}
+
+// Optional TLS on both listeners (https and wss), on with --tls-cert and
+// --tls-key. After the handshake OpenSSL hands the record layer to the kernel
+// (kTLS) where it can; sending then stays a plain send() or sendfile() on the
+// socket and the kernel encrypts in place, so broadcast frames are still
+// encoded once and file bodies never pass through user space. Without kTLS,
+// data goes through SSL_read / SSL_write on a non-blocking socket. Sessions
+// resume from the server cache or a ticket, so a returning browser skips the
+// full handshake on each of its HTTP requests.
+#define TLS_MAX_FDS 65536
+#define TLS_HANDSHAKE_MS 5000
+
+typedef struct TlsConn {
+    SSL* ssl;
+    int ktls_send;
+    // OpenSSL requires an SSL_write that wanted to block to be retried with at
+    // least as many bytes
+    long retry_len;
+    // Serialises SSL_read and SSL_write unless the kernel does the sending
+    pthread_mutex_t lock;
+} TlsConn;
+
+static SSL_CTX* tls_ctx;
+static TlsConn* tls_conns[TLS_MAX_FDS];
+static unsigned long tls_handshakes, tls_resumed, tls_offloaded;
+
+// ALPN: h2 is offered on connections accepted with offer_h2 (the HTTP
+// listener), so WebSockets stay on HTTP/1.1
+static int tls_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len, const unsigned char* in, unsigned int in_len, void* arg) {
+    (void)arg;
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    const unsigned char* offered = SSL_get_app_data(ssl) ? protocols : protocols + 3;
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_len, offered, protocols + sizeof(protocols) - 1 - offered, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// A server context for cert / key, with kTLS requested if ktls is set.
+// Returns NULL, having printed why, if they cannot be loaded.
+static SSL_CTX* tls_context(const char* cert, const char* key, int ktls) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return NULL;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"collab", 6);
+    SSL_CTX_sess_set_cache_size(ctx, 4096);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_alpn, NULL);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+        printf("Cannot load TLS certificate %s / key %s:\n", cert, key);
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Runs the server side of the handshake on a freshly accepted socket. Does
+// nothing without ctx. Returns -1 if the handshake fails or times out.
+static int tls_accept(SSL_CTX* ctx, int fd, int offer_h2) {
+    if (!ctx) return 0;
+    if (fd >= TLS_MAX_FDS) return -1;
+    TlsConn* conn = mem_calloc(MEM_CONNECTIONS, 1, sizeof(TlsConn));
+    conn->ssl = SSL_new(ctx);
+    pthread_mutex_init(&conn->lock, NULL);
+    struct timeval timeout = {TLS_HANDSHAKE_MS / 1000, 0}, none = {0, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    SSL_set_fd(conn->ssl, fd);
+    if (offer_h2) SSL_set_app_data(conn->ssl, conn);
+    int rc = SSL_accept(conn->ssl);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    if (rc != 1) {
+        SSL_free(conn->ssl);
+        pthread_mutex_destroy(&conn->lock);
+        mem_free(conn);
+        return -1;
+    }
+    conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0;
+    if (!conn->ktls_send) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    __atomic_add_fetch(&tls_handshakes, 1, __ATOMIC_RELAXED);
+    if (SSL_session_reused(conn->ssl)) __atomic_add_fetch(&tls_resumed, 1, __ATOMIC_RELAXED);
+    if (conn->ktls_send) __atomic_add_fetch(&tls_offloaded, 1, __ATOMIC_RELAXED);
+    tls_conns[fd] = conn;
+    return 0;
+}
+
+// Waits until SSL_read / SSL_write can make progress after err
+static void tls_wait(int fd, int err) {
+    struct pollfd p = {fd, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, 0};
+    poll(&p, 1, -1);
+}
+
+// recv() for a socket that may carry TLS; blocks until data or end of stream
+long tls_recv(int fd, void* buf, long len) {
+    TlsConn* conn = fd < TLS_MAX_FDS ? tls_conns[fd] : NULL;
+    if (!conn) return recv(fd, buf, len, 0);
+    while (1) {
+        size_t got = 0;
+        if (!conn->ktls_send) pthread_mutex_lock(&conn->lock);
+        int rc = SSL_read_ex(conn->ssl, buf, len, &got);
+        int err = rc == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, rc);
+        if (!conn->ktls_send) pthread_mutex_unlock(&conn->lock);
+        if (rc == 1) return got;
+        if (err == SSL_ERROR_ZERO_RETURN) return 0;
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return -1;
+        tls_wait(fd, err);
+    }
+}
+
+// send() for a socket that may carry TLS. Honours MSG_DONTWAIT; may send less
+// than len.
+long tls_send(int fd, const void* data, long len, int flags) {
+    TlsConn* conn = fd < TLS_MAX_FDS ? tls_conns[fd] : NULL;
+    if (!conn || conn->ktls_send) return send(fd, data, len, flags);
+    while (1) {
+        size_t sent = 0;
+        pthread_mutex_lock(&conn->lock);
+        if (conn->retry_len > len) {
+            pthread_mutex_unlock(&conn->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        int rc = SSL_write_ex(conn->ssl, data, len, &sent);
+        int err = rc == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, rc);
+        int again = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+        conn->retry_len = again ? len : 0;
+        pthread_mutex_unlock(&conn->lock);
+        if (rc == 1) return sent;
+        if (!again) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+        tls_wait(fd, err);
+    }
+}
+
+// Ends the TLS session, if any, and closes the socket
+void tls_close(int fd) {
+    TlsConn* conn = fd < TLS_MAX_FDS ? tls_conns[fd] : NULL;
+    if (conn) {
+        tls_conns[fd] = NULL;
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        pthread_mutex_destroy(&conn->lock);
+        mem_free(conn);
+    }
+    close(fd);
+}
+
+void frame_release(Frame* frame) {
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (frame->room) __atomic_sub_fetch(&frame->room->queued_bytes, frame->len, __ATOMIC_RELAXED);
+        mem_free(frame);
+    }
+}
+
+// Caller holds client->lock
+static void client_queue_clear(Client* client) {
+    while (client->out_head) {
+        OutFrame* out = client->out_head;
+        client->out_head = out->next;
+        frame_release(out->frame);
+        mem_free(out);
+    }
+    client->out_tail = NULL;
+    client->out_sent = client->out_queued = 0;
+    client->out_frames = 0;
+}
+
+void remove_client(int socket) {
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    Client** curr = &clients;
+    while (*curr) {
+        if ((*curr)->socket == socket) {
+            Client* temp = *curr;
+            *curr = (*curr)->next;
+            printf("Client removed: %s (socket %d)\n", temp->username, temp->socket);
+            pthread_mutex_lock(&temp->tenant->quota_lock);
+            temp->tenant->connections--;
+            pthread_mutex_unlock(&temp->tenant->quota_lock);
+            client_queue_clear(temp);
+            pthread_mutex_destroy(&temp->lock);
+            // A follower's socket belongs to the HTTP request it answers
+            if (!temp->follower) tls_close(temp->socket);
+            mem_free(temp);
+            break;
+        }
+        curr = &(*curr)->next;
+    }
+    lock_release(&clients_mutex);
+}
+
+// send() may write less than asked for large bodies; keep going until done
+int send_all(int socket, const char* data, long len) {
+    while (len > 0) {
+        long sent = tls_send(socket, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Sends len bytes of fd from its current offset. The kernel moves them to the
+// socket directly unless a TLS session without kTLS has to encrypt them here.
+int send_file(int socket, int fd, long len) {
+    TlsConn* conn = socket < TLS_MAX_FDS ? tls_conns[socket] : NULL;
+    if (conn && !conn->ktls_send) {
+        char buffer[16384];
+        while (len > 0) {
+            long n = read(fd, buffer, len < (long)sizeof(buffer) ? len : (long)sizeof(buffer));
+            if (n <= 0 || send_all(socket, buffer, n) != 0) return -1;
+            len -= n;
+        }
+        return 0;
+    }
+    while (len > 0) {
+        long sent = sendfile(socket, fd, NULL, len);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Encodes an unmasked frame with one reference, owned by the caller
+Frame* ws_frame(int opcode, const char* payload, long len) {
+    Frame* frame = mem_alloc(MEM_FRAMES, sizeof(Frame) + len + 10);
+    unsigned char* p = (unsigned char*)frame->data;
+    int idx = 0;
+    
+    p[idx++] = 0x80 | opcode;
+    
+    if (len < 126) {
+        p[idx++] = len;
+    } else if (len < 65536) {
+        p[idx++] = 126;
+        p[idx++] = (len >> 8) & 0xFF;
+        p[idx++] = len & 0xFF;
+    } else {
+        p[idx++] = 127;
+        for (int i = 7; i >= 0; i--) {
+            p[idx++] = (len >> (i * 8)) & 0xFF;
+        }
+    }
+    
+    memcpy(p + idx, payload, len);
+    frame->len = idx + len;
+    frame->refs = 1;
+    frame->trace = trace_current;
+    frame->room = NULL;
+    return frame;
+}
+
+pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+int sched_pending = 0;
+
+#define SCHED_QUANTUM 65536
+#define SCHED_TICK_MS 10
+
+// Caller holds client->lock. Queues frame for the outbound scheduler. A client
+// that lets more than CLIENT_QUEUE_LIMIT bytes pile up is disconnected.
+void client_enqueue(Client* client, Frame* frame) {
+    if (!client->active) return;
+    if (client->out_head && client->out_queued + frame->len > CLIENT_QUEUE_LIMIT) {
+        printf("Disconnecting slow client %s (%ld bytes queued)\n", client->username, client->out_queued);
+        client->active = 0;
+        client_queue_clear(client);
+        shutdown(client->socket, SHUT_RDWR);
+        return;
+    }
+    OutFrame* out = mem_alloc(MEM_FRAMES, sizeof(OutFrame));
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    out->frame = frame;
+    out->queued_us = frame->trace ? now_us() : 0;
+    out->next = NULL;
+    if (client->out_tail) client->out_tail->next = out;
+    else client->out_head = out;
+    client->out_tail = out;
+    client->out_queued += frame->len;
+    client->out_frames++;
+    
+    pthread_mutex_lock(&sched_mutex);
+    sched_pending = 1;
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+// Caller holds client->lock. Writes up to budget bytes of the client's queue
+// without blocking and returns how many went out.
+static long client_flush(Client* client, long budget) {
+    long written = 0;
+    while (client->out_head && written < budget) {
+        Frame* frame = client->out_head->frame;
+        long chunk = frame->len - client->out_sent;
+        if (chunk > budget - written) chunk = budget - written;
+        long sent = tls_send(client->socket, frame->data + client->out_sent, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // The reader thread notices the broken connection and removes the client
+                client->active = 0;
+                client_queue_clear(client);
+            }
+            break;
+        }
+        written += sent;
+        client->out_sent += sent;
+        if (client->out_sent == frame->len) {
+            OutFrame* out = client->out_head;
+            client->out_head = out->next;
+            if (!client->out_head) client->out_tail = NULL;
+            client->out_queued -= frame->len;
+            client->out_frames--;
+            client->out_sent = 0;
+            __atomic_store_n(&client->msgs_out, client->msgs_out + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&client->bytes_out, client->bytes_out + frame->len, __ATOMIC_RELAXED);
+            rate_count(&client->out_rate, now_ms(), 1);
+            if (frame->trace) trace_record(frame->trace, "flush", out->queued_us, now_us(), client->socket);
+            frame_release(frame);
+            mem_free(out);
+        }
+    }
+    return written;
+}
+
+// The only writer of WebSocket frames. Each pass refills every tenant's
+// bandwidth bucket and gives every client with queued output up to
+// SCHED_QUANTUM bytes, paid from its tenant's bucket. A tenant out of tokens
+// or a client whose socket is full waits for a later pass while everyone else
+// keeps going.
+void* outbound_scheduler(void* arg) {
+    (void)arg;
+    int backlog = 0, progress = 0;
+    thread_role("scheduler");
+    while (1) {
+        thread_wait("wait");
+        pthread_mutex_lock(&sched_mutex);
+        if (!sched_pending && !progress) {
+            if (backlog) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += SCHED_TICK_MS * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&sched_cond, &sched_mutex, &deadline);
+            } else {
+                while (!sched_pending) pthread_cond_wait(&sched_cond, &sched_mutex);
+            }
+        }
+        sched_pending = 0;
+        pthread_mutex_unlock(&sched_mutex);
+        thread_state("flush");
+        
+        long long now = now_ms();
+        for (Tenant* tenant = tenants; tenant; tenant = tenant->next) bucket_refill(&tenant->bandwidth, now);
+        backlog = progress = 0;
+        lock_acquire(&clients_mutex, LOCK_CLIENTS);
+        for (Client* curr = clients; curr; curr = curr->next) {
+            lock_acquire(&curr->lock, LOCK_CLIENT);
+            if (curr->out_head) {
+                TokenBucket* bucket = &curr->tenant->bandwidth;
+                long budget = SCHED_QUANTUM;
+                if (bucket->rate > 0 && bucket->tokens < budget) budget = bucket->tokens > 0 ? (long)bucket->tokens : 0;
+                long written = budget > 0 ? client_flush(curr, budget) : 0;
+                if (written > 0) flight_event(FLIGHT_SEND, curr->socket, written, curr->username, strlen(curr->username));
+                if (bucket->rate > 0) bucket->tokens -= written;
+                if (curr->out_head) {
+                    backlog = 1;
+                    if (written > 0) progress = 1;
+                }
+            }
+            lock_release(&curr->lock);
+        }
+        lock_release(&clients_mutex);
+    }
+    return NULL;
+}
+
+// Sends message to the tenant's clients that have room open
+void broadcast_room(Tenant* tenant, const char* room, const char* message) {
+    Frame* frame = ws_frame(0x1, message, strlen(message));
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    Client* curr = clients;
+    int count = 0;
+    while (curr) {
+        if (curr->active && !curr->follower && curr->tenant == tenant && strcmp(curr->current_file, room) == 0) {
+            lock_acquire(&curr->lock, LOCK_CLIENT);
+            client_enqueue(curr, frame);
+            count++;
+            lock_release(&curr->lock);
+        }
+        curr = curr->next;
+    }
+    lock_release(&clients_mutex);
+    frame_release(frame);
+    printf("Room %s: sent to %d clients\n", room, count);
+}
+
+// Sends message to every client of the tenant. The frame is encoded once and
+// shared by all of their queues.
+void broadcast_message(Tenant* tenant, const char* message, int exclude_socket) {
+    Frame* frame = ws_frame(0x1, message, strlen(message));
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    Client* curr = clients;
+    int count = 0;
+    while (curr) {
+        if (curr->socket != exclude_socket && curr->active && !curr->follower && curr->tenant == tenant) {
+            lock_acquire(&curr->lock, LOCK_CLIENT);
+            client_enqueue(curr, frame);
+            count++;
+            lock_release(&curr->lock);
+        }
+        curr = curr->next;
+    }
+    lock_release(&clients_mutex);
+    frame_release(frame);
+    printf("Broadcast to %d clients: %.100s\n", count, message);
+}
+
+// Status line and headers of a response whose body is length bytes
+void format_response_header(char* header, size_t size, const char* status, const char* content_type, const char* extra_headers, long length) {
+    snprintf(header, size,
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %ld\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Allow-Methods: GET, POST, PUT, PATCH, DELETE, OPTIONS\r\n"
+        "Access-Control-Allow-Headers: Content-Type, If-Match, Authorization, X-Tenant\r\n"
+        "Access-Control-Expose-Headers: ETag\r\n"
+        "%s"
+        "Connection: close\r\n"
+        "\r\n",
+        status, content_type, length, extra_headers);
+}
+
+void send_response_with_headers(int socket, const char* status, const char* content_type, const char* extra_headers, const char* body) {
+    char header[BUFFER_SIZE];
+    format_response_header(header, sizeof(header), status, content_type, extra_headers, strlen(body));
+    send_all(socket, header, strlen(header));
+    send_all(socket, body, strlen(body));
+}
+
+void send_response(int socket, const char* status, const char* content_type, const char* body) {
+    send_response_with_headers(socket, status, content_type, "", body);
+}
+
+// Returns the closing quote of the JSON string starting at p, skipping escapes
+const char* json_string_end(const char* p) {
+    while (*p && *p != '"') {
+        if (*p == '\\' && *(p+1)) p++;
+        p++;
+    }
+    return *p == '"' ? p : NULL;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static unsigned parse_hex4(const char* p) {
+    unsigned v = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hex_value(p[i]);
+        if (h < 0) return 0xFFFD;
+        v = (v << 4) | h;
+    }
+    return v;
+}
+
+// Copies the URL-decoded value of key from the query string of url into out.
+// Returns 0 when the key is present.
+int query_param(const char* url, const char* key, char* out, size_t out_size) {
+    const char* q = strchr(url, '?');
+    size_t key_len = strlen(key);
+    out[0] = '\0';
+    while (q) {
+        q++;
+        if (strncmp(q, key, key_len) == 0 && q[key_len] == '=') {
+            const char* v = q + key_len + 1;
+            size_t n = 0;
+            while (*v && *v != '&' && n + 1 < out_size) {
+                if (*v == '+') {
+                    out[n++] = ' ';
+                    v++;
+                } else if (*v == '%' && hex_value(v[1]) >= 0 && hex_value(v[2]) >= 0) {
+                    out[n++] = (char)(hex_value(v[1]) * 16 + hex_value(v[2]));
+                    v += 3;
+                } else {
+                    out[n++] = *v++;
+                }
+            }
+            out[n] = '\0';
+            return 0;
+        }
+        q = strchr(q, '&');
+    }
+    return -1;
+}
+
+// Copies the trimmed value of an HTTP header (case-insensitive name) into out.
+// Returns 0 when the header is present.
+int header_value(const char* headers, const char* name, char* out, size_t out_size) {
+    char needle[64];
+    snprintf(needle, sizeof(needle), "\r\n%s:", name);
+    out[0] = '\0';
+    const char* h = strcasestr(headers, needle);
+    if (!h) return -1;
+    h += strlen(needle);
+    while (*h == ' ' || *h == '\t') h++;
+    size_t n = 0;
+    while (h[n] && h[n] != '\r' && h[n] != '\n' && n + 1 < out_size) {
+        out[n] = h[n];
+        n++;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+// Escapes src as the body of a JSON string; dst needs room for len * 6 bytes
+char* json_escape(const char* src, long len, char* dst) {
+    for (long i = 0; i < len; i++) {
+        unsigned char c = src[i];
+        if (c == '"' || c == '\\') { *dst++ = '\\'; *dst++ = c; }
+        else if (c == '\n') { *dst++ = '\\'; *dst++ = 'n'; }
+        else if (c == '\r') { *dst++ = '\\'; *dst++ = 'r'; }
+        else if (c == '\t') { *dst++ = '\\'; *dst++ = 't'; }
+        else if (c < 0x20) dst += sprintf(dst, "\\u%04x", c);
+        else *dst++ = c;
+    }
+    return dst;
+}
+
+// Decodes the JSON string body [start, end) into a malloc'd UTF-8 buffer
+char* json_unescape(const char* start, const char* end, long* out_len) {
+    char* out = mem_alloc(MEM_HTTP, end - start + 1);
+    char* o = out;
+    for (const char* p = start; p < end; p++) {
+        if (*p != '\\' || p + 1 >= end) { *o++ = *p; continue; }
+        p++;
+        switch (*p) {
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'u': {
+                if (p + 4 >= end) { p = end - 1; break; }
+                unsigned cp = parse_hex4(p + 1);
+                p += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF && p + 6 < end && p[1] == '\\' && p[2] == 'u') {
+                    unsigned lo = parse_hex4(p + 3);
+                    if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                }
+                if (cp < 0x80) {
+                    *o++ = cp;
+                } else if (cp < 0x800) {
+                    *o++ = 0xC0 | (cp >> 6);
+                    *o++ = 0x80 | (cp & 0x3F);
+                } else if (cp < 0x10000) {
+                    *o++ = 0xE0 | (cp >> 12);
+                    *o++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *o++ = 0x80 | (cp & 0x3F);
+                } else {
+                    *o++ = 0xF0 | (cp >> 18);
+                    *o++ = 0x80 | ((cp >> 12) & 0x3F);
+                    *o++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *o++ = 0x80 | (cp & 0x3F);
+                }
+                break;
+            }
+            default: *o++ = *p; break;
+        }
+    }
+    *o = '\0';
+    *out_len = o - out;
+    return out;
+}
+
+// Copies the raw (still escaped) value of a short JSON string field into out.
+// Returns 0 when the field is present and fits.
+int json_string_field(const char* json, const char* key, char* out, size_t out_size) {
+    char needle[64];
+    snprintf(needle, sizeof(needle), "\"%s\":\"", key);
+    out[0] = '\0';
+    const char* start = strstr(json, needle);
+    if (!start) return -1;
+    start += strlen(needle);
+    const char* end = json_string_end(start);
+    if (!end || (size_t)(end - start) >= out_size) return -1;
+    memcpy(out, start, end - start);
+    out[end - start] = '\0';
+    return 0;
+}
+
+typedef struct {
+    unsigned char* data;
+    long len;
+    long capacity;
+} ByteBuffer;
+
+void byte_buffer_append(ByteBuffer* buf, const void* data, long len) {
+    if (buf->len + len > buf->capacity) {
+        buf->capacity = (buf->len + len) * 2 + 256;
+        buf->data = mem_realloc(MEM_HTTP, buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// Authentication is off unless ./auth/users exists. Users, the signing secret
+// and the ACL are loaded once at startup and never change, so verifying a token
+// or evaluating a permission takes no locks.
+typedef struct UserRecord {
+    char name[64];
+    int iterations;
+    unsigned char salt[16];
+    unsigned char hash[32];
+    struct UserRecord* next;
+} UserRecord;
+
+typedef struct AclRule {
+    char pattern[256];
+    char user[64];
+    int perms;
+    struct AclRule* next;
+} AclRule;
+
+#define PERM_READ 1
+#define PERM_WRITE 2
+#define AUTH_TOKEN_TTL (12 * 60 * 60)
+#define AUTH_PBKDF2_ITERATIONS 100000
+
+int auth_enabled = 0;
+unsigned char auth_secret[32];
+UserRecord* auth_users = NULL;
+// Without ./auth/acl every signed-in user may read and write every file
+AclRule* acl_rules = NULL;
+
+static void hex_encode(const unsigned char* data, int len, char* out) {
+    for (int i = 0; i < len; i++) sprintf(out + i * 2, "%02x", data[i]);
+}
+
+static int hex_decode(const char* hex, unsigned char* out, int len) {
+    for (int i = 0; i < len; i++) {
+        int hi = hex_value(hex[i * 2]), lo = hi < 0 ? -1 : hex_value(hex[i * 2 + 1]);
+        if (hi < 0 || lo < 0) return -1;
+        out[i] = hi * 16 + lo;
+    }
+    return 0;
+}
+
+static int valid_username(const char* name) {
+    if (!name[0] || strlen(name) >= 64) return 0;
+    for (const char* p = name; *p; p++) {
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_' || *p == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void password_hash(const char* password, const unsigned char* salt, int iterations, unsigned char* out) {
+    PKCS5_PBKDF2_HMAC(password, strlen(password), salt, 16, iterations, EVP_sha256(), 32, out);
+}
+
+// Appends name to ./auth/users; a later entry for the same name wins
+int auth_add_user(const char* name, const char* password) {
+    if (!valid_username(name)) {
+        printf("Usernames may only contain letters, digits, '_' and '-'\n");
+        return -1;
+    }
+    unsigned char salt[16], hash[32];
+    if (RAND_bytes(salt, sizeof(salt)) != 1) return -1;
+    password_hash(password, salt, AUTH_PBKDF2_ITERATIONS, hash);
+    
+    char salt_hex[33], hash_hex[65];
+    hex_encode(salt, 16, salt_hex);
+    hex_encode(hash, 32, hash_hex);
+    mkdir("./auth", 0700);
+    int fd = open("./auth/users", O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) return -1;
+    dprintf(fd, "%s:%d:%s:%s\n", name, AUTH_PBKDF2_ITERATIONS, salt_hex, hash_hex);
+    close(fd);
+    printf("Added user %s\n", name);
+    return 0;
+}
+
+// Reads ./auth/users, ./auth/acl and the token signing secret (created on
+// first use). Lines of the ACL are "<file glob> <user or *> <r|rw|->".
+void auth_load(void) {
+    FILE* fp = fopen("./auth/users", "r");
+    if (!fp) {
+        printf("Authentication disabled (no ./auth/users)\n");
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        UserRecord* user = mem_calloc(MEM_OTHER, 1, sizeof(UserRecord));
+        char salt_hex[64], hash_hex[128];
+        if (sscanf(line, "%63[^:]:%d:%63[^:]:%127s", user->name, &user->iterations, salt_hex, hash_hex) != 4 ||
+            hex_decode(salt_hex, user->salt, 16) != 0 || hex_decode(hash_hex, user->hash, 32) != 0) {
+            mem_free(user);
+            continue;
+        }
+        user->next = auth_users;
+        auth_users = user;
+    }
+    fclose(fp);
+    
+    int fd = open("./auth/secret", O_RDONLY);
+    if (fd < 0 || read(fd, auth_secret, sizeof(auth_secret)) != sizeof(auth_secret)) {
+        if (fd >= 0) close(fd);
+        if (RAND_bytes(auth_secret, sizeof(auth_secret)) != 1) {
+            printf("Could not generate a token secret; authentication disabled\n");
+            return;
+        }
+        fd = open("./auth/secret", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd >= 0 && write(fd, auth_secret, sizeof(auth_secret)) != sizeof(auth_secret)) {
+            printf("Could not save ./auth/secret; tokens will not survive a restart\n");
+        }
+    }
+    if (fd >= 0) close(fd);
+    
+    fp = fopen("./auth/acl", "r");
+    AclRule** tail = &acl_rules;
+    while (fp && fgets(line, sizeof(line), fp)) {
+        AclRule rule = {0};
+        char perms[8];
+        if (line[0] == '#' || sscanf(line, "%255s %63s %7s", rule.pattern, rule.user, perms) != 3) continue;
+        rule.perms = (strchr(perms, 'r') ? PERM_READ : 0) | (strchr(perms, 'w') ? PERM_WRITE : 0);
+        *tail = mem_alloc(MEM_OTHER, sizeof(AclRule));
+        **tail = rule;
+        tail = &(*tail)->next;
+    }
+    if (fp) fclose(fp);
+    auth_enabled = 1;
+    printf("Authentication enabled%s\n", acl_rules ? " with ./auth/acl" : "");
+}
+
+// Tokens are "<user>.<expiry>.<hex HMAC-SHA256 of the part before it>"
+void auth_issue_token(const char* user, char* out, size_t out_size, long* expires) {
+    *expires = time(NULL) + AUTH_TOKEN_TTL;
+    int n = snprintf(out, out_size, "%s.%ld", user, *expires);
+    unsigned char mac[32];
+    unsigned int mac_len = sizeof(mac);
+    HMAC(EVP_sha256(), auth_secret, sizeof(auth_secret), (const unsigned char*)out, n, mac, &mac_len);
+    out[n] = '.';
+    hex_encode(mac, 32, out + n + 1);
+}
+
+// Checks the signature and expiry of token and copies its user into user_out.
+// Returns 0 when the token is valid.
+int auth_verify_token(const char* token, char* user_out, size_t user_size) {
+    const char* sig = strrchr(token, '.');
+    const char* dot = strchr(token, '.');
+    if (!sig || sig == dot || strlen(sig + 1) != 64) return -1;
+    
+    unsigned char mac[32], given[32];
+    unsigned int mac_len = sizeof(mac);
+    HMAC(EVP_sha256(), auth_secret, sizeof(auth_secret), (const unsigned char*)token, sig - token, mac, &mac_len);
+    if (hex_decode(sig + 1, given, 32) != 0 || CRYPTO_memcmp(mac, given, 32) != 0) return -1;
+    if (atol(dot + 1) < time(NULL) || (size_t)(dot - token) >= user_size) return -1;
+    memcpy(user_out, token, dot - token);
+    user_out[dot - token] = '\0';
+    return 0;
+}
+
+// Permission bits of user on file; the first matching ACL line wins
+int acl_perms(const char* user, const char* file) {
+    if (!auth_enabled || !acl_rules) return PERM_READ | PERM_WRITE;
+    for (AclRule* rule = acl_rules; rule; rule = rule->next) {
+        if ((strcmp(rule->user, "*") == 0 || strcmp(rule->user, user) == 0) && fnmatch(rule->pattern, file, 0) == 0) {
+            return rule->perms;
+        }
+    }
+    return 0;
+}
+
+// Caller holds client->lock. Re-evaluates the ACL only when the file differs
+// from the one the cached bits are for.
+int client_perms(Client* client, const char* file) {
+    if (strcmp(client->perms_file, file) != 0) {
+        snprintf(client->perms_file, sizeof(client->perms_file), "%s", file);
+        client->perms = acl_perms(client->username, file);
+    }
+    return client->perms;
+}
+
+// Charges frame to room, the document whose update it is, until it is sent
+static Frame* frame_charge(Frame* frame, Document* room) {
+    if (room) {
+        frame->room = room;
+        __atomic_add_fetch(&room->queued_bytes, frame->len, __ATOMIC_RELAXED);
+    }
+    return frame;
+}
+
+// A Server-Sent Event for followers' queues, with one reference. data must be
+// a single line, as JSON is. Without an event, data is queued as it is.
+static Frame* sse_frame(const char* event, long id, const char* data, long len) {
+    Frame* frame = mem_alloc(MEM_FRAMES, sizeof(Frame) + len + 96);
+    int n = event ? sprintf(frame->data, "id: %ld\nevent: %s\ndata: ", id, event) : 0;
+    memcpy(frame->data + n, data, len);
+    frame->len = n + len;
+    if (event) {
+        memcpy(frame->data + frame->len, "\n\n", 2);
+        frame->len += 2;
+    }
+    frame->refs = 1;
+    frame->trace = trace_current;
+    frame->room = NULL;
+    return frame;
+}
+
+// Like broadcast_message, but only to clients allowed to read file. Followers
+// of file get it as an "update" event with revision as its id. Each encoding is
+// built once and charged to room, the file's document, if there is one.
+void broadcast_file(Tenant* tenant, const char* file, Document* room, long revision, const char* message, int exclude_socket) {
+    long len = strlen(message);
+    Frame* frame = frame_charge(ws_frame(0x1, message, len), room);
+    Frame* event = NULL;
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    Client* curr = clients;
+    while (curr) {
+        if (curr->socket != exclude_socket && curr->active && curr->tenant == tenant) {
+            lock_acquire(&curr->lock, LOCK_CLIENT);
+            if (!auth_enabled || client_perms(curr, file) & PERM_READ) {
+                if (!curr->follower) {
+                    client_enqueue(curr, frame);
+                } else if (strcmp(curr->current_file, file) == 0) {
+                    if (!event) event = frame_charge(sse_frame("update", revision, message, len), room);
+                    client_enqueue(curr, event);
+                }
+            }
+            lock_release(&curr->lock);
+        }
+        curr = curr->next;
+    }
+    lock_release(&clients_mutex);
+    frame_release(frame);
+    if (event) {
+        frame_release(event);
+        if (room) __atomic_store_n(&room->streamed_revision, revision, __ATOMIC_RELAXED);
+    }
+}
+
+// Everything a room holds: the document buffer (live or packed), its undo
+// history, the revision hashes resyncing clients are checked against, a
+// presence entry per member and the update frames still queued for subscribers
+static long room_bytes(Document* doc) {
+    return __atomic_load_n(&doc->capacity, __ATOMIC_RELAXED) + __atomic_load_n(&doc->packed_len, __ATOMIC_RELAXED) +
+        __atomic_load_n(&doc->undo_bytes, __ATOMIC_RELAXED) + (long)sizeof(doc->hash_history) +
+        __atomic_load_n(&doc->members, __ATOMIC_RELAXED) * (long)sizeof(Client) +
+        __atomic_load_n(&doc->queued_bytes, __ATOMIC_RELAXED);
+}
+
+// Called without doc->lock after an edit. A room over room_budget first loses
+// its oldest history; then a dirty document is written out, so the workspace
+// quota may drop its buffer, and its spare capacity is released; last, the
+// subscribers with the most of its updates still queued are disconnected.
+static void room_enforce(Document* doc) {
+    if (!room_budget) return;
+    Tenant* tenant = doc->tenant;
+    int members = 0;
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    for (Client* c = clients; c; c = c->next) {
+        if (c->tenant != tenant) continue;
+        lock_acquire(&c->lock, LOCK_CLIENT);
+        if (strcmp(c->current_file, doc->name) == 0) members++;
+        lock_release(&c->lock);
+    }
+    lock_release(&clients_mutex);
+    __atomic_store_n(&doc->members, members, __ATOMIC_RELAXED);
+    long before = room_bytes(doc);
+    if (before <= room_budget) return;
+    
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    long excess = room_bytes(doc) - room_budget;
+    if (excess > 0) undo_shrink(doc, doc->undo_bytes > excess ? doc->undo_bytes - excess : 0);
+    if (room_bytes(doc) > room_budget && doc->content) {
+        if (doc->dirty && tenant->storage->write(tenant, doc->name, doc->content, doc->length, NULL, 0) == 0) {
+            document_persisted(doc, doc->name, xxh64(doc->content, doc->length, 0));
+        }
+        if (doc->capacity > doc->length + 1) {
+            doc->content = mem_realloc(MEM_DOCUMENTS, doc->content, doc->length + 1);
+            doc->capacity = doc->length + 1;
+        }
+    }
+    document_account(doc);
+    lock_release(&doc->lock);
+    
+    // A subscriber still holding more than one update has fallen behind
+    while (room_bytes(doc) > room_budget) {
+        Client* slowest = NULL;
+        long slowest_bytes = 0;
+        lock_acquire(&clients_mutex, LOCK_CLIENTS);
+        for (Client* c = clients; c; c = c->next) {
+            lock_acquire(&c->lock, LOCK_CLIENT);
+            long held = 0;
+            int frames = 0;
+            for (OutFrame* out = c->out_head; out; out = out->next) {
+                if (out->frame->room == doc) {
+                    held += out->frame->len;
+                    frames++;
+                }
+            }
+            lock_release(&c->lock);
+            if (frames > 1 && held > slowest_bytes) {
+                slowest = c;
+                slowest_bytes = held;
+            }
+        }
+        if (slowest) {
+            lock_acquire(&slowest->lock, LOCK_CLIENT);
+            printf("Disconnecting slow client %s from room %s (%ld bytes queued)\n", slowest->username, doc->name, slowest_bytes);
+            slowest->active = 0;
+            client_queue_clear(slowest);
+            shutdown(slowest->socket, SHUT_RDWR);
+            lock_release(&slowest->lock);
+        }
+        lock_release(&clients_mutex);
+        if (!slowest) break;
+    }
+    printf("Room %s/%s over budget: %ld bytes, now %ld\n", tenant->name, doc->name, before, room_bytes(doc));
+}
+
+Tenant* find_tenant(const char* name) {
+    Tenant* tenant = tenants;
+    while (tenant && strcmp(tenant->name, name) != 0) tenant = tenant->next;
+    return tenant;
+}
+
+// Whether user may work in tenant; anyone may when authentication is off
+int tenant_admits(Tenant* tenant, const char* user) {
+    if (!auth_enabled || strcmp(tenant->members, "*") == 0) return 1;
+    size_t len = strlen(user);
+    for (const char* p = tenant->members; *p; ) {
+        size_t n = strcspn(p, ",");
+        if (n == len && strncmp(p, user, n) == 0) return 1;
+        p += n;
+        if (*p == ',') p++;
+    }
+    return 0;
+}
+
+// The tenant a request addresses: an X-Tenant header, or a tenant= query
+// parameter where headers cannot be set. NULL if it names no known tenant.
+Tenant* request_tenant(const char* headers, const char* url) {
+    char name[64];
+    if (header_value(headers, "X-Tenant", name, sizeof(name)) != 0 &&
+        query_param(url, "tenant", name, sizeof(name)) != 0) {
+        return find_tenant(DEFAULT_TENANT);
+    }
+    return find_tenant(name[0] ? name : DEFAULT_TENANT);
+}
+
+// Finds the session token of a request: an "Authorization: Bearer" header, or a
+// token= query parameter where headers cannot be set (WebSocket upgrades)
+int request_token(const char* headers, const char* url, char* out, size_t out_size) {
+    char auth[512];
+    if (header_value(headers, "Authorization", auth, sizeof(auth)) == 0 && strncasecmp(auth, "Bearer ", 7) == 0) {
+        snprintf(out, out_size, "%s", auth + 7);
+        return 0;
+    }
+    return query_param(url, "token", out, out_size);
+}
+
+// Checks the request's token, the user's membership of tenant and their
+// permission on file (NULL for no particular file). On failure replies 401/403
+// and returns -1.
+int authorize_request(int socket, const char* headers, const char* url, Tenant* tenant, const char* file, int perm,
+                      char* user_out, size_t user_size) {
+    user_out[0] = '\0';
+    if (!auth_enabled) return 0;
+    char token[512];
+    if (request_token(headers, url, token, sizeof(token)) != 0 || auth_verify_token(token, user_out, user_size) != 0) {
+        send_response(socket, "401 Unauthorized", "application/json", "{\"error\":\"Login required\"}");
+        return -1;
+    }
+    if (!tenant_admits(tenant, user_out)) {
+        send_response(socket, "403 Forbidden", "application/json", "{\"error\":\"Not a member of this workspace\"}");
+        return -1;
+    }
+    if (file && (acl_perms(user_out, file) & perm) != perm) {
+        send_response(socket, "403 Forbidden", "application/json", "{\"error\":\"Permission denied\"}");
+        return -1;
+    }
+    return 0;
+}
+
+// GET /api/login says whether logging in is required; POST checks a password
+// and issues a token
+void login_handler(int socket, const char* method, const char* body) {
+    if (strcmp(method, "GET") == 0) {
+        send_response(socket, "200 OK", "application/json", auth_enabled ? "{\"required\":true}" : "{\"required\":false}");
+        return;
+    }
+    char name[64], raw_password[512];
+    if (!auth_enabled || !body || json_string_field(body, "username", name, sizeof(name)) != 0 ||
+        json_string_field(body, "password", raw_password, sizeof(raw_password)) != 0) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid request\"}");
+        return;
+    }
+    long password_len;
+    char* password = json_unescape(raw_password, raw_password + strlen(raw_password), &password_len);
+    
+    UserRecord* user = auth_users;
+    while (user && strcmp(user->name, name) != 0) user = user->next;
+    int ok = 0;
+    if (user) {
+        unsigned char hash[32];
+        password_hash(password, user->salt, user->iterations, hash);
+        ok = CRYPTO_memcmp(hash, user->hash, 32) == 0;
+    }
+    OPENSSL_cleanse(password, password_len);
+    mem_free(password);
+    if (!ok) {
+        printf("Failed login for %s\n", name);
+        send_response(socket, "401 Unauthorized", "application/json", "{\"error\":\"Invalid username or password\"}");
+        return;
+    }
+    
+    char token[256], reply[512];
+    long expires;
+    auth_issue_token(name, token, sizeof(token), &expires);
+    snprintf(reply, sizeof(reply), "{\"token\":\"%s\",\"username\":\"%s\",\"expires\":%ld}", token, name, expires);
+    send_response(socket, "200 OK", "application/json", reply);
+}
+
+#define DICT_MAX_BYTES (32 * 1024)
+#define DICT_SAMPLE_DOCS 256
+#define DICT_SAMPLE_MAX_BYTES (16 * 1024)
+#define DICT_MIN_DOCS 8
+#define DICT_SEGMENT 64
+#define DICT_KMER 8
+#define DICT_TABLE_BITS 18
+
+typedef struct {
+    const char* data;
+    long score;
+} DictSegment;
+
+// Caller holds tenant->fs_index_mutex
+static void dict_collect_paths(FsNode* dir, char* prefix, size_t prefix_len, char** paths, int* count) {
+    for (int i = 0; i < dir->child_count && *count < DICT_SAMPLE_DOCS; i++) {
+        FsNode* node = dir->children[i];
+        int n = snprintf(prefix + prefix_len, 512 - prefix_len, "%s%s", prefix_len ? "/" : "", node->name);
+        if (node->is_dir) {
+            dict_collect_paths(node, prefix, prefix_len + n, paths, count);
+        } else if (node->size >= DICT_SEGMENT && node->size <= DICT_SAMPLE_MAX_BYTES) {
+            paths[(*count)++] = mem_strdup(MEM_OTHER, prefix);
+        }
+    }
+}
+
+static uint32_t dict_kmer(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * XXH_PRIME64_1) >> (64 - DICT_TABLE_BITS));
+}
+
+// Sum of the counts of a segment's k-mers that occur in more than one document
+static long dict_score(const char* segment, const uint16_t* counts) {
+    long score = 0;
+    for (int i = 0; i + DICT_KMER <= DICT_SEGMENT; i++) {
+        uint16_t c = counts[dict_kmer(segment + i)];
+        if (c > 1) score += c;
+    }
+    return score;
+}
+
+static int dict_segment_cmp(const void* a, const void* b) {
+    long sa = ((const DictSegment*)a)->score, sb = ((const DictSegment*)b)->score;
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+// Trains the tenant's dictionary from a sample of its small documents, along
+// the lines of zstd's COVER trainer: k-mers are counted by how many documents
+// contain them, the segments richest in shared k-mers are picked greedily with
+// each k-mer counted once, and the best end up last, where deflate reaches
+// them most cheaply. Leaves tenant->dict NULL if there is too little to learn.
+static void tenant_train_dictionary(Tenant* tenant) {
+    char* paths[DICT_SAMPLE_DOCS];
+    char prefix[512] = "";
+    int path_count = 0;
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    dict_collect_paths(&tenant->fs_root, prefix, 0, paths, &path_count);
+    lock_release(&tenant->fs_index_mutex);
+    
+    char* samples[DICT_SAMPLE_DOCS];
+    long lens[DICT_SAMPLE_DOCS];
+    int count = 0;
+    for (int i = 0; i < path_count; i++) {
+        struct stat st;
+        samples[count] = tenant->storage->read(tenant, paths[i], &lens[count], &st);
+        if (samples[count] && lens[count] >= DICT_SEGMENT) count++;
+        else mem_free(samples[count]);
+        mem_free(paths[i]);
+    }
+    if (count < DICT_MIN_DOCS) {
+        for (int i = 0; i < count; i++) mem_free(samples[i]);
+        return;
+    }
+    
+    uint16_t* counts = mem_calloc(MEM_OTHER, 1 << DICT_TABLE_BITS, sizeof(uint16_t));
+    int* last_doc = mem_alloc(MEM_OTHER, (1 << DICT_TABLE_BITS) * sizeof(int));
+    memset(last_doc, 0xff, (1 << DICT_TABLE_BITS) * sizeof(int));
+    long segment_count = 0;
+    for (int d = 0; d < count; d++) {
+        for (long i = 0; i + DICT_KMER <= lens[d]; i++) {
+            uint32_t h = dict_kmer(samples[d] + i);
+            if (last_doc[h] != d && counts[h] < UINT16_MAX) counts[h]++;
+            last_doc[h] = d;
+        }
+        segment_count += lens[d] / DICT_SEGMENT;
+    }
+    mem_free(last_doc);
+    
+    DictSegment* segments = mem_alloc(MEM_OTHER, segment_count * sizeof(DictSegment));
+    long n = 0;
+    for (int d = 0; d < count; d++) {
+        for (long off = 0; off + DICT_SEGMENT <= lens[d]; off += DICT_SEGMENT) {
+            segments[n].data = samples[d] + off;
+            segments[n].score = dict_score(samples[d] + off, counts);
+            n++;
+        }
+    }
+    qsort(segments, n, sizeof(DictSegment), dict_segment_cmp);
+    
+    // Picked segments are written from the back so the best sits at the end
+    unsigned char* dict = mem_alloc(MEM_OTHER, DICT_MAX_BYTES);
+    long dict_len = 0;
+    for (long i = 0; i < n && dict_len + DICT_SEGMENT <= DICT_MAX_BYTES && segments[i].score > 0; i++) {
+        if (dict_score(segments[i].data, counts) < segments[i].score / 2) continue;
+        dict_len += DICT_SEGMENT;
+        memcpy(dict + DICT_MAX_BYTES - dict_len, segments[i].data, DICT_SEGMENT);
+        for (int k = 0; k + DICT_KMER <= DICT_SEGMENT; k++) counts[dict_kmer(segments[i].data + k)] = 0;
+    }
+    mem_free(segments);
+    mem_free(counts);
+    for (int i = 0; i < count; i++) mem_free(samples[i]);
+    if (dict_len == 0) {
+        mem_free(dict);
+        return;
+    }
+    memmove(dict, dict + DICT_MAX_BYTES - dict_len, dict_len);
+    tenant->dict = dict;
+    tenant->dict_len = dict_len;
+    printf("Workspace %s: trained a %ld byte dictionary on %d documents\n", tenant->name, dict_len, count);
+}
+
+// Loads the dictionary a packing backend stored with the tenant's documents,
+// or trains one (storing it first if the backend packs documents with it)
+static void tenant_dictionary_init(Tenant* tenant) {
+    long len;
+    struct stat st;
+    if (tenant->storage->packs_values) {
+        char* saved = tenant->storage->read(tenant, DICT_KEY, &len, &st);
+        if (saved) {
+            tenant->dict = (unsigned char*)saved;
+            tenant->dict_len = len;
+            return;
+        }
+    }
+    tenant_train_dictionary(tenant);
+    if (tenant->dict && tenant->storage->packs_values &&
+        tenant->storage->write(tenant, DICT_KEY, (const char*)tenant->dict, tenant->dict_len, NULL, 0) != 0) {
+        printf("Workspace %s: cannot store dictionary: %s\n", tenant->name, strerror(errno));
+        mem_free(tenant->dict);
+        tenant->dict = NULL;
+        tenant->dict_len = 0;
+    }
+}
+
+// Snapshot of a tenant's file index (<files dir>.index), written by the
+// checkpointer and loaded at startup in place of a scan of storage. The header
+// is followed by one IndexEntry and its path per node, parents first; the
+// checksum covers everything after the header.
+#define INDEX_MAGIC 0x58444945u
+#define INDEX_VERSION 2
+#define INDEX_CHECKPOINT_SECONDS 60
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char backend[8];
+    uint64_t count;
+    uint64_t body_len;
+    uint64_t checksum;
+} IndexHeader;
+
+typedef struct {
+    int64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    uint16_t path_len;
+    uint8_t is_dir;
+    uint8_t pad;
+    uint32_t mtime_nsec;
+} IndexEntry;
+
+// Caller holds the tenant's fs_index_mutex
+static void index_snapshot_collect(FsNode* dir, char* prefix, size_t prefix_len, ByteBuffer* out, uint64_t* count) {
+    for (int i = 0; i < dir->child_count; i++) {
+        FsNode* node = dir->children[i];
+        int n = snprintf(prefix + prefix_len, 512 - prefix_len, "%s%s", prefix_len ? "/" : "", node->name);
+        IndexEntry entry = {node->is_dir ? 0 : node->size, node->mtime, node->hash, prefix_len + n, node->is_dir, 0, node->mtime_nsec};
+        byte_buffer_append(out, &entry, sizeof(entry));
+        byte_buffer_append(out, prefix, prefix_len + n);
+        (*count)++;
+        if (node->is_dir) index_snapshot_collect(node, prefix, prefix_len + n, out, count);
+    }
+}
+
+// Writes the tenant's index to its snapshot if it changed since the last one.
+// Returns -1 if the snapshot could not be replaced.
+int index_snapshot_save(Tenant* tenant) {
+    IndexHeader header = {INDEX_MAGIC, INDEX_VERSION, "", 0, 0, 0};
+    ByteBuffer body = {0};
+    char prefix[512] = "";
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    long changes = tenant->fs_changes;
+    if (changes != tenant->fs_snapshot_changes) index_snapshot_collect(&tenant->fs_root, prefix, 0, &body, &header.count);
+    lock_release(&tenant->fs_index_mutex);
+    if (changes == tenant->fs_snapshot_changes) return 0;
+    
+    snprintf(header.backend, sizeof(header.backend), "%s", tenant->storage->name);
+    header.body_len = body.len;
+    header.checksum = xxh64(body.data, body.len, 0);
+    char tmp_path[160];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", tenant->index_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && pwrite_all(fd, (const char*)&header, sizeof(header), 0) == 0 &&
+             pwrite_all(fd, (const char*)body.data, body.len, sizeof(header)) == 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    ok = ok && rename(tmp_path, tenant->index_path) == 0;
+    mem_free(body.data);
+    if (!ok) {
+        printf("Workspace %s: cannot write index snapshot: %s\n", tenant->name, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    tenant->fs_snapshot_changes = changes;
+    lock_release(&tenant->fs_index_mutex);
+    return 0;
+}
+
+// Fills the tenant's empty index from its snapshot. Returns -1, with the index
+// left empty, if there is none or it does not validate.
+static int index_snapshot_load(Tenant* tenant) {
+    int fd = open(tenant->index_path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(IndexHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    
+    IndexHeader header;
+    memcpy(&header, map, sizeof(header));
+    const char* body = map + sizeof(header);
+    long body_len = st.st_size - sizeof(header);
+    int ok = header.magic == INDEX_MAGIC && header.version == INDEX_VERSION &&
+             strncmp(header.backend, tenant->storage->name, sizeof(header.backend)) == 0 &&
+             header.body_len == (uint64_t)body_len && xxh64(body, body_len, 0) == header.checksum;
+    long offset = 0;
+    for (uint64_t i = 0; ok && i < header.count; i++) {
+        IndexEntry entry;
+        char path[512];
+        if (offset + (long)sizeof(entry) > body_len) break;
+        memcpy(&entry, body + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.path_len == 0 || entry.path_len >= sizeof(path) || offset + entry.path_len > body_len) break;
+        memcpy(path, body + offset, entry.path_len);
+        path[entry.path_len] = '\0';
+        offset += entry.path_len;
+        if (!valid_path(path)) break;
+        if (entry.is_dir) {
+            fs_index_mkdir(tenant, path, entry.mtime);
+        } else {
+            struct timespec mtime = {entry.mtime, entry.mtime_nsec};
+            fs_index_update(tenant, path, entry.size, mtime);
+            if (entry.hash) fs_index_set_hash(tenant, path, entry.size, mtime, entry.hash);
+        }
+    }
+    ok = ok && offset == body_len;
+    munmap(map, st.st_size);
+    
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    if (ok) tenant->fs_snapshot_changes = tenant->fs_changes;
+    else fs_index_sweep(&tenant->fs_root, tenant->fs_generation + 1);
+    lock_release(&tenant->fs_index_mutex);
+    if (!ok) printf("Workspace %s: ignoring invalid index snapshot %s\n", tenant->name, tenant->index_path);
+    return ok ? 0 : -1;
+}
+
+// Brings an index loaded from a snapshot in line with storage: a fresh scan
+// marks everything it finds with a new generation, and whatever it did not
+// find is then dropped. Requests are served from the snapshot meanwhile.
+static void* index_reconcile(void* arg) {
+    Tenant* tenant = arg;
+    thread_role("reconcile");
+    // A one-off background pass rather than a loop, so not watched for stalls
+    thread_wait("scan");
+    long long start = now_ms();
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    unsigned generation = ++tenant->fs_generation;
+    lock_release(&tenant->fs_index_mutex);
+    
+    tenant->storage->scan(tenant);
+    
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    long dropped = fs_index_sweep(&tenant->fs_root, generation);
+    tenant->fs_changes += dropped;
+    tenant->fs_reconciling = 0;
+    long files = tenant->fs_root.files;
+    lock_release(&tenant->fs_index_mutex);
+    printf("Workspace %s: index reconciled in %lld ms, %ld files (%ld gone)\n",
+        tenant->name, now_ms() - start, files, dropped);
+    return NULL;
+}
+
+// Holds SIGINT and SIGTERM (blocked in every thread) and, every
+// INDEX_CHECKPOINT_SECONDS and before exiting on one of them, writes the
+// snapshot of each tenant whose index changed
+void mem_report(void);
+
+void* index_checkpointer(void* arg) {
+    const sigset_t* signals = arg;
+    struct timespec interval = {INDEX_CHECKPOINT_SECONDS, 0};
+    thread_role("checkpoint");
+    while (1) {
+        thread_wait("wait");
+        int sig = sigtimedwait(signals, NULL, &interval);
+        thread_state("save");
+        for (Tenant* tenant = tenants; tenant; tenant = tenant->next) index_snapshot_save(tenant);
+        if (sig > 0) {
+            printf("Index snapshots written, exiting on signal %d\n", sig);
+            if (mem_accounting) mem_report();
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+// Opens (creating it if needed) a tenant's storage and indexes it. Returns
+// NULL if the storage cannot be opened.
+Tenant* tenant_create(const char* name, const char* files_dir, const char* chat_dir) {
+    Tenant* tenant = mem_calloc(MEM_OTHER, 1, sizeof(Tenant));
+    tenant->storage = storage_backend;
+    tenant->root_fd = -1;
+    if (tenant->storage->open(tenant, files_dir) != 0) {
+        printf("Cannot open %s storage at %s: %s\n", tenant->storage->name, files_dir, strerror(errno));
+        mem_free(tenant);
+        return NULL;
+    }
+    snprintf(tenant->name, sizeof(tenant->name), "%s", name);
+    snprintf(tenant->chat_dir, sizeof(tenant->chat_dir), "%s", chat_dir);
+    strcpy(tenant->members, "*");
+    tenant->fs_root.name = "";
+    tenant->fs_root.is_dir = 1;
+    pthread_mutex_init(&tenant->documents_mutex, NULL);
+    pthread_mutex_init(&tenant->chat_rooms_mutex, NULL);
+    pthread_mutex_init(&tenant->fs_index_mutex, NULL);
+    pthread_mutex_init(&tenant->quota_lock, NULL);
+    // With a snapshot the index is usable at once and storage is rescanned in
+    // the background; without one the scan has to finish first
+    snprintf(tenant->index_path, sizeof(tenant->index_path), "%s.index", files_dir);
+    pthread_t reconcile_thread;
+    if (index_snapshot_load(tenant) == 0) {
+        tenant->fs_reconciling = 1;
+        if (pthread_create(&reconcile_thread, NULL, index_reconcile, tenant) == 0) {
+            pthread_detach(reconcile_thread);
+        } else {
+            index_reconcile(tenant);
+        }
+    } else {
+        tenant->storage->scan(tenant);
+    }
+    tenant_dictionary_init(tenant);
+    tenant->next = tenants;
+    tenants = tenant;
+    printf("Workspace %s: %ld files (%ld bytes)%s\n", name, tenant->fs_root.files, tenant->fs_root.size,
+        tenant->fs_reconciling ? " from index snapshot" : "");
+    return tenant;
+}
+
+// Creates the default tenant on ./files and ./chat, then those listed in
+// ./tenants/config, one per line:
+//   <name> <connections> <memory MiB> <outbound KiB/s> <CPU ms/s> [member,...]
+// where 0 means no limit and a missing member list or "*" admits anyone. A
+// line for "default" sets the default tenant's quotas; the others keep their
+// files and chat under ./tenants/<name>/.
+int tenant_load(void) {
+    if (!tenant_create(DEFAULT_TENANT, "./files", "./chat")) return -1;
+    FILE* fp = fopen("./tenants/config", "r");
+    char line[1024];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        char name[64], members[512] = "*";
+        long connections, memory_mb, bandwidth_kb, cpu_ms;
+        if (line[0] == '#' || sscanf(line, "%63s %ld %ld %ld %ld %511s", name, &connections, &memory_mb,
+                                     &bandwidth_kb, &cpu_ms, members) < 5) {
+            continue;
+        }
+        if (!valid_username(name)) {
+            printf("Skipping workspace with invalid name %s\n", name);
+            continue;
+        }
+        Tenant* tenant = find_tenant(name);
+        if (!tenant) {
+            char dir[128], files_dir[128], chat_dir[128];
+            snprintf(dir, sizeof(dir), "./tenants/%s", name);
+            snprintf(files_dir, sizeof(files_dir), "./tenants/%s/files", name);
+            snprintf(chat_dir, sizeof(chat_dir), "./tenants/%s/chat", name);
+            mkdir("./tenants", 0755);
+            mkdir(dir, 0755);
+            tenant = tenant_create(name, files_dir, chat_dir);
+            if (!tenant) continue;
+        }
+        tenant->max_connections = connections;
+        tenant->max_doc_bytes = memory_mb << 20;
+        tenant->bandwidth.rate = tenant->bandwidth.tokens = bandwidth_kb * 1024.0;
+        tenant->cpu.rate = tenant->cpu.tokens = cpu_ms * 1000.0;
+        snprintf(tenant->members, sizeof(tenant->members), "%s", members);
+    }
+    if (fp) fclose(fp);
+    return 0;
+}
+
+// --bench-storage [n]: saves, opens, lists and deletes n small documents (in
+// folders of 100) with each backend in a scratch directory, and prints the mean
+// latency of each operation
+int storage_bench(int count) {
+    const StorageBackend* backends[] = {&fs_storage, &kv_storage};
+    char dir[64], path[64], content[4096];
+    if (count <= 0) count = 10000;
+    snprintf(dir, sizeof(dir), "./bench-storage-%d", (int)getpid());
+    printf("%d documents per backend\n", count);
+    printf("%-8s %10s %10s %10s %10s\n", "backend", "save us", "open us", "list ms", "delete us");
+    for (int b = 0; b < 2; b++) {
+        Tenant tenant = {0};
+        tenant.storage = backends[b];
+        tenant.root_fd = -1;
+        tenant.fs_root.name = "";
+        tenant.fs_root.is_dir = 1;
+        pthread_mutex_init(&tenant.fs_index_mutex, NULL);
+        pthread_mutex_init(&tenant.quota_lock, NULL);
+        if (tenant.storage->open(&tenant, dir) != 0) {
+            printf("Cannot open %s storage at %s: %s\n", tenant.storage->name, dir, strerror(errno));
+            return 1;
+        }
+        
+        long long start = now_us();
+        for (int i = 0; i < count; i++) {
+            int len = 256 + (i * 7919) % 3840;
+            for (int j = 0; j < len; j++) content[j] = 'a' + (i + j) % 26;
+            snprintf(path, sizeof(path), "d%03d/doc%06d.txt", i / 100, i);
+            if (tenant.storage->write(&tenant, path, content, len, NULL, 0) != 0) {
+                printf("Save failed: %s\n", strerror(errno));
+                return 1;
+            }
+        }
+        double save_us = (double)(now_us() - start) / count;
+        
+        start = now_us();
+        for (int i = 0; i < count; i++) {
+            snprintf(path, sizeof(path), "d%03d/doc%06d.txt", i / 100, i);
+            long len;
+            struct stat st;
+            mem_free(tenant.storage->read(&tenant, path, &len, &st));
+        }
+        double open_us = (double)(now_us() - start) / count;
+        
+        start = now_us();
+        tenant.storage->scan(&tenant);
+        double list_ms = (now_us() - start) / 1000.0;
+        
+        start = now_us();
+        for (int i = 0; i < count; i++) {
+            snprintf(path, sizeof(path), "d%03d/doc%06d.txt", i / 100, i);
+            tenant.storage->remove(&tenant, path);
+        }
+        double delete_us = (double)(now_us() - start) / count;
+        printf("%-8s %10.1f %10.1f %10.2f %10.1f\n", tenant.storage->name, save_us, open_us, list_ms, delete_us);
+        
+        if (tenant.root_fd >= 0) {
+            for (int i = 0; i < count; i += 100) {
+                snprintf(path, sizeof(path), "d%03d", i / 100);
+                unlinkat(tenant.root_fd, path, AT_REMOVEDIR);
+            }
+            close(tenant.root_fd);
+            rmdir(dir);
+        }
+        if (tenant.store) {
+            KvStore* store = tenant.store;
+            munmap(store->map, store->map_size);
+            close(store->fd);
+            unlink(store->path);
+        }
+    }
+    return 0;
+}
+
+// --bench-tls: pushes mb MiB over loopback to a local TLS client, once as
+// 64 KiB writes (as broadcast frames go out) and once with send_file, over
+// plain TCP, user-space TLS and kTLS
+typedef struct TlsBenchClient {
+    int port;
+    SSL_CTX* ctx;
+    long received;
+} TlsBenchClient;
+
+static void* tls_bench_client(void* arg) {
+    TlsBenchClient* c = arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(c->port);
+    c->received = 0;
+    SSL* ssl = NULL;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        if (c->ctx) {
+            ssl = SSL_new(c->ctx);
+            SSL_set_fd(ssl, fd);
+        }
+        if (!ssl || SSL_connect(ssl) == 1) {
+            char buffer[65536];
+            while (1) {
+                size_t got = 0;
+                long n = ssl ? (SSL_read_ex(ssl, buffer, sizeof(buffer), &got) == 1 ? (long)got : 0) : recv(fd, buffer, sizeof(buffer), 0);
+                if (n <= 0) break;
+                c->received += n;
+            }
+        }
+    }
+    if (ssl) SSL_free(ssl);
+    close(fd);
+    return NULL;
+}
+
+// One transfer of bytes to a fresh connection. Returns MiB/s, or -1 if it
+// failed, or if kTLS was asked for and the kernel did not take the session.
+static double tls_bench_run(int listener, int port, SSL_CTX* ctx, SSL_CTX* client_ctx, int ktls, int file_fd, long bytes, int use_sendfile) {
+    TlsBenchClient client = {port, ctx ? client_ctx : NULL, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, tls_bench_client, &client);
+    int fd = accept(listener, NULL, NULL);
+    long long start = now_us();
+    int ok = fd >= 0 && tls_accept(ctx, fd, 0) == 0 && (!ktls || tls_conns[fd]->ktls_send);
+    if (ok && use_sendfile) {
+        lseek(file_fd, 0, SEEK_SET);
+        ok = send_file(fd, file_fd, bytes) == 0;
+    } else if (ok) {
+        static char frame[65536];
+        for (long left = bytes; ok && left > 0; left -= sizeof(frame)) {
+            ok = send_all(fd, frame, left < (long)sizeof(frame) ? left : (long)sizeof(frame)) == 0;
+        }
+    }
+    if (fd >= 0) tls_close(fd);
+    pthread_join(thread, NULL);
+    double seconds = (now_us() - start) / 1e6;
+    return ok && client.received == bytes ? bytes / 1048576.0 / seconds : -1;
+}
+
+int tls_bench(const char* cert, const char* key, int mb) {
+    if (!cert || !key) {
+        printf("--bench-tls needs --tls-cert and --tls-key first\n");
+        return 1;
+    }
+    if (mb <= 0) mb = 256;
+    SSL_CTX* user_ctx = tls_context(cert, key, 0);
+    SSL_CTX* ktls_ctx = tls_context(cert, key, 1);
+    SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+    if (!user_ctx || !ktls_ctx || !client_ctx) return 1;
+    
+    char path[64];
+    snprintf(path, sizeof(path), "./bench-tls-%d", (int)getpid());
+    int file_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (file_fd < 0) {
+        printf("Cannot create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    unlink(path);
+    long bytes = (long)mb << 20;
+    char block[65536];
+    for (long i = 0; i < (long)sizeof(block); i++) block[i] = 'a' + i % 26;
+    for (long left = bytes; left > 0; left -= sizeof(block)) {
+        if (write(file_fd, block, left < (long)sizeof(block) ? left : (long)sizeof(block)) < 0) {
+            printf("Cannot write %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    }
+    
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &addr_len) != 0) {
+        printf("Cannot listen on loopback: %s\n", strerror(errno));
+        return 1;
+    }
+    int port = ntohs(addr.sin_port);
+    
+    struct { const char* name; SSL_CTX* ctx; int ktls; } modes[] = {{"tcp", NULL, 0}, {"tls", user_ctx, 0}, {"ktls", ktls_ctx, 1}};
+    printf("%d MiB per transfer\n", mb);
+    printf("%-8s %14s %14s\n", "mode", "write MiB/s", "sendfile MiB/s");
+    for (int m = 0; m < 3; m++) {
+        double written = tls_bench_run(listener, port, modes[m].ctx, client_ctx, modes[m].ktls, file_fd, bytes, 0);
+        double sent = tls_bench_run(listener, port, modes[m].ctx, client_ctx, modes[m].ktls, file_fd, bytes, 1);
+        if (written < 0 || sent < 0) {
+            printf("%-8s %s\n", modes[m].name, modes[m].ktls ? "not available (is the tls kernel module loaded?)" : "failed");
+            continue;
+        }
+        printf("%-8s %14.0f %14.0f\n", modes[m].name, written, sent);
+    }
+    close(listener);
+    close(file_fd);
+    return 0;
+}
+
+static double ratio(long raw, long packed) {
+    return packed ? (double)raw / packed : 0;
+}
+
+// GET /api/workspace: the tenant's quotas and what it is using of them, and
+// how well its idle documents (in memory) and stored documents compress
+void workspace_info(int socket, Tenant* tenant) {
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    long files = tenant->fs_root.files, file_bytes = tenant->fs_root.size;
+    int reconciling = tenant->fs_reconciling;
+    lock_release(&tenant->fs_index_mutex);
+    
+    char reply[2048];
+    pthread_mutex_lock(&tenant->quota_lock);
+    CompressionStats* c = &tenant->compression;
+    snprintf(reply, sizeof(reply),
+        "{\"name\":\"%s\",\"files\":%ld,\"file_bytes\":%ld,\"index_reconciling\":%s,\"connections\":%d,\"max_connections\":%d,"
+        "\"doc_bytes\":%ld,\"max_doc_bytes\":%ld,\"bandwidth\":%.0f,\"cpu_ms\":%.0f,"
+        "\"compression\":{\"dictionary_bytes\":%ld,\"packed_docs\":%ld,\"packed_raw_bytes\":%ld,"
+        "\"packed_bytes\":%ld,\"packed_ratio\":%.2f,\"unpacks\":%ld,\"unpack_avg_us\":%.1f,"
+        "\"unpack_max_us\":%lld,\"stored_raw_bytes\":%ld,\"stored_bytes\":%ld,\"stored_ratio\":%.2f}}",
+        tenant->name, files, file_bytes, reconciling ? "true" : "false", tenant->connections, tenant->max_connections,
+        __atomic_load_n(&tenant->doc_bytes, __ATOMIC_RELAXED), tenant->max_doc_bytes,
+        tenant->bandwidth.rate, tenant->cpu.rate / 1000,
+        tenant->dict_len, c->packed_docs, c->packed_raw_bytes, c->packed_bytes,
+        ratio(c->packed_raw_bytes, c->packed_bytes), c->unpacks,
+        c->unpacks ? (double)c->unpack_us / c->unpacks : 0, c->unpack_max_us,
+        c->stored_raw_bytes, c->stored_bytes, ratio(c->stored_raw_bytes, c->stored_bytes));
+    pthread_mutex_unlock(&tenant->quota_lock);
+    send_response(socket, "200 OK", "application/json", reply);
+}
+
+// A connection as /admin/state reports it, with names already JSON-escaped
+typedef struct {
+    Tenant* tenant;
+    char file[256];
+    char user_json[64 * 6];
+    char file_json[256 * 6];
+    int socket;
+    int follower;
+    long long connected_ms;
+    long long last_active_ms;
+    long queued_bytes;
+    int queued_frames;
+    long msgs_in;
+    long bytes_in;
+    long in_rate;
+    long msgs_out;
+    long bytes_out;
+    long out_rate;
+} ConnectionSnapshot;
+
+// HTTP/2 requests are served on a socketpair; this maps the handler's end to
+// the client connection (plus one) it stands for
+static int http_origins[TLS_MAX_FDS];
+
+int request_from_localhost(int socket) {
+    if (socket < TLS_MAX_FDS && http_origins[socket]) socket = http_origins[socket] - 1;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    return getpeername(socket, (struct sockaddr*)&addr, &len) == 0 && addr.sin_family == AF_INET &&
+           ntohl(addr.sin_addr.s_addr) >> 24 == 127;
+}
+
+// GET /admin/state (localhost only): every connection with its traffic and
+// outbound queue, and every document that is loaded or has members (a room)
+// with its size and edit rate, across all workspaces. Counters are read as
+// their owners last wrote them, without taking any client's or document's
+// lock; clients_mutex is held only while the connections are copied.
+void admin_state(int socket) {
+    long long now = now_ms();
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    int count = 0;
+    for (Client* c = clients; c; c = c->next) count++;
+    ConnectionSnapshot* conns = mem_calloc(MEM_HTTP, count ? count : 1, sizeof(ConnectionSnapshot));
+    count = 0;
+    for (Client* c = clients; c; c = c->next) {
+        if (!c->active) continue;
+        ConnectionSnapshot* s = &conns[count++];
+        s->tenant = c->tenant;
+        snprintf(s->file, sizeof(s->file), "%s", c->current_file);
+        *json_escape(c->username, strlen(c->username), s->user_json) = '\0';
+        *json_escape(s->file, strlen(s->file), s->file_json) = '\0';
+        s->socket = c->socket;
+        s->follower = c->follower;
+        s->connected_ms = c->connected_ms;
+        s->last_active_ms = __atomic_load_n(&c->last_active_ms, __ATOMIC_RELAXED);
+        s->queued_bytes = __atomic_load_n(&c->out_queued, __ATOMIC_RELAXED) - __atomic_load_n(&c->out_sent, __ATOMIC_RELAXED);
+        s->queued_frames = __atomic_load_n(&c->out_frames, __ATOMIC_RELAXED);
+        s->msgs_in = __atomic_load_n(&c->msgs_in, __ATOMIC_RELAXED);
+        s->bytes_in = __atomic_load_n(&c->bytes_in, __ATOMIC_RELAXED);
+        s->in_rate = rate_read(&c->in_rate, now);
+        s->msgs_out = __atomic_load_n(&c->msgs_out, __ATOMIC_RELAXED);
+        s->bytes_out = __atomic_load_n(&c->bytes_out, __ATOMIC_RELAXED);
+        s->out_rate = rate_read(&c->out_rate, now);
+    }
+    lock_release(&clients_mutex);
+    
+    ByteBuffer out = {0};
+    char entry[2048];
+    long queued_total = 0;
+    byte_buffer_append(&out, "{\"connections\":[", 16);
+    for (int i = 0; i < count; i++) {
+        ConnectionSnapshot* s = &conns[i];
+        queued_total += s->queued_bytes;
+        int n = snprintf(entry, sizeof(entry),
+            "%s{\"workspace\":\"%s\",\"user\":\"%s\",\"file\":\"%s\",\"socket\":%d,\"follower\":%s,\"connected_s\":%lld,"
+            "\"idle_ms\":%lld,\"queued_frames\":%d,\"queued_bytes\":%ld,\"msgs_in\":%ld,\"bytes_in\":%ld,"
+            "\"msgs_in_per_s\":%ld,\"msgs_out\":%ld,\"bytes_out\":%ld,\"msgs_out_per_s\":%ld}",
+            i ? "," : "", s->tenant->name, s->user_json, s->file_json, s->socket, s->follower ? "true" : "false",
+            (now - s->connected_ms) / 1000,
+            now - s->last_active_ms, s->queued_frames, s->queued_bytes, s->msgs_in, s->bytes_in, s->in_rate,
+            s->msgs_out, s->bytes_out, s->out_rate);
+        byte_buffer_append(&out, entry, n);
+    }
+    
+    byte_buffer_append(&out, "],\"rooms\":[", 11);
+    int rooms = 0;
+    for (Tenant* tenant = tenants; tenant; tenant = tenant->next) {
+        // Documents are only ever added at the head and never freed
+        lock_acquire(&tenant->documents_mutex, LOCK_DOCUMENTS);
+        Document* doc = tenant->documents;
+        lock_release(&tenant->documents_mutex);
+        for (; doc; doc = doc->next) {
+            int members = 0;
+            for (int i = 0; i < count; i++) {
+                if (conns[i].tenant == tenant && strcmp(conns[i].file, doc->name) == 0) members++;
+            }
+            int packed = __atomic_load_n(&doc->packed, __ATOMIC_RELAXED) != NULL;
+            if (!members && !packed && !__atomic_load_n(&doc->content, __ATOMIC_RELAXED)) continue;
+            char name[256 * 6 + 1];
+            *json_escape(doc->name, strlen(doc->name), name) = '\0';
+            int n = snprintf(entry, sizeof(entry),
+                "%s{\"workspace\":\"%s\",\"file\":\"%s\",\"members\":%d,\"bytes\":%ld,\"room_bytes\":%ld,"
+                "\"queued_bytes\":%ld,\"packed\":%s,\"dirty\":%s,\"revision\":%ld,\"ops\":%ld,\"ops_per_s\":%ld}",
+                rooms++ ? "," : "", tenant->name, name, members, __atomic_load_n(&doc->length, __ATOMIC_RELAXED),
+                room_bytes(doc), __atomic_load_n(&doc->queued_bytes, __ATOMIC_RELAXED),
+                packed ? "true" : "false", __atomic_load_n(&doc->dirty, __ATOMIC_RELAXED) ? "true" : "false",
+                __atomic_load_n(&doc->revision, __ATOMIC_RELAXED), __atomic_load_n(&doc->ops, __ATOMIC_RELAXED),
+                rate_read(&doc->op_rate, now));
+            byte_buffer_append(&out, entry, n);
+        }
+    }
+    int n = snprintf(entry, sizeof(entry), "],\"connection_count\":%d,\"room_count\":%d,\"queued_bytes\":%ld}",
+        count, rooms, queued_total);
+    byte_buffer_append(&out, entry, n + 1);
+    mem_free(conns);
+    send_response(socket, "200 OK", "application/json", (const char*)out.data);
+    mem_free(out.data);
+}
+
+// On-demand sampling profiler behind GET /admin/profile. ITIMER_PROF sends
+// SIGPROF to whichever thread is burning CPU, hz times per CPU-second. The
+// handler walks that thread's frame pointers from the interrupted context,
+// reading each frame through process_vm_readv so a bad pointer fails instead
+// of faulting, and claims a slot in a preallocated buffer with an atomic add.
+// Symbols are resolved after sampling stops, from the executable's symbol
+// table (static functions included) and dladdr for shared libraries. Stacks
+// are most complete when built with -fno-omit-frame-pointer.
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_MAX_SAMPLES 65536
+#define PROFILE_MAX_SECONDS 60
+#define PROFILE_STACK_SPAN (8L << 20)
+
+#if defined(__x86_64__)
+#define PROFILE_PC(uc) ((uintptr_t)(uc)->uc_mcontext.gregs[REG_RIP])
+#define PROFILE_FP(uc) ((uintptr_t)(uc)->uc_mcontext.gregs[REG_RBP])
+#define PROFILE_SP(uc) ((uintptr_t)(uc)->uc_mcontext.gregs[REG_RSP])
+#elif defined(__aarch64__)
+#define PROFILE_PC(uc) ((uintptr_t)(uc)->uc_mcontext.pc)
+#define PROFILE_FP(uc) ((uintptr_t)(uc)->uc_mcontext.regs[29])
+#define PROFILE_SP(uc) ((uintptr_t)(uc)->uc_mcontext.sp)
+#endif
+
+typedef struct {
+    int depth;
+    uintptr_t pcs[PROFILE_MAX_DEPTH];
+} ProfileSample;
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    const char* name;
+} ProfileSymbol;
+
+pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ProfileSample* profile_samples;
+static long profile_capacity;
+static long profile_next;
+static int profile_active;
+static int profile_walk;
+static pid_t profile_pid;
+static ProfileSymbol* profile_symbols;
+static long profile_symbol_count;
+static pthread_once_t profile_symbols_once = PTHREAD_ONCE_INIT;
+
+static int profile_read(void* out, uintptr_t addr, size_t len) {
+    struct iovec local = {out, len}, remote = {(void*)addr, len};
+    return process_vm_readv(profile_pid, &local, 1, &remote, 1, 0) == (ssize_t)len ? 0 : -1;
+}
+
+// Checks whether stacks can be read safely; without process_vm_readv only
+// the interrupted function is recorded
+static void profile_unwind_init(void) {
+    long probe = 0;
+    profile_pid = getpid();
+    profile_walk = profile_read(&probe, (uintptr_t)&probe, sizeof(probe)) == 0;
+}
+
+// Async-signal-safe. Fills pcs with the interrupted address followed by the
+// return addresses of its callers and returns how many there are.
+static int profile_unwind(void* context, uintptr_t* pcs, int max) {
+#ifdef PROFILE_PC
+    ucontext_t* uc = context;
+    uintptr_t fp = PROFILE_FP(uc), sp = PROFILE_SP(uc);
+    int depth = 0;
+    pcs[depth++] = PROFILE_PC(uc);
+    // A frame record is the caller's frame pointer followed by the return address
+    while (profile_walk && depth < max && fp >= sp && fp - sp < PROFILE_STACK_SPAN && !(fp & 7)) {
+        uintptr_t frame[2];
+        if (profile_read(frame, fp, sizeof(frame)) != 0 || !frame[1]) break;
+        pcs[depth++] = frame[1];
+        if (frame[0] <= fp) break;
+        sp = fp;
+        fp = frame[0];
+    }
+    return depth;
+#else
+    (void)context;
+    (void)pcs;
+    (void)max;
+    return 0;
+#endif
+}
+
+static void profile_signal(int sig, siginfo_t* info, void* context) {
+    (void)sig;
+    (void)info;
+    if (!__atomic_load_n(&profile_active, __ATOMIC_ACQUIRE)) return;
+    long slot = __atomic_fetch_add(&profile_next, 1, __ATOMIC_RELAXED);
+    if (slot >= profile_capacity) return;
+    int saved_errno = errno;
+    ProfileSample* sample = &profile_samples[slot];
+    __atomic_store_n(&sample->depth, profile_unwind(context, sample->pcs, PROFILE_MAX_DEPTH), __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+static int profile_symbol_cmp(const void* a, const void* b) {
+    uintptr_t x = ((const ProfileSymbol*)a)->start, y = ((const ProfileSymbol*)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+// Loads the function symbols of the running executable (once, through
+// profile_symbols_once); a stripped binary leaves the table empty
+static void profile_load_symbols(void) {
+    Dl_info self;
+    if (!dladdr((void*)profile_load_symbols, &self)) return;
+    int fd = open("/proc/self/exe", O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    const unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)map;
+    if (st.st_size < (off_t)sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > (uint64_t)st.st_size) {
+        munmap((void*)map, st.st_size);
+        return;
+    }
+    // Names point into the mapping, which therefore stays
+    const Elf64_Shdr* sections = (const Elf64_Shdr*)(map + eh->e_shoff);
+    uintptr_t base = eh->e_type == ET_DYN ? (uintptr_t)self.dli_fbase : 0;
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= eh->e_shnum) continue;
+        const Elf64_Sym* syms = (const Elf64_Sym*)(map + sections[i].sh_offset);
+        const char* names = (const char*)map + sections[sections[i].sh_link].sh_offset;
+        long count = sections[i].sh_size / sizeof(Elf64_Sym);
+        profile_symbols = mem_alloc(MEM_OTHER, count * sizeof(ProfileSymbol));
+        for (long j = 0; j < count; j++) {
+            if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC || !syms[j].st_value) continue;
+            profile_symbols[profile_symbol_count++] =
+                (ProfileSymbol){base + syms[j].st_value, base + syms[j].st_value + syms[j].st_size, names + syms[j].st_name};
+        }
+        qsort(profile_symbols, profile_symbol_count, sizeof(ProfileSymbol), profile_symbol_cmp);
+        break;
+    }
+}
+
+static const char* profile_symbol(uintptr_t pc, char* buf, size_t size) {
+    long lo = 0, hi = profile_symbol_count;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (profile_symbols[mid].start <= pc) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > 0 && pc < profile_symbols[lo - 1].end) return profile_symbols[lo - 1].name;
+    Dl_info info = {0};
+    int found = dladdr((void*)pc, &info);
+    if (found && info.dli_sname) return info.dli_sname;
+    if (found && info.dli_fname) {
+        const char* file = strrchr(info.dli_fname, '/');
+        snprintf(buf, size, "[%s]", file ? file + 1 : info.dli_fname);
+    } else {
+        snprintf(buf, size, "0x%lx", (unsigned long)pc);
+    }
+    return buf;
+}
+
+static int profile_line_cmp(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// GET /admin/profile?seconds=<n>&hz=<rate> (localhost only): samples every
+// thread for n seconds (default 10) and replies with folded stacks, one
+// "outermost;...;leaf count" line per distinct stack, as flamegraph.pl and
+// speedscope read them. One profile runs at a time.
+void admin_profile(int socket, const char* url) {
+#ifndef PROFILE_PC
+    (void)url;
+    send_response(socket, "501 Not Implemented", "application/json", "{\"error\":\"Profiling is not supported on this CPU\"}");
+#else
+    char value[16];
+    int seconds = query_param(url, "seconds", value, sizeof(value)) == 0 ? atoi(value) : 10;
+    int hz = query_param(url, "hz", value, sizeof(value)) == 0 ? atoi(value) : 99;
+    if (seconds < 1 || seconds > PROFILE_MAX_SECONDS || hz < 1 || hz > 1000) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"seconds must be 1-60 and hz 1-1000\"}");
+        return;
+    }
+    if (pthread_mutex_trylock(&profile_mutex) != 0) {
+        send_response(socket, "409 Conflict", "application/json", "{\"error\":\"A profile is already running\"}");
+        return;
+    }
+    
+    profile_unwind_init();
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    profile_capacity = (long)seconds * hz * (cores > 0 ? cores : 1);
+    if (profile_capacity > PROFILE_MAX_SAMPLES) profile_capacity = PROFILE_MAX_SAMPLES;
+    profile_samples = mem_calloc(MEM_HTTP, profile_capacity, sizeof(ProfileSample));
+    profile_next = 0;
+    struct sigaction action = {0};
+    action.sa_sigaction = profile_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    
+    printf("Profiling for %d s at %d Hz%s\n", seconds, hz, profile_walk ? "" : " (leaf frames only)");
+    __atomic_store_n(&profile_active, 1, __ATOMIC_RELEASE);
+    struct itimerval timer = {{0, 1000000 / hz}, {0, 1000000 / hz}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    struct timespec left = {seconds, 0};
+    thread_wait("profile");
+    while (nanosleep(&left, &left) != 0 && errno == EINTR) {}
+    thread_state("handle");
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    __atomic_store_n(&profile_active, 0, __ATOMIC_RELEASE);
+    // Lets a handler still running on another thread finish its sample
+    struct timespec settle = {0, 20 * 1000000L};
+    nanosleep(&settle, NULL);
+    
+    pthread_once(&profile_symbols_once, profile_load_symbols);
+    long taken = profile_next < profile_capacity ? profile_next : profile_capacity;
+    char** lines = mem_alloc(MEM_HTTP, (taken ? taken : 1) * sizeof(char*));
+    long count = 0;
+    for (long i = 0; i < taken; i++) {
+        ProfileSample* sample = &profile_samples[i];
+        int depth = __atomic_load_n(&sample->depth, __ATOMIC_ACQUIRE);
+        if (!depth) continue;
+        ByteBuffer line = {0};
+        for (int d = depth - 1; d >= 0; d--) {
+            char buf[128];
+            // Return addresses point after the call, which may be the next function
+            const char* name = profile_symbol(sample->pcs[d] - (d > 0), buf, sizeof(buf));
+            if (d < depth - 1) byte_buffer_append(&line, ";", 1);
+            byte_buffer_append(&line, name, strlen(name));
+        }
+        byte_buffer_append(&line, "", 1);
+        lines[count++] = (char*)line.data;
+    }
+    qsort(lines, count, sizeof(char*), profile_line_cmp);
+    
+    ByteBuffer out = {0};
+    for (long i = 0; i < count;) {
+        long j = i + 1;
+        while (j < count && strcmp(lines[j], lines[i]) == 0) j++;
+        char tail[32];
+        int n = snprintf(tail, sizeof(tail), " %ld\n", j - i);
+        byte_buffer_append(&out, lines[i], strlen(lines[i]));
+        byte_buffer_append(&out, tail, n);
+        for (long k = i; k < j; k++) mem_free(lines[k]);
+        i = j;
+    }
+    byte_buffer_append(&out, "", 1);
+    long dropped = profile_next - taken;
+    mem_free(lines);
+    mem_free(profile_samples);
+    profile_samples = NULL;
+    pthread_mutex_unlock(&profile_mutex);
+    
+    printf("Profile done: %ld samples, %ld dropped\n", count, dropped);
+    send_response(socket, "200 OK", "text/plain", (const char*)out.data);
+    mem_free(out.data);
+#endif
+}
+
+typedef struct {
+    TraceSpan span;
+    pid_t tid;
+} TraceEvent;
+
+static int trace_event_cmp(const void* a, const void* b) {
+    const TraceEvent* x = a;
+    const TraceEvent* y = b;
+    if (x->span.trace != y->span.trace) return x->span.trace < y->span.trace ? -1 : 1;
+    return x->span.start_us < y->span.start_us ? -1 : x->span.start_us > y->span.start_us;
+}
+
+// GET /admin/trace (localhost only) returns the recorded spans as Chrome Trace
+// Event JSON for chrome://tracing or Perfetto; every span has its trace ID in
+// args. ?trace=<id> keeps one trace and ?min_ms=<n> only traces that took at
+// least n ms from receive to the last flush. ?rate=<0..1> sets the sampling rate instead.
+void admin_trace(int socket, const char* url) {
+    char value[32];
+    if (query_param(url, "rate", value, sizeof(value)) == 0) {
+        double rate = atof(value);
+        if (rate < 0 || rate > 1) {
+            send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"rate must be between 0 and 1\"}");
+            return;
+        }
+        __atomic_store_n(&trace_threshold, (uint32_t)(rate * UINT32_MAX), __ATOMIC_RELAXED);
+        printf("Tracing %.4g of messages\n", rate);
+        char response[64];
+        snprintf(response, sizeof(response), "{\"rate\":%.4g}", rate);
+        send_response(socket, "200 OK", "application/json", response);
+        return;
+    }
+    uint64_t only = query_param(url, "trace", value, sizeof(value)) == 0 ? strtoull(value, NULL, 16) : 0;
+    long long min_us = query_param(url, "min_ms", value, sizeof(value)) == 0 ? (long long)(atof(value) * 1000) : 0;
+    
+    // A span overwritten while being copied is dropped: only those still
+    // inside the ring after the copy are kept
+    long count = 0, capacity = 0;
+    TraceEvent* events = NULL;
+    pthread_mutex_lock(&thread_rings_mutex);
+    for (ThreadRing* ring = thread_rings; ring; ring = ring->next_ring) {
+        unsigned long end = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+        unsigned long begin = end > TRACE_RING_SPANS ? end - TRACE_RING_SPANS : 0;
+        if (count + (long)(end - begin) > capacity) {
+            capacity = count + (end - begin) + 1024;
+            events = mem_realloc(MEM_HTTP, events, capacity * sizeof(TraceEvent));
+        }
+        long first = count;
+        for (unsigned long i = begin; i < end; i++) {
+            events[count].span = ring->spans[i % TRACE_RING_SPANS];
+            events[count].tid = ring->tid;
+            count++;
+        }
+        unsigned long now_end = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+        if (now_end > begin + TRACE_RING_SPANS) {
+            long stale = now_end - TRACE_RING_SPANS - begin;
+            if (stale > count - first) stale = count - first;
+            memmove(events + first, events + first + stale, (count - first - stale) * sizeof(TraceEvent));
+            count -= stale;
+        }
+    }
+    pthread_mutex_unlock(&thread_rings_mutex);
+    if (count) qsort(events, count, sizeof(TraceEvent), trace_event_cmp);
+    
+    ByteBuffer out = {0};
+    const char* head = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    byte_buffer_append(&out, head, strlen(head));
+    int pid = getpid(), first = 1;
+    for (long i = 0; i < count;) {
+        long j = i;
+        long long begin = events[i].span.start_us, end = 0;
+        for (; j < count && events[j].span.trace == events[i].span.trace; j++) {
+            if (events[j].span.start_us + events[j].span.dur_us > end) end = events[j].span.start_us + events[j].span.dur_us;
+        }
+        if ((only && events[i].span.trace != only) || end - begin < min_us) {
+            i = j;
+            continue;
+        }
+        for (; i < j; i++) {
+            TraceSpan* span = &events[i].span;
+            char name[sizeof(span->name) * 6 + 1];
+            *json_escape(span->name, strlen(span->name), name) = '\0';
+            char event[512];
+            int n = snprintf(event, sizeof(event),
+                "%s{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%llx\"",
+                first ? "" : ",", name, span->start_us, span->dur_us, pid, events[i].tid, (unsigned long long)span->trace);
+            if (span->arg >= 0) n += snprintf(event + n, sizeof(event) - n, ",\"socket\":%ld", span->arg);
+            n += snprintf(event + n, sizeof(event) - n, "}}");
+            byte_buffer_append(&out, event, n);
+            first = 0;
+        }
+    }
+    byte_buffer_append(&out, "]}", 3);
+    mem_free(events);
+    send_response(socket, "200 OK", "application/json", (const char*)out.data);
+    mem_free(out.data);
+}
+
+// Crash flight recorder. On SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT the
+// handler writes every thread ring's state and recent events, unformatted,
+// to crash-<pid>.flight using only write(). It then raises the signal again
+// for its default action, such as a core dump. Read the file with
+// --read-flight <file>.
+#define FLIGHT_MAGIC 0x54484c46u
+#define FLIGHT_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    int32_t signal;
+    int32_t tid;
+    int32_t threads;
+    uint64_t fault_addr;
+    uint64_t pc;
+    int64_t time_us;
+    int64_t wall_s;
+    uint32_t events;
+    uint32_t event_size;
+} FlightHeader;
+
+typedef struct {
+    int32_t tid;
+    int32_t in_use;
+    char role[16];
+    char state[16];
+    int64_t acquired_us;
+    uint64_t event_next;
+} FlightThread;
+
+static char flight_path[64];
+
+static void flight_write(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        p += n;
+        len -= n;
+    }
+}
+
+static void flight_crash(int sig, siginfo_t* info, void* context) {
+    static int crashing = 0;
+    // A second thread crashing meanwhile waits for the first to finish the dump
+    if (__atomic_exchange_n(&crashing, 1, __ATOMIC_ACQ_REL)) {
+        while (1) pause();
+    }
+    int fd = open(flight_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        FlightHeader header = {FLIGHT_MAGIC, FLIGHT_VERSION, getpid(), sig, gettid(), 0,
+                               (uint64_t)(uintptr_t)info->si_addr, 0, now_us(), time(NULL),
+                               FLIGHT_RING_EVENTS, sizeof(FlightEvent)};
+#ifdef PROFILE_PC
+        header.pc = PROFILE_PC((ucontext_t*)context);
+#else
+        (void)context;
+#endif
+        for (ThreadRing* ring = thread_rings; ring; ring = ring->next_ring) header.threads++;
+        flight_write(fd, &header, sizeof(header));
+        for (ThreadRing* ring = thread_rings; ring && header.threads-- > 0; ring = ring->next_ring) {
+            FlightThread thread = {ring->tid, ring->in_use, {0}, {0}, ring->acquired_us, ring->event_next};
+            memcpy(thread.role, ring->role, sizeof(thread.role));
+            for (int i = 0; ring->state && ring->state[i] && i < (int)sizeof(thread.state) - 1; i++) thread.state[i] = ring->state[i];
+            flight_write(fd, &thread, sizeof(thread));
+            flight_write(fd, ring->events, sizeof(ring->events));
+        }
+        close(fd);
+        static const char note[] = "Fatal signal; recent events written to ";
+        flight_write(2, note, sizeof(note) - 1);
+        flight_write(2, flight_path, strlen(flight_path));
+        flight_write(2, "\n", 1);
+    }
+    raise(sig);
+}
+
+void flight_install(void) {
+    snprintf(flight_path, sizeof(flight_path), "crash-%d.flight", getpid());
+    struct sigaction action = {0};
+    action.sa_sigaction = flight_crash;
+    action.sa_flags = SA_SIGINFO | SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    for (int i = 0; i < 5; i++) sigaction(signals[i], &action, NULL);
+}
+
+// --read-flight <file>: prints a crash dump, each thread's events oldest first
+// with their time before the crash
+int flight_read(const char* file) {
+    static const char* kinds[FLIGHT_KINDS] = {"?", "connect", "disconnect", "recv", "message", "send", "http", "load", "store"};
+    FILE* f = fopen(file, "rb");
+    FlightHeader header;
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || header.magic != FLIGHT_MAGIC || header.version != FLIGHT_VERSION ||
+        header.events != FLIGHT_RING_EVENTS || header.event_size != sizeof(FlightEvent)) {
+        printf("%s is not a flight record from this build\n", file);
+        if (f) fclose(f);
+        return 1;
+    }
+    time_t wall = header.wall_s;
+    printf("Signal %d (%s) in thread %d of pid %d at %s", header.signal, strsignal(header.signal), header.tid, header.pid, ctime(&wall));
+    printf("pc 0x%llx, fault address 0x%llx\n", (unsigned long long)header.pc, (unsigned long long)header.fault_addr);
+    static FlightEvent events[FLIGHT_RING_EVENTS];
+    FlightThread thread;
+    for (int t = 0; t < header.threads; t++) {
+        if (fread(&thread, sizeof(thread), 1, f) != 1 || fread(events, sizeof(events), 1, f) != 1) {
+            printf("Truncated after %d threads\n", t);
+            break;
+        }
+        thread.role[sizeof(thread.role) - 1] = '\0';
+        printf("\nThread %d [%s] %s%s\n", thread.tid, thread.role, thread.in_use ? thread.state : "exited",
+            thread.tid == header.tid ? "  <- crashed" : "");
+        uint64_t begin = thread.event_next > FLIGHT_RING_EVENTS ? thread.event_next - FLIGHT_RING_EVENTS : 0;
+        for (uint64_t i = begin; i < thread.event_next; i++) {
+            FlightEvent* event = &events[i % FLIGHT_RING_EVENTS];
+            char detail[sizeof(event->detail) + 1];
+            int n = 0;
+            for (; n < (int)sizeof(event->detail) && event->detail[n]; n++) {
+                detail[n] = (unsigned char)event->detail[n] >= 0x20 && event->detail[n] != 0x7f ? event->detail[n] : '.';
+            }
+            detail[n] = '\0';
+            printf("  %12.3f ms  %-10s fd %-4d %10ld  %s%s\n", (header.time_us - event->time_us) / 1000.0,
+                event->kind > 0 && event->kind < FLIGHT_KINDS ? kinds[event->kind] : "?", event->fd, event->value, detail,
+                event->time_us < thread.acquired_us ? "  (earlier thread)" : "");
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// Stall watchdog. Every STALL_CHECK_MS it looks for threads that have been
+// busy (see thread_state) for longer than stall_threshold_ms and logs each
+// such spell once. The report gives the thread's role and state, its last
+// recorded event, the locks it holds or waits for, and its stack. The stack
+// is captured by signalling the thread, which unwinds itself like the
+// profiler does.
+#define STALL_CHECK_MS 50
+#define STALL_SIGNAL (SIGRTMIN + 1)
+
+// --stall-ms; 0 turns the watchdog off
+static long stall_threshold_ms = 200;
+static unsigned long stall_count = 0;
+
+static void stall_signal(int sig, siginfo_t* info, void* context) {
+    (void)sig;
+    (void)info;
+    int saved_errno = errno;
+    ThreadRing* ring = thread_ring_self;
+    if (ring) __atomic_store_n(&ring->stall_depth, profile_unwind(context, ring->stall_pcs, STALL_STACK_DEPTH), __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+// The thread holding mutex, if it is a tracked lock
+static ThreadRing* stall_lock_holder(pthread_mutex_t* mutex, long long* since_us) {
+    for (ThreadRing* ring = thread_rings; ring; ring = ring->next_ring) {
+        int count = __atomic_load_n(&ring->hold_count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < count && i < LOCK_HOLD_MAX; i++) {
+            if (ring->holds[i].mutex == mutex) {
+                *since_us = ring->holds[i].since_us;
+                return ring;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void stall_report(ThreadRing* ring, long long busy_since, long long now) {
+    char line[512];
+    ByteBuffer out = {0};
+    int n = snprintf(line, sizeof(line), "Stall: %s thread %d busy for %lld ms (%s)", ring->role, ring->tid,
+        (now - busy_since) / 1000, ring->state);
+    byte_buffer_append(&out, line, n);
+    int count = __atomic_load_n(&ring->hold_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && i < LOCK_HOLD_MAX; i++) {
+        n = snprintf(line, sizeof(line), "%s %s %lld ms", i ? "," : ", holding", lock_names[ring->holds[i].lock_class],
+            (now - ring->holds[i].since_us) / 1000);
+        byte_buffer_append(&out, line, n);
+    }
+    LockHold waiting = ring->waiting;
+    if (waiting.mutex) {
+        long long held_since = 0;
+        ThreadRing* holder = stall_lock_holder(waiting.mutex, &held_since);
+        n = snprintf(line, sizeof(line), ", waiting %lld ms for %s", (now - waiting.since_us) / 1000, lock_names[waiting.lock_class]);
+        byte_buffer_append(&out, line, n);
+        if (holder) {
+            n = snprintf(line, sizeof(line), " held %lld ms by %s thread %d", (now - held_since) / 1000, holder->role, holder->tid);
+            byte_buffer_append(&out, line, n);
+        }
+    }
+    unsigned long events = __atomic_load_n(&ring->event_next, __ATOMIC_ACQUIRE);
+    if (events) {
+        FlightEvent last = ring->events[(events - 1) % FLIGHT_RING_EVENTS];
+        n = snprintf(line, sizeof(line), "; last event %lld ms ago on fd %d: %.*s", (now - last.time_us) / 1000, last.fd,
+            (int)strnlen(last.detail, sizeof(last.detail)), last.detail);
+        byte_buffer_append(&out, line, n);
+    }
+    byte_buffer_append(&out, "\n", 1);
+    
+    // The thread fills stall_pcs from its signal handler, unless it is gone
+    __atomic_store_n(&ring->stall_depth, -1, __ATOMIC_RELEASE);
+    if (tgkill(getpid(), ring->tid, STALL_SIGNAL) == 0) {
+        struct timespec pause = {0, 1000000L};
+        for (int i = 0; i < 20 && __atomic_load_n(&ring->stall_depth, __ATOMIC_ACQUIRE) < 0; i++) nanosleep(&pause, NULL);
+    }
+    int depth = __atomic_load_n(&ring->stall_depth, __ATOMIC_ACQUIRE);
+    if (depth > 0) pthread_once(&profile_symbols_once, profile_load_symbols);
+    for (int i = 0; i < depth; i++) {
+        char buf[128];
+        n = snprintf(line, sizeof(line), "    at %s\n", profile_symbol(ring->stall_pcs[i] - (i > 0), buf, sizeof(buf)));
+        byte_buffer_append(&out, line, n);
+    }
+    byte_buffer_append(&out, "", 1);
+    printf("%s", (const char*)out.data);
+    mem_free(out.data);
+}
+
+void* stall_watchdog(void* arg) {
+    (void)arg;
+    thread_role("watchdog");
+    thread_wait("sleep");
+    struct timespec interval = {0, STALL_CHECK_MS * 1000000L};
+    while (1) {
+        nanosleep(&interval, NULL);
+        long long now = now_us();
+        // Rings are never freed, so the list can be walked without the lock
+        for (ThreadRing* ring = __atomic_load_n(&thread_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next_ring) {
+            long long busy_since = __atomic_load_n(&ring->busy_since_us, __ATOMIC_ACQUIRE);
+            if (!ring->in_use || !busy_since || now - busy_since < stall_threshold_ms * 1000 || ring->stall_reported_us == busy_since) {
+                continue;
+            }
+            ring->stall_reported_us = busy_since;
+            __atomic_add_fetch(&stall_count, 1, __ATOMIC_RELAXED);
+            stall_report(ring, busy_since, now);
+        }
+    }
+    return NULL;
+}
+
+int stall_watchdog_start(void) {
+    if (stall_threshold_ms <= 0) return 0;
+    profile_unwind_init();
+    struct sigaction action = {0};
+    action.sa_sigaction = stall_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(STALL_SIGNAL, &action, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stall_watchdog, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static void metrics_histogram(ByteBuffer* out, const char* name, const char* label, const char* value, const LatencyHistogram* histogram) {
+    char line[256];
+    unsigned long cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        cumulative += histogram->counts[i];
+        int n = snprintf(line, sizeof(line), "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", name, label, value, (1L << i) / 1e6, cumulative);
+        byte_buffer_append(out, line, n);
+    }
+    int n = snprintf(line, sizeof(line), "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n%s_sum{%s=\"%s\"} %.6f\n%s_count{%s=\"%s\"} %lu\n",
+        name, label, value, histogram->total, name, label, value, histogram->sum_us / 1e6, name, label, value, histogram->total);
+    byte_buffer_append(out, line, n);
+}
+
+static void histogram_merge(LatencyHistogram* into, const LatencyHistogram* from) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum_us += from->sum_us;
+}
+
+// GET /admin/metrics (localhost only): lock wait and hold times per lock,
+// busy spells per thread role and the stall count, in Prometheus text format.
+// Histograms are summed over every thread that ever recorded.
+void admin_metrics(int socket) {
+    static LatencyHistogram waits[LOCK_CLASSES], holds[LOCK_CLASSES], busy[32];
+    static char roles[32][16];
+    static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&metrics_mutex);
+    memset(waits, 0, sizeof(waits));
+    memset(holds, 0, sizeof(holds));
+    memset(busy, 0, sizeof(busy));
+    int role_count = 0;
+    pthread_mutex_lock(&thread_rings_mutex);
+    for (ThreadRing* ring = thread_rings; ring; ring = ring->next_ring) {
+        for (int c = 0; c < LOCK_CLASSES; c++) {
+            histogram_merge(&waits[c], &ring->lock_wait[c]);
+            histogram_merge(&holds[c], &ring->lock_hold[c]);
+        }
+        int r = 0;
+        while (r < role_count && strcmp(roles[r], ring->role) != 0) r++;
+        if (r == role_count && role_count < 32) memcpy(roles[role_count++], ring->role, sizeof(roles[0]));
+        if (r < role_count) histogram_merge(&busy[r], &ring->busy);
+    }
+    pthread_mutex_unlock(&thread_rings_mutex);
+    
+    ByteBuffer out = {0};
+    const char* text = "# HELP collab_lock_wait_seconds Time spent waiting to take a lock.\n# TYPE collab_lock_wait_seconds histogram\n";
+    byte_buffer_append(&out, text, strlen(text));
+    for (int c = 0; c < LOCK_CLASSES; c++) metrics_histogram(&out, "collab_lock_wait_seconds", "lock", lock_names[c], &waits[c]);
+    text = "# HELP collab_lock_hold_seconds Time a lock was held.\n# TYPE collab_lock_hold_seconds histogram\n";
+    byte_buffer_append(&out, text, strlen(text));
+    for (int c = 0; c < LOCK_CLASSES; c++) metrics_histogram(&out, "collab_lock_hold_seconds", "lock", lock_names[c], &holds[c]);
+    text = "# HELP collab_busy_seconds Time threads worked between waits for input, by thread role.\n# TYPE collab_busy_seconds histogram\n";
+    byte_buffer_append(&out, text, strlen(text));
+    for (int r = 0; r < role_count; r++) metrics_histogram(&out, "collab_busy_seconds", "role", roles[r], &busy[r]);
+    pthread_mutex_unlock(&metrics_mutex);
+    char line[160];
+    int n = snprintf(line, sizeof(line), "# HELP collab_stalls_total Busy spells longer than the stall threshold.\n# TYPE collab_stalls_total counter\ncollab_stalls_total %lu\n",
+        __atomic_load_n(&stall_count, __ATOMIC_RELAXED));
+    byte_buffer_append(&out, line, n);
+    if (tls_ctx) {
+        unsigned long handshakes = __atomic_load_n(&tls_handshakes, __ATOMIC_RELAXED);
+        unsigned long resumed = __atomic_load_n(&tls_resumed, __ATOMIC_RELAXED);
+        n = snprintf(line, sizeof(line), "# HELP collab_tls_handshakes_total Completed TLS handshakes, by whether the session was resumed.\n"
+            "# TYPE collab_tls_handshakes_total counter\n");
+        byte_buffer_append(&out, line, n);
+        n = snprintf(line, sizeof(line), "collab_tls_handshakes_total{resumed=\"false\"} %lu\ncollab_tls_handshakes_total{resumed=\"true\"} %lu\n",
+            handshakes - resumed, resumed);
+        byte_buffer_append(&out, line, n);
+        n = snprintf(line, sizeof(line), "# HELP collab_tls_ktls_total TLS connections whose sending the kernel took over.\n"
+            "# TYPE collab_tls_ktls_total counter\ncollab_tls_ktls_total %lu\n", __atomic_load_n(&tls_offloaded, __ATOMIC_RELAXED));
+        byte_buffer_append(&out, line, n);
+    }
+    if (mem_accounting) {
+        static const char* gauges[][3] = {
+            {"collab_memory_live_bytes", "gauge", "Bytes allocated and not yet freed, by subsystem."},
+            {"collab_memory_live_allocations", "gauge", "Blocks allocated and not yet freed, by subsystem."},
+            {"collab_memory_peak_bytes", "gauge", "Highest live byte count seen, by subsystem."},
+            {"collab_memory_allocations_total", "counter", "Blocks allocated, by subsystem."},
+        };
+        for (int g = 0; g < 4; g++) {
+            n = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", gauges[g][0], gauges[g][2], gauges[g][0], gauges[g][1]);
+            byte_buffer_append(&out, line, n);
+            for (int t = 0; t < MEM_TAGS; t++) {
+                MemGauge* gauge = &mem_gauges[t];
+                long values[] = {gauge->live_bytes, gauge->live_blocks, gauge->peak_bytes, (long)gauge->allocations};
+                n = snprintf(line, sizeof(line), "%s{subsystem=\"%s\"} %ld\n", gauges[g][0], mem_tag_names[t], values[g]);
+                byte_buffer_append(&out, line, n);
+            }
+        }
+    }
+    byte_buffer_append(&out, "", 1);
+    send_response(socket, "200 OK", "text/plain; version=0.0.4", (const char*)out.data);
+    mem_free(out.data);
+}
+
+static int mem_site_cmp(const void* a, const void* b) {
+    long x = ((const MemSite*)a)->live_bytes, y = ((const MemSite*)b)->live_bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Printed at shutdown with --mem-accounting: what each subsystem still holds,
+// then the call sites holding the most
+void mem_report(void) {
+    printf("Memory still allocated at shutdown:\n");
+    for (int t = 0; t < MEM_TAGS; t++) {
+        printf("  %-12s %10ld bytes in %7ld blocks (peak %ld bytes, %lu allocations)\n", mem_tag_names[t],
+            mem_gauges[t].live_bytes, mem_gauges[t].live_blocks, mem_gauges[t].peak_bytes, mem_gauges[t].allocations);
+    }
+    static MemSite sites[MEM_SITES];
+    int count = 0;
+    for (int i = 0; i < MEM_SITES; i++) {
+        if (mem_sites[i].caller && mem_sites[i].live_blocks > 0) sites[count++] = mem_sites[i];
+    }
+    qsort(sites, count, sizeof(MemSite), mem_site_cmp);
+    pthread_once(&profile_symbols_once, profile_load_symbols);
+    for (int i = 0; i < count && i < 20; i++) {
+        char buf[128];
+        printf("  %10ld bytes in %7ld blocks  allocated in %s\n", sites[i].live_bytes, sites[i].live_blocks,
+            profile_symbol(sites[i].caller - 1, buf, sizeof(buf)));
+    }
+}
+
+static void list_files_under(FsNode* dir, char* prefix, size_t prefix_len, const char* user, ByteBuffer* out) {
+    for (int i = 0; i < dir->child_count; i++) {
+        FsNode* node = dir->children[i];
+        int n = snprintf(prefix + prefix_len, 512 - prefix_len, "%s%s", prefix_len ? "/" : "", node->name);
+        if (node->is_dir) {
+            list_files_under(node, prefix, prefix_len + n, user, out);
+        } else if (acl_perms(user, prefix) & PERM_READ) {
+            char escaped[512 * 6];
+            char* end = json_escape(prefix, prefix_len + n, escaped);
+            if (out->len > 1) byte_buffer_append(out, ",", 1);
+            byte_buffer_append(out, "\"", 1);
+            byte_buffer_append(out, escaped, end - escaped);
+            byte_buffer_append(out, "\"", 1);
+        }
+        prefix[prefix_len] = '\0';
+    }
+}
+
+// GET /api/files: every file path in the tree
+void list_files(int socket, Tenant* tenant, const char* user) {
+    ByteBuffer out = {0};
+    char prefix[512] = "";
+    byte_buffer_append(&out, "[", 1);
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    list_files_under(&tenant->fs_root, prefix, 0, user, &out);
+    lock_release(&tenant->fs_index_mutex);
+    byte_buffer_append(&out, "]", 2);
+    send_response(socket, "200 OK", "application/json", (const char*)out.data);
+    mem_free(out.data);
+}
+
+// GET /api/tree?path=dir: one level of the tree, so clients expand folders on
+// demand however large the project is
+void list_tree(int socket, Tenant* tenant, const char* url, const char* user) {
+    char path[256];
+    query_param(url, "path", path, sizeof(path));
+    if (path[0] && !valid_path(path)) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid path\"}");
+        return;
+    }
+    
+    ByteBuffer out = {0};
+    char entry[2048];
+    char escaped[256 * 6 + 1];
+    *json_escape(path, strlen(path), escaped) = '\0';
+    snprintf(entry, sizeof(entry), "{\"path\":\"%s\",\"entries\":[", escaped);
+    byte_buffer_append(&out, entry, strlen(entry));
+    
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    FsNode* dir = fs_walk(&tenant->fs_root, path, NULL, 1);
+    if (!dir || !dir->is_dir) {
+        lock_release(&tenant->fs_index_mutex);
+        mem_free(out.data);
+        send_response(socket, "404 Not Found", "application/json", "{\"error\":\"No such folder\"}");
+        return;
+    }
+    int first = 1;
+    for (int i = 0; i < dir->child_count; i++) {
+        FsNode* node = dir->children[i];
+        char full[512];
+        snprintf(full, sizeof(full), "%s%s%s", path, path[0] ? "/" : "", node->name);
+        if (!node->is_dir && !(acl_perms(user, full) & PERM_READ)) continue;
+        *json_escape(node->name, strlen(node->name), escaped) = '\0';
+        if (node->is_dir) {
+            snprintf(entry, sizeof(entry), "%s{\"name\":\"%s\",\"type\":\"dir\",\"size\":%ld,\"files\":%ld,\"children\":%d,\"mtime\":%ld}",
+                first ? "" : ",", escaped, node->size, node->files, node->child_count, (long)node->mtime);
+        } else {
+            snprintf(entry, sizeof(entry), "%s{\"name\":\"%s\",\"type\":\"file\",\"size\":%ld,\"mtime\":%ld}",
+                first ? "" : ",", escaped, node->size, (long)node->mtime);
+        }
+        byte_buffer_append(&out, entry, strlen(entry));
+        first = 0;
+    }
+    lock_release(&tenant->fs_index_mutex);
+    
+    byte_buffer_append(&out, "]}", 3);
+    send_response(socket, "200 OK", "application/json", (const char*)out.data);
+    mem_free(out.data);
+}
+
+void read_file(int socket, Tenant* tenant, const char* filename) {
+    Document* doc = get_document(tenant, filename);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    int loaded = document_load(doc, filename);
+    if (loaded != 0) {
+        lock_release(&doc->lock);
+        if (loaded == -2) send_response(socket, "507 Insufficient Storage", "application/json", "{\"error\":\"Memory quota exceeded\"}");
+        else send_response(socket, "404 Not Found", "application/json", "{\"content\":\"\"}");
+        return;
+    }
+    
+    char* escaped = mem_alloc(MEM_HTTP, doc->length * 6 + 1024);
+    char* p = escaped + sprintf(escaped, "{\"content\":\"");
+    p = json_escape(doc->content, doc->length, p);
+    long revision = doc->revision;
+    char hash_hex[16];
+    doc_hash_format(doc->live_hash, hash_hex);
+    lock_release(&doc->lock);
+    sprintf(p, "\",\"revision\":%ld,\"hash\":\"%s\"}", revision, hash_hex);
+    
+    char etag[64];
+    snprintf(etag, sizeof(etag), "ETag: \"%ld\"\r\n", revision);
+    send_response_with_headers(socket, "200 OK", "application/json", etag, escaped);
+    mem_free(escaped);
+}
+
+char* content_update_message(const char* uname, const char* fname, long revision, const char* hash_hex,
+                             const char* extra, const char* escaped, long escaped_len);
+
+// The document as a "snapshot" event, charged to it. Caller holds doc->lock
+// and has loaded the content.
+static Frame* sse_snapshot(Document* doc) {
+    char hash_hex[16];
+    doc_hash_format(doc->live_hash, hash_hex);
+    char* escaped = mem_alloc(MEM_FRAMES, doc->length * 6 + 1);
+    long escaped_len = json_escape(doc->content, doc->length, escaped) - escaped;
+    char* msg = content_update_message("", doc->name, doc->revision, hash_hex, "", escaped, escaped_len);
+    Frame* frame = frame_charge(sse_frame("snapshot", doc->revision, msg, strlen(msg)), doc);
+    mem_free(msg);
+    mem_free(escaped);
+    return frame;
+}
+
+// Sends followers of file the document as it is now, after a change that did
+// not come through broadcast_file (HTTP saves, patches and imports)
+void follow_snapshot(Tenant* tenant, const char* file) {
+    int followers = 0;
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    for (Client* c = clients; c; c = c->next) {
+        if (c->follower && c->active && c->tenant == tenant && strcmp(c->current_file, file) == 0) followers++;
+    }
+    lock_release(&clients_mutex);
+    if (!followers) return;
+    
+    Document* doc = get_document(tenant, file);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    if (doc->revision == doc->streamed_revision || document_load(doc, file) != 0) {
+        lock_release(&doc->lock);
+        return;
+    }
+    Frame* event = sse_snapshot(doc);
+    doc->streamed_revision = doc->revision;
+    lock_release(&doc->lock);
+    
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    for (Client* c = clients; c; c = c->next) {
+        if (c->follower && c->tenant == tenant && strcmp(c->current_file, file) == 0) {
+            lock_acquire(&c->lock, LOCK_CLIENT);
+            client_enqueue(c, event);
+            lock_release(&c->lock);
+        }
+    }
+    lock_release(&clients_mutex);
+    frame_release(event);
+}
+
+// GET /api/stream?name=: a Server-Sent Events response carrying the document as
+// a "snapshot" event, then its updates from broadcast_file, until the client
+// goes away. Followers are clients like WebSocket ones, so their events are
+// encoded once per update and written by the outbound scheduler. Event ids are
+// revisions: a reconnecting EventSource sends the last one as Last-Event-ID,
+// and if that is still current the snapshot is skipped. Updates carry the
+// whole document, so an older revision just gets the current snapshot.
+// A comment line every SSE_KEEPALIVE_MS keeps proxies from closing an idle
+// stream and finds followers that are gone.
+#define SSE_KEEPALIVE_MS 15000
+
+void follow_file(int socket, Tenant* tenant, const char* headers, const char* filename, const char* user) {
+    char last_id[32];
+    long resume = header_value(headers, "Last-Event-ID", last_id, sizeof(last_id)) == 0 ? atol(last_id) : -1;
+    Document* doc = get_document(tenant, filename);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    int loaded = document_load(doc, filename);
+    if (loaded != 0) {
+        lock_release(&doc->lock);
+        if (loaded == -2) send_response(socket, "507 Insufficient Storage", "application/json", "{\"error\":\"Memory quota exceeded\"}");
+        else send_response(socket, "404 Not Found", "application/json", "{\"error\":\"File not found\"}");
+        return;
+    }
+    if (tenant_connect(tenant) != 0) {
+        lock_release(&doc->lock);
+        printf("Workspace %s is at its connection limit\n", tenant->name);
+        send_response(socket, "503 Service Unavailable", "application/json", "{\"error\":\"Too many connections\"}");
+        return;
+    }
+    
+    Client* client = mem_calloc(MEM_CONNECTIONS, 1, sizeof(Client));
+    client->socket = socket;
+    client->connected_ms = client->last_active_ms = now_ms();
+    client->tenant = tenant;
+    client->follower = 1;
+    snprintf(client->username, sizeof(client->username), "%s", user[0] ? user : "follower");
+    snprintf(client->current_file, sizeof(client->current_file), "%s", filename);
+    snprintf(client->perms_file, sizeof(client->perms_file), "%s", filename);
+    client->perms = acl_perms(client->username, filename);
+    
+    // Queued while doc->lock keeps the next update from going out first
+    const char* head = "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    Frame* start = sse_frame(NULL, 0, head, strlen(head));
+    Frame* snapshot = doc->revision != resume ? sse_snapshot(doc) : NULL;
+    add_client(client);
+    lock_acquire(&client->lock, LOCK_CLIENT);
+    client_enqueue(client, start);
+    if (snapshot) client_enqueue(client, snapshot);
+    lock_release(&client->lock);
+    lock_release(&doc->lock);
+    frame_release(start);
+    if (snapshot) frame_release(snapshot);
+    
+    // Whatever the client sends is ignored, and the end of the request side
+    // means it is gone, except on an HTTP/2 stream's socketpair: that closes
+    // after the request, and the stream lasts until the pair hangs up.
+    int h2_stream = socket < TLS_MAX_FDS && http_origins[socket];
+    struct pollfd pfd = {socket, POLLIN, 0};
+    while (__atomic_load_n(&client->active, __ATOMIC_RELAXED)) {
+        thread_wait("follow");
+        int ready = poll(&pfd, 1, SSE_KEEPALIVE_MS);
+        thread_state("handle");
+        if (ready > 0 && (pfd.revents & (POLLHUP | POLLERR))) break;
+        if (ready > 0) {
+            char discard[256];
+            if (tls_recv(socket, discard, sizeof(discard)) <= 0) {
+                if (!h2_stream) break;
+                pfd.events = 0;
+            }
+        } else if (ready == 0) {
+            Frame* keepalive = sse_frame(NULL, 0, ":\n\n", 3);
+            lock_acquire(&client->lock, LOCK_CLIENT);
+            client_enqueue(client, keepalive);
+            lock_release(&client->lock);
+            frame_release(keepalive);
+        }
+    }
+    remove_client(socket);
+}
+
+// Tells every client the file was persisted; clients whose copy does not match
+// the hash at that revision resync it, and followers get the new content
+void broadcast_file_saved(Tenant* tenant, const char* filename, long revision, const char* hash_hex) {
+    char saved_msg[512];
+    snprintf(saved_msg, sizeof(saved_msg), "{\"type\":\"file_saved\",\"file\":\"%s\",\"revision\":%ld,\"hash\":\"%s\"}",
+        filename, revision, hash_hex);
+    broadcast_message(tenant, saved_msg, -1);
+    follow_snapshot(tenant, filename);
+}
+
+// Saves skip the disk entirely when the content hash matches what is already
+// persisted. A non-"*" If-Match must name the current revision, otherwise the
+// save is rejected as a stale overwrite.
+// filename is the request's validated target, already checked against the caller's permissions
+void write_file(int socket, Tenant* tenant, const char* filename, const char* body, const char* if_match) {
+    const char* content_start = body ? strstr(body, "\"content\":\"") : NULL;
+    if (!filename[0] || !content_start) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid request\"}");
+        return;
+    }
+    
+    content_start += 11;
+    const char* content_end = json_string_end(content_start);
+    if (!content_end) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid request\"}");
+        return;
+    }
+    
+    long len;
+    char* content = json_unescape(content_start, content_end, &len);
+    uint64_t hash = xxh64(content, len, 0);
+    
+    Document* doc = get_document(tenant, filename);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    if (document_ensure(doc, filename) != 0 || document_reserve(doc, len + 1 - doc->capacity) != 0 ||
+        document_grow(doc, len) != 0) {
+        lock_release(&doc->lock);
+        mem_free(content);
+        send_response(socket, "507 Insufficient Storage", "application/json", "{\"error\":\"Memory quota exceeded\"}");
+        return;
+    }
+    
+    char reply[256];
+    char hash_hex[16];
+    if (document_matches_disk(doc, filename, hash, len)) {
+        // Nothing to write, but the live buffer still follows the saved content
+        int changed = document_replace(doc, content, len, NULL) > 0;
+        doc->dirty = 0;
+        long revision = doc->revision;
+        doc_hash_format(doc->live_hash, hash_hex);
+        lock_release(&doc->lock);
+        mem_free(content);
+        snprintf(reply, sizeof(reply), "{\"success\":true,\"unchanged\":true,\"revision\":%ld}", revision);
+        send_response(socket, "200 OK", "application/json", reply);
+        if (changed) broadcast_file_saved(tenant, filename, revision, hash_hex);
+        return;
+    }
+    
+    if (if_match && strcmp(if_match, "*") != 0 && atol(if_match) != doc->revision) {
+        snprintf(reply, sizeof(reply), "{\"error\":\"Revision mismatch\",\"revision\":%ld}", doc->revision);
+        lock_release(&doc->lock);
+        mem_free(content);
+        send_response(socket, "412 Precondition Failed", "application/json", reply);
+        return;
+    }
+    
+    if (tenant->storage->write(tenant, filename, content, len, NULL, 0) != 0) {
+        lock_release(&doc->lock);
+        mem_free(content);
+        send_response(socket, "500 Internal Server Error", "application/json", "{\"error\":\"Could not write file\"}");
+        return;
+    }
+    
+    document_replace(doc, content, len, NULL);
+    document_persisted(doc, filename, hash);
+    long revision = doc->revision;
+    doc_hash_format(doc->live_hash, hash_hex);
+    lock_release(&doc->lock);
+    mem_free(content);
+    
+    snprintf(reply, sizeof(reply), "{\"success\":true,\"revision\":%ld}", revision);
+    send_response(socket, "200 OK", "application/json", reply);
+    broadcast_file_saved(tenant, filename, revision, hash_hex);
+}
+
+// One byte-range replacement against the base revision of a document
+typedef struct {
+    long offset;
+    long remove;
+    char* text;
+    long text_len;
+} PatchEdit;
+
+typedef struct {
+    PatchEdit* items;
+    int count;
+    int capacity;
+} PatchEdits;
+
+void patch_edits_add(PatchEdits* edits, long offset, long remove, char* text, long text_len) {
+    if (edits->count == edits->capacity) {
+        edits->capacity = edits->capacity ? edits->capacity * 2 : 8;
+        edits->items = mem_realloc(MEM_HTTP, edits->items, edits->capacity * sizeof(PatchEdit));
+    }
+    edits->items[edits->count++] = (PatchEdit){offset, remove, text, text_len};
+}
+
+void patch_edits_free(PatchEdits* edits) {
+    for (int i = 0; i < edits->count; i++) mem_free(edits->items[i].text);
+    mem_free(edits->items);
+}
+
+static const char* skip_ws(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+// Parses "edits":[{"offset":N,"delete":N,"text":"..."},...]. Returns -1 on malformed input.
+int parse_json_edits(const char* body, PatchEdits* edits) {
+    const char* p = strstr(body, "\"edits\"");
+    if (!p) return -1;
+    p = skip_ws(p + 7);
+    if (*p != ':') return -1;
+    p = skip_ws(p + 1);
+    if (*p != '[') return -1;
+    p = skip_ws(p + 1);
+    
+    while (*p == '{') {
+        long offset = -1, remove = 0, text_len = 0;
+        char* text = NULL;
+        p = skip_ws(p + 1);
+        while (*p == '"') {
+            const char* key = p + 1;
+            const char* key_end = json_string_end(key);
+            if (!key_end) { mem_free(text); return -1; }
+            p = skip_ws(key_end + 1);
+            if (*p != ':') { mem_free(text); return -1; }
+            p = skip_ws(p + 1);
+            if (*p == '"') {
+                const char* value_end = json_string_end(p + 1);
+                if (!value_end) { mem_free(text); return -1; }
+                if (key_end - key == 4 && strncmp(key, "text", 4) == 0) {
+                    mem_free(text);
+                    text = json_unescape(p + 1, value_end, &text_len);
+                }
+                p = value_end + 1;
+            } else {
+                char* num_end;
+                long value = strtol(p, &num_end, 10);
+                if (num_end == p) { mem_free(text); return -1; }
+                if (key_end - key == 6 && strncmp(key, "offset", 6) == 0) offset = value;
+                else if (key_end - key == 6 && strncmp(key, "delete", 6) == 0) remove = value;
+                p = num_end;
+            }
+            p = skip_ws(p);
+            if (*p == ',') p = skip_ws(p + 1);
+        }
+        if (*p != '}' || offset < 0 || remove < 0) { mem_free(text); return -1; }
+        if (!text) text = mem_calloc(MEM_HTTP, 1, 1);
+        patch_edits_add(edits, offset, remove, text, text_len);
+        p = skip_ws(p + 1);
+        if (*p == ',') p = skip_ws(p + 1);
+    }
+    return *p == ']' ? 0 : -1;
+}
+
+// Converts a unified diff against base into byte-range edits, verifying every
+// context and removed line. Returns -1 if the diff does not apply cleanly.
+int parse_unified_diff(const char* base, long base_len, const char* diff, long diff_len, PatchEdits* edits) {
+    const char* end = diff + diff_len;
+    const char* line = diff;
+    long cursor = 0;
+    long line_no = 0;
+    
+    while (line < end && strncmp(line, "@@", 2) != 0) {
+        const char* nl = memchr(line, '\n', end - line);
+        line = nl ? nl + 1 : end;
+    }
+    
+    while (line < end) {
+        long old_start, old_count = 1;
+        if (sscanf(line, "@@ -%ld,%ld", &old_start, &old_count) < 1) return -1;
+        const char* nl = memchr(line, '\n', end - line);
+        line = nl ? nl + 1 : end;
+        
+        long target = old_count == 0 ? old_start : old_start - 1;
+        if (target < line_no) return -1;
+        while (line_no < target) {
+            const char* base_nl = memchr(base + cursor, '\n', base_len - cursor);
+            if (!base_nl) return -1;
+            cursor = base_nl - base + 1;
+            line_no++;
+        }
+        
+        long run_offset = -1, run_remove = 0;
+        char* run_text = NULL;
+        long run_len = 0;
+        char last_kind = 0;
+        
+        while (line < end && strncmp(line, "@@", 2) != 0) {
+            nl = memchr(line, '\n', end - line);
+            const char* line_end = nl ? nl : end;
+            const char* next = nl ? nl + 1 : end;
+            char kind = *line;
+            const char* text = line + 1;
+            long text_len = line_end - text;
+            if (text_len > 0 && text[text_len - 1] == '\r' && kind != '\\') text_len--;
+            
+            if (kind == '\\') {
+                if (last_kind == '+' && run_len > 0 && run_text[run_len - 1] == '\n') run_len--;
+                line = next;
+                continue;
+            }
+            last_kind = kind;
+            
+            if (kind == '+') {
+                if (run_offset < 0) run_offset = cursor;
+                run_text = mem_realloc(MEM_HTTP, run_text, run_len + text_len + 2);
+                memcpy(run_text + run_len, text, text_len);
+                run_len += text_len;
+                run_text[run_len++] = '\n';
+                line = next;
+                continue;
+            }
+            
+            if (kind != ' ' && kind != '-') {
+                mem_free(run_text);
+                return -1;
+            }
+            
+            const char* base_nl = memchr(base + cursor, '\n', base_len - cursor);
+            long base_line_len = (base_nl ? base_nl - base : base_len) - cursor;
+            long base_line_total = base_nl ? base_line_len + 1 : base_line_len;
+            if (cursor >= base_len || base_line_len != text_len || memcmp(base + cursor, text, text_len) != 0) {
+                mem_free(run_text);
+                return -1;
+            }
+            
+            if (kind == '-') {
+                if (run_offset < 0) run_offset = cursor;
+                run_remove += base_line_total;
+            } else if (run_offset >= 0) {
+                patch_edits_add(edits, run_offset, run_remove, run_text ? run_text : mem_calloc(MEM_HTTP, 1, 1), run_len);
+                run_offset = -1;
+                run_remove = 0;
+                run_text = NULL;
+                run_len = 0;
+            }
+            cursor += base_line_total;
+            line_no++;
+            line = next;
+        }
+        
+        if (run_offset >= 0) {
+            patch_edits_add(edits, run_offset, run_remove, run_text ? run_text : mem_calloc(MEM_HTTP, 1, 1), run_len);
+        } else {
+            mem_free(run_text);
+        }
+    }
+    return 0;
+}
+
+// Caller holds doc->lock. Applies sorted, non-overlapping edits to the live
+// buffer and writes back only the bytes that moved. A buffer that was already
+// ahead of disk, or an empty edit list on one, is written in full.
+// Returns -1 if the edits are invalid and -2 if they could not be stored;
+// either way the document is left as it was.
+int document_apply_edits(Document* doc, const char* path, PatchEdits* edits) {
+    long prev_end = 0;
+    long removed_len = 0;
+    long peak_len = doc->length;
+    int same_size = 1;
+    for (int i = 0; i < edits->count; i++) {
+        PatchEdit* e = &edits->items[i];
+        if (e->offset < prev_end || e->offset + e->remove > doc->length) return -1;
+        prev_end = e->offset + e->remove;
+        removed_len += e->remove;
+        if (e->text_len > e->remove) peak_len += e->text_len - e->remove;
+        if (e->text_len != e->remove) same_size = 0;
+    }
+    if (edits->count == 0 && !doc->dirty) return 0;
+    // Edits are applied (and undone) back to front, so the buffer must hold every growth at once
+    if (document_grow(doc, peak_len) != 0) return -2;
+    
+    // The replaced bytes are kept until the write succeeds so a failed write
+    // can be spliced back out
+    char* removed = mem_alloc(MEM_HTTP, removed_len + 1);
+    long saved = 0;
+    for (int i = 0; i < edits->count; i++) {
+        memcpy(removed + saved, doc->content + edits->items[i].offset, edits->items[i].remove);
+        saved += edits->items[i].remove;
+    }
+    
+    int full_write = doc->dirty;
+    long old_len = doc->length;
+    for (int i = edits->count - 1; i >= 0; i--) {
+        PatchEdit* e = &edits->items[i];
+        document_splice(doc, e->offset, e->remove, e->text, e->text_len);
+    }
+    
+    // Same-size edits change only their own bytes; otherwise everything from
+    // the first edit on moves. No ranges means a full write.
+    StorageRange* ranges = mem_alloc(MEM_HTTP, (edits->count + 1) * sizeof(StorageRange));
+    int count = 0;
+    if (!full_write && same_size) {
+        for (int i = 0; i < edits->count; i++) ranges[count++] = (StorageRange){edits->items[i].offset, edits->items[i].text_len};
+    } else if (!full_write) {
+        long first = edits->items[0].offset;
+        ranges[count++] = (StorageRange){first, doc->length - first};
+    }
+    int rc = doc->tenant->storage->write(doc->tenant, path, doc->content, doc->length, ranges, count);
+    mem_free(ranges);
+    if (rc != 0) {
+        // Back to front, each edit sits where the edits before it moved it
+        long shift = doc->length - old_len;
+        for (int i = edits->count - 1; i >= 0; i--) {
+            PatchEdit* e = &edits->items[i];
+            shift -= e->text_len - e->remove;
+            saved -= e->remove;
+            document_splice(doc, e->offset + shift, e->text_len, removed + saved, e->remove);
+        }
+        mem_free(removed);
+        return -2;
+    }
+    mem_free(removed);
+    
+    // Other users' undo entries follow the edits in the order they were applied
+    for (int i = edits->count - 1; i >= 0; i--) {
+        PatchEdit* e = &edits->items[i];
+        undo_transform(doc, NULL, e->offset, e->remove, e->text_len);
+    }
+    document_persisted(doc, path, xxh64(doc->content, doc->length, 0));
+    if (edits->count > 0) {
+        doc->revision++;
+        document_record_revision(doc);
+    }
+    return 0;
+}
+
+// PATCH /api/file: JSON byte-range edits ({"filename","base_revision","edits"})
+// or a unified diff body (?name=...&base=N). The base revision may also come
+// from If-Match and must equal the current revision.
+void patch_file(int socket, Tenant* tenant, const char* filename, const char* url, const char* content_type, const char* if_match, const char* body, long body_len) {
+    char base[32] = {0};
+    int is_json = content_type && strstr(content_type, "json") != NULL;
+    
+    if (is_json) {
+        const char* rev = strstr(body, "\"base_revision\":");
+        if (rev) snprintf(base, sizeof(base), "%ld", atol(rev + 16));
+    } else {
+        query_param(url, "base", base, sizeof(base));
+    }
+    if (!base[0] && if_match) snprintf(base, sizeof(base), "%s", if_match);
+    
+    if (!filename[0]) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Missing filename\"}");
+        return;
+    }
+    if (!base[0]) {
+        send_response(socket, "428 Precondition Required", "application/json", "{\"error\":\"Missing base revision\"}");
+        return;
+    }
+    
+    Document* doc = get_document(tenant, filename);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    int loaded = document_load(doc, filename);
+    if (loaded != 0) {
+        lock_release(&doc->lock);
+        if (loaded == -2) send_response(socket, "507 Insufficient Storage", "application/json", "{\"error\":\"Memory quota exceeded\"}");
+        else send_response(socket, "404 Not Found", "application/json", "{\"error\":\"File not found\"}");
+        return;
+    }
+    
+    char reply[256];
+    if (atol(base) != doc->revision) {
+        snprintf(reply, sizeof(reply), "{\"error\":\"Revision mismatch\",\"revision\":%ld}", doc->revision);
+        lock_release(&doc->lock);
+        send_response(socket, "412 Precondition Failed", "application/json", reply);
+        return;
+    }
+    
+    PatchEdits edits = {0};
+    int parsed = is_json ? parse_json_edits(body, &edits)
+                         : parse_unified_diff(doc->content, doc->length, body, body_len, &edits);
+    // An empty edit list flushes live edits; with nothing buffered it is a no-op
+    int unchanged = parsed == 0 && edits.count == 0 && !doc->dirty;
+    long growth = 0;
+    for (int i = 0; i < edits.count; i++) growth += edits.items[i].text_len - edits.items[i].remove;
+    if (parsed == 0 && document_reserve(doc, doc->length + growth + 1 - doc->capacity) != 0) {
+        lock_release(&doc->lock);
+        patch_edits_free(&edits);
+        send_response(socket, "507 Insufficient Storage", "application/json", "{\"error\":\"Memory quota exceeded\"}");
+        return;
+    }
+    int applied = parsed == 0 ? document_apply_edits(doc, filename, &edits) : -1;
+    if (applied != 0) {
+        lock_release(&doc->lock);
+        patch_edits_free(&edits);
+        if (applied == -2) {
+            send_response(socket, "500 Internal Server Error", "application/json", "{\"error\":\"Could not write file\"}");
+        } else {
+            send_response(socket, "409 Conflict", "application/json", "{\"error\":\"Patch does not apply\"}");
+        }
+        return;
+    }
+    long revision = doc->revision;
+    long length = doc->length;
+    char hash_hex[16];
+    doc_hash_format(doc->live_hash, hash_hex);
+    lock_release(&doc->lock);
+    patch_edits_free(&edits);
+    
+    char etag[64];
+    snprintf(etag, sizeof(etag), "ETag: \"%ld\"\r\n", revision);
+    snprintf(reply, sizeof(reply), "{\"success\":true,\"revision\":%ld,\"length\":%ld,\"hash\":\"%s\"%s}",
+        revision, length, hash_hex, unchanged ? ",\"unchanged\":true" : "");
+    send_response_with_headers(socket, "200 OK", "application/json", etag, reply);
+    if (!unchanged) broadcast_file_saved(tenant, filename, revision, hash_hex);
+}
+
+// rsync-style weak checksum: a = sum of bytes, b = sum of prefix sums, 16 bits each
+static uint32_t weak_checksum(const unsigned char* p, long len) {
+    uint32_t a = 0, b = 0;
+    for (long i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+
+static uint32_t fnv1a32(const unsigned char* p, long len) {
+    uint32_t h = 2166136261u;
+    for (long i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t read_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Growable byte buffer for building binary responses
+static void byte_buffer_append_le32(ByteBuffer* buf, uint32_t v) {
+    unsigned char b[4] = {v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, (v >> 24) & 0xFF};
+    byte_buffer_append(buf, b, 4);
+}
+
+static void sync_emit_literal(ByteBuffer* out, const char* data, long len) {
+    if (len <= 0) return;
+    byte_buffer_append(out, "L", 1);
+    byte_buffer_append_le32(out, len);
+    byte_buffer_append(out, data, len);
+}
+
+// Encodes content as block copies from the client's copy plus literal bytes.
+// Records: 'C' first_block count (u32 LE each) or 'L' length bytes.
+void sync_delta(const char* content, long len, const unsigned char* sigs, uint32_t block_size, uint32_t block_count, ByteBuffer* out) {
+    uint32_t table_size = 1;
+    while (table_size < block_count * 2) table_size <<= 1;
+    int32_t* heads = mem_alloc(MEM_HTTP, table_size * sizeof(int32_t));
+    int32_t* chain = mem_alloc(MEM_HTTP, (block_count ? block_count : 1) * sizeof(int32_t));
+    for (uint32_t i = 0; i < table_size; i++) heads[i] = -1;
+    for (uint32_t i = block_count; i-- > 0; ) {
+        uint32_t slot = (read_le32(sigs + i * 8) * 2654435761u) & (table_size - 1);
+        chain[i] = heads[slot];
+        heads[slot] = i;
+    }
+    
+    const unsigned char* data = (const unsigned char*)content;
+    long literal_start = 0;
+    long copy_first = -1, copy_count = 0;
+    long pos = 0;
+    uint32_t a = 0, b = 0;
+    int have_window = 0;
+    
+    while (block_count > 0 && pos + (long)block_size <= len) {
+        if (!have_window) {
+            uint32_t w = weak_checksum(data + pos, block_size);
+            a = w & 0xFFFF;
+            b = w >> 16;
+            have_window = 1;
+        }
+        uint32_t weak = (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+        int32_t match = -1;
+        uint32_t strong = 0;
+        int strong_done = 0;
+        for (int32_t j = heads[(weak * 2654435761u) & (table_size - 1)]; j >= 0; j = chain[j]) {
+            if (read_le32(sigs + j * 8) != weak) continue;
+            if (!strong_done) {
+                strong = fnv1a32(data + pos, block_size);
+                strong_done = 1;
+            }
+            if (read_le32(sigs + j * 8 + 4) != strong) continue;
+            match = j;
+            if (copy_first >= 0 && j == copy_first + copy_count) break;
+        }
+        
+        if (match >= 0) {
+            sync_emit_literal(out, content + literal_start, pos - literal_start);
+            if (copy_first >= 0 && pos == literal_start && match == copy_first + copy_count) {
+                copy_count++;
+            } else {
+                if (copy_first >= 0) {
+                    byte_buffer_append(out, "C", 1);
+                    byte_buffer_append_le32(out, copy_first);
+                    byte_buffer_append_le32(out, copy_count);
+                }
+                copy_first = match;
+                copy_count = 1;
+            }
+            pos += block_size;
+            literal_start = pos;
+            have_window = 0;
+            continue;
+        }
+        
+        if (copy_first >= 0 && pos == literal_start) {
+            byte_buffer_append(out, "C", 1);
+            byte_buffer_append_le32(out, copy_first);
+            byte_buffer_append_le32(out, copy_count);
+            copy_first = -1;
+        }
+        if (pos + (long)block_size < len) {
+            unsigned char out_byte = data[pos], in_byte = data[pos + block_size];
+            a = a - out_byte + in_byte;
+            b = b - block_size * out_byte + a;
+        }
+        pos++;
+    }
+    
+    if (copy_first >= 0 && pos == literal_start) {
+        byte_buffer_append(out, "C", 1);
+        byte_buffer_append_le32(out, copy_first);
+        byte_buffer_append_le32(out, copy_count);
+    }
+    sync_emit_literal(out, content + literal_start, len - literal_start);
+    mem_free(heads);
+    mem_free(chain);
+}
+
+// POST /api/file/sync?name=: body is u32 block_size, u32 block_count, then a
+// (weak, strong) u32 pair per full block of the client's copy. The reply is the
+// current content expressed as sync_delta records, so a mostly-unchanged copy
+// costs only its changed ranges.
+void sync_file(int socket, Tenant* tenant, const char* filename, const char* body, long body_len) {
+    const unsigned char* sigs = (const unsigned char*)body + 8;
+    uint32_t block_size = body_len >= 8 ? read_le32((const unsigned char*)body) : 0;
+    uint32_t block_count = body_len >= 8 ? read_le32((const unsigned char*)body + 4) : 0;
+    if (!filename[0] || block_size == 0 || block_size > (1 << 24) || (long)block_count * 8 != body_len - 8) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid sync request\"}");
+        return;
+    }
+    
+    Document* doc = get_document(tenant, filename);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    int loaded = document_load(doc, filename);
+    if (loaded != 0) {
+        lock_release(&doc->lock);
+        if (loaded == -2) send_response(socket, "507 Insufficient Storage", "application/json", "{\"error\":\"Memory quota exceeded\"}");
+        else send_response(socket, "404 Not Found", "application/json", "{\"error\":\"File not found\"}");
+        return;
+    }
+    ByteBuffer delta = {0};
+    sync_delta(doc->content, doc->length, sigs, block_size, block_count, &delta);
+    long revision = doc->revision;
+    long length = doc->length;
+    char hash_hex[16];
+    doc_hash_format(doc->live_hash, hash_hex);
+    lock_release(&doc->lock);
+    
+    char header[512];
+    snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %ld\r\n"
+        "ETag: \"%ld\"\r\n"
+        "X-Content-Length: %ld\r\n"
+        "X-Content-Hash: %s\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Expose-Headers: ETag, X-Content-Length, X-Content-Hash\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        delta.len, revision, length, hash_hex);
+    send_all(socket, header, strlen(header));
+    send_all(socket, (const char*)delta.data, delta.len);
+    printf("Sync %s: %ld bytes as %ld byte delta\n", filename, length, delta.len);
+    mem_free(delta.data);
+}
+
+void delete_file_handler(int socket, Tenant* tenant, const char* filename) {
+    Document* doc = get_document(tenant, filename);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    // A file that only exists as unsaved live edits is deleted too
+    int removed = tenant->storage->remove(tenant, filename) == 0;
+    if (removed) fs_index_remove(tenant, filename);
+    if (removed || doc->dirty) {
+        doc->hash_known = 0;
+        doc->dirty = 0;
+        doc->revision++;
+        document_drop_packed(doc);
+        mem_free(doc->content);
+        doc->content = NULL;
+        doc->length = doc->capacity = 0;
+        doc->live_hash = doc_hash("", 0);
+        document_record_revision(doc);
+        undo_clear(doc);
+        document_account(doc);
+        lock_release(&doc->lock);
+        send_response(socket, "200 OK", "application/json", "{\"success\":true}");
+    } else {
+        lock_release(&doc->lock);
+        send_response(socket, "404 Not Found", "application/json", "{\"error\":\"File not found\"}");
+    }
+}
+
+// Workspace archives are tar streams, gzip-compressed on export. The export's
+// tar stream is cut into EXPORT_CHUNK pieces that a pool of threads compresses
+// as separate gzip members (which gunzip and tar read as one stream), sent in
+// order as they finish, so compression uses every core while the sender reads
+// the next files.
+#define EXPORT_CHUNK (1L << 20)
+#define EXPORT_SLOTS 16
+#define EXPORT_MAX_WORKERS 8
+#define IMPORT_MAX_FILE MAX_REQUEST_SIZE
+
+typedef struct {
+    unsigned char* in;
+    long in_len;
+    unsigned char* out;
+    long out_len;
+    int failed;
+    int done;
+} ExportChunk;
+
+typedef struct {
+    int socket;
+    int failed;
+    Tenant* tenant;
+    ByteBuffer pending;  // tar bytes not yet handed to a worker
+    ExportChunk chunks[EXPORT_SLOTS];
+    long submitted;
+    long taken;
+    long sent;
+    long long sent_bytes;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ExportStream;
+
+// Compresses submitted chunks until the stream stops, charging its CPU time
+// to the tenant
+static void* export_worker(void* arg) {
+    ExportStream* stream = arg;
+    long long cpu = thread_cpu_us();
+    thread_role("export");
+    pthread_mutex_lock(&stream->lock);
+    while (1) {
+        thread_wait("wait");
+        while (stream->taken == stream->submitted && !stream->stopping) pthread_cond_wait(&stream->cond, &stream->lock);
+        if (stream->taken == stream->submitted) break;
+        ExportChunk* chunk = &stream->chunks[stream->taken++ % EXPORT_SLOTS];
+        pthread_mutex_unlock(&stream->lock);
+        thread_state("compress");
+        
+        z_stream z = {0};
+        chunk->out = NULL;
+        chunk->out_len = 0;
+        chunk->failed = 1;
+        if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            long cap = deflateBound(&z, chunk->in_len);
+            chunk->out = mem_alloc(MEM_HTTP, cap);
+            z.next_in = chunk->in;
+            z.avail_in = chunk->in_len;
+            z.next_out = chunk->out;
+            z.avail_out = cap;
+            chunk->failed = deflate(&z, Z_FINISH) != Z_STREAM_END;
+            chunk->out_len = cap - z.avail_out;
+            deflateEnd(&z);
+        }
+        
+        pthread_mutex_lock(&stream->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    tenant_cpu_end(stream->tenant, cpu);
+    return NULL;
+}
+
+// Waits for the oldest unsent chunk and sends it
+static void export_send_one(ExportStream* stream) {
+    ExportChunk* chunk = &stream->chunks[stream->sent % EXPORT_SLOTS];
+    pthread_mutex_lock(&stream->lock);
+    while (!chunk->done) pthread_cond_wait(&stream->cond, &stream->lock);
+    chunk->done = 0;
+    pthread_mutex_unlock(&stream->lock);
+    // A chunk that did not compress would leave a hole in the archive, so the
+    // export stops there like it does when the client goes away
+    if (chunk->failed && !stream->failed) {
+        printf("Export %s: compression failed\n", stream->tenant->name);
+        stream->failed = 1;
+    }
+    if (!stream->failed && send_all(stream->socket, (const char*)chunk->out, chunk->out_len) != 0) stream->failed = 1;
+    stream->sent_bytes += chunk->out_len;
+    mem_free(chunk->in);
+    mem_free(chunk->out);
+    stream->sent++;
+}
+
+// Hands the pending tar bytes to the workers once a slot is free
+static void export_submit(ExportStream* stream) {
+    if (stream->pending.len == 0) return;
+    if (stream->submitted - stream->sent == EXPORT_SLOTS) export_send_one(stream);
+    ExportChunk* chunk = &stream->chunks[stream->submitted % EXPORT_SLOTS];
+    chunk->in = stream->pending.data;
+    chunk->in_len = stream->pending.len;
+    stream->pending = (ByteBuffer){0};
+    pthread_mutex_lock(&stream->lock);
+    stream->submitted++;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void export_write(ExportStream* stream, const void* data, long len) {
+    const char* p = data;
+    while (len > 0) {
+        long n = EXPORT_CHUNK - stream->pending.len < len ? EXPORT_CHUNK - stream->pending.len : len;
+        byte_buffer_append(&stream->pending, p, n);
+        p += n;
+        len -= n;
+        if (stream->pending.len == EXPORT_CHUNK) export_submit(stream);
+    }
+}
+
+// Writes data and zeros up to the next 512-byte block
+static void export_write_padded(ExportStream* stream, const void* data, long len) {
+    static const char zeros[512];
+    export_write(stream, data, len);
+    if (len % 512) export_write(stream, zeros, 512 - len % 512);
+}
+
+// Fills a ustar header. Returns -1 if path does not fit its name and prefix
+// fields.
+static int tar_header(unsigned char* block, const char* path, long size, time_t mtime, char type) {
+    memset(block, 0, 512);
+    size_t len = strlen(path);
+    const char* name = path;
+    if (len > 100) {
+        // Split at a '/' leaving at most 155 bytes before it and 100 after
+        name = NULL;
+        for (const char* slash = strchr(path, '/'); slash && !name; slash = strchr(slash + 1, '/')) {
+            if (slash - path <= 155 && len - (slash - path) - 1 <= 100) name = slash + 1;
+        }
+        if (!name) return -1;
+        memcpy(block + 345, path, name - 1 - path);
+    }
+    memcpy(block, name, strlen(name));
+    snprintf((char*)block + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf((char*)block + 108, 8, "%07o", 0);
+    snprintf((char*)block + 116, 8, "%07o", 0);
+    snprintf((char*)block + 124, 12, "%011lo", (unsigned long)size);
+    snprintf((char*)block + 136, 12, "%011lo", (unsigned long)mtime);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memset(block + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++) sum += block[i];
+    snprintf((char*)block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+    return 0;
+}
+
+// Appends one file (or directory) to the archive, preceded by a pax header
+// when its path is too long for ustar
+static void export_entry(ExportStream* stream, const char* path, const char* data, long size, time_t mtime, int is_dir) {
+    unsigned char block[512];
+    char name[520];
+    snprintf(name, sizeof(name), "%s%s", path, is_dir ? "/" : "");
+    if (tar_header(block, name, size, mtime, is_dir ? '5' : '0') != 0) {
+        // A pax record is "<length> path=<name>\n", the length counting itself
+        char record[600];
+        int body = strlen(name) + 7, len = body + 1;
+        while (len < body + (int)snprintf(NULL, 0, "%d", len)) len++;
+        snprintf(record, sizeof(record), "%d path=%s\n", len, name);
+        tar_header(block, "PaxHeader", len, mtime, 'x');
+        export_write(stream, block, 512);
+        export_write_padded(stream, record, len);
+        name[99] = '\0';
+        tar_header(block, name, size, mtime, is_dir ? '5' : '0');
+    }
+    export_write(stream, block, 512);
+    if (size) export_write_padded(stream, data, size);
+}
+
+typedef struct {
+    char* path;
+    time_t mtime;
+    int is_dir;
+} ExportItem;
+
+// Caller holds the tenant's fs_index_mutex. Lists the files and empty
+// directories under dir.
+static void export_collect(FsNode* dir, char* prefix, size_t prefix_len, ExportItem** items, long* count, long* capacity) {
+    for (int i = 0; i < dir->child_count; i++) {
+        FsNode* node = dir->children[i];
+        int n = snprintf(prefix + prefix_len, 512 - prefix_len, "%s%s", prefix_len ? "/" : "", node->name);
+        if (!node->is_dir || node->child_count == 0) {
+            if (*count == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 256;
+                *items = mem_realloc(MEM_HTTP, *items, *capacity * sizeof(ExportItem));
+            }
+            (*items)[(*count)++] = (ExportItem){mem_strdup(MEM_HTTP, prefix), node->mtime, node->is_dir};
+        }
+        if (node->is_dir) export_collect(node, prefix, prefix_len + n, items, count, capacity);
+    }
+}
+
+// GET /api/export[?path=dir]: streams the saved content of the workspace, or
+// of the folder or file at dir, as a .tar.gz. Entries are named from the
+// workspace root, and files the user may not read are left out.
+void export_archive(int socket, Tenant* tenant, const char* url, const char* user) {
+    char root[256];
+    query_param(url, "path", root, sizeof(root));
+    if (root[0] && !valid_path(root)) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid path\"}");
+        return;
+    }
+    
+    ExportItem* items = NULL;
+    long count = 0, capacity = 0;
+    char prefix[512];
+    snprintf(prefix, sizeof(prefix), "%s", root);
+    lock_acquire(&tenant->fs_index_mutex, LOCK_FS_INDEX);
+    FsNode* node = root[0] ? fs_walk(&tenant->fs_root, root, NULL, 0) : &tenant->fs_root;
+    if (node && node->is_dir) {
+        export_collect(node, prefix, strlen(prefix), &items, &count, &capacity);
+    } else if (node) {
+        items = mem_alloc(MEM_HTTP, sizeof(ExportItem));
+        items[count++] = (ExportItem){mem_strdup(MEM_HTTP, root), node->mtime, 0};
+    }
+    lock_release(&tenant->fs_index_mutex);
+    if (!node) {
+        send_response(socket, "404 Not Found", "application/json", "{\"error\":\"Not found\"}");
+        return;
+    }
+    
+    char header[512];
+    const char* base = strrchr(root, '/') ? strrchr(root, '/') + 1 : root[0] ? root : tenant->name;
+    snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/gzip\r\n"
+        "Content-Disposition: attachment; filename=\"%s.tar.gz\"\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: close\r\n"
+        "\r\n", base);
+    send_all(socket, header, strlen(header));
+    
+    ExportStream stream = {0};
+    stream.socket = socket;
+    stream.tenant = tenant;
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.cond, NULL);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int worker_count = cores < 1 ? 1 : cores > EXPORT_MAX_WORKERS ? EXPORT_MAX_WORKERS : cores;
+    pthread_t workers[EXPORT_MAX_WORKERS];
+    for (int i = 0; i < worker_count; i++) pthread_create(&workers[i], NULL, export_worker, &stream);
+    
+    long files = 0, raw_bytes = 0;
+    long long start = now_ms();
+    for (long i = 0; i < count; i++) {
+        const char* path = items[i].path;
+        if (!stream.failed && (acl_perms(user, path) & PERM_READ)) {
+            struct stat st;
+            long len;
+            char* content = items[i].is_dir ? NULL : tenant->storage->read(tenant, path, &len, &st);
+            if (items[i].is_dir) {
+                export_entry(&stream, path, NULL, 0, items[i].mtime, 1);
+            } else if (content) {
+                export_entry(&stream, path, content, len, st.st_mtime, 0);
+                files++;
+                raw_bytes += len;
+            }
+            mem_free(content);
+        }
+        mem_free(items[i].path);
+    }
+    mem_free(items);
+    static const char end[1024];
+    export_write(&stream, end, sizeof(end));
+    export_submit(&stream);
+    while (stream.sent < stream.submitted) export_send_one(&stream);
+    
+    pthread_mutex_lock(&stream.lock);
+    stream.stopping = 1;
+    pthread_cond_broadcast(&stream.cond);
+    pthread_mutex_unlock(&stream.lock);
+    for (int i = 0; i < worker_count; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.cond);
+    printf("Export %s:%s: %ld files, %ld bytes as %lld in %lld ms%s\n", tenant->name, root[0] ? root : "/",
+        files, raw_bytes, stream.sent_bytes, now_ms() - start, stream.failed ? " (aborted)" : "");
+}
+
+// The request body of an import, read from the socket as it is unpacked
+typedef struct {
+    int socket;
+    const unsigned char* head;  // body bytes that arrived with the headers
+    long head_len;
+    long pending;               // body bytes still to be received
+    int gzip;
+    z_stream z;
+    unsigned char in[BUFFER_SIZE];
+} ImportStream;
+
+static long import_read_raw(ImportStream* s, unsigned char* out, long len) {
+    if (s->head_len > 0) {
+        long n = len < s->head_len ? len : s->head_len;
+        memcpy(out, s->head, n);
+        s->head += n;
+        s->head_len -= n;
+        return n;
+    }
+    if (s->pending <= 0) return 0;
+    long n;
+    do {
+        n = tls_recv(s->socket, out, len < s->pending ? len : s->pending);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return 0;
+    s->pending -= n;
+    return n;
+}
+
+// Fills out with the next len bytes of the tar stream. Returns -1 if the body
+// ends first or does not inflate.
+static int import_read(ImportStream* s, unsigned char* out, long len) {
+    while (len > 0) {
+        if (!s->gzip) {
+            long n = import_read_raw(s, out, len);
+            if (n == 0) return -1;
+            out += n;
+            len -= n;
+            continue;
+        }
+        if (s->z.avail_in == 0) {
+            long n = import_read_raw(s, s->in, sizeof(s->in));
+            if (n == 0) return -1;
+            s->z.next_in = s->in;
+            s->z.avail_in = n;
+        }
+        s->z.next_out = out;
+        s->z.avail_out = len;
+        int rc = inflate(&s->z, Z_NO_FLUSH);
+        out += len - s->z.avail_out;
+        len = s->z.avail_out;
+        // A stream of several gzip members continues with the next one
+        if (rc == Z_STREAM_END) inflateReset(&s->z);
+        else if (rc != Z_OK && rc != Z_BUF_ERROR) return -1;
+    }
+    return 0;
+}
+
+// Reads an octal tar field, or a base-256 one (high bit set)
+static long tar_number(const unsigned char* field, int len) {
+    long value = 0;
+    if (field[0] & 0x80) {
+        for (int i = 1; i < len; i++) value = value << 8 | field[i];
+        return value;
+    }
+    for (int i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') value = value * 8 + field[i] - '0';
+    }
+    return value;
+}
+
+// Stores an imported file, through its document when one is open so that
+// editors see the new content
+static int import_store(Tenant* tenant, const char* path, const char* content, long len) {
+    uint64_t hash = xxh64(content, len, 0);
+    lock_acquire(&tenant->documents_mutex, LOCK_DOCUMENTS);
+    Document* doc = tenant->documents;
+    while (doc && strcmp(doc->name, path) != 0) doc = doc->next;
+    lock_release(&tenant->documents_mutex);
+    if (!doc) {
+        struct stat st;
+        if (tenant->storage->write(tenant, path, content, len, NULL, 0) != 0) return -1;
+        if (tenant->storage->stat(tenant, path, &st) == 0) {
+            fs_index_update(tenant, path, st.st_size, st.st_mtim);
+            fs_index_set_hash(tenant, path, st.st_size, st.st_mtim, hash);
+        }
+        return 0;
+    }
+    
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    if (document_ensure(doc, path) != 0 || document_reserve(doc, len + 1 - doc->capacity) != 0 ||
+        document_grow(doc, len) != 0 || tenant->storage->write(tenant, path, content, len, NULL, 0) != 0) {
+        lock_release(&doc->lock);
+        return -1;
+    }
+    document_replace(doc, content, len, NULL);
+    document_persisted(doc, path, hash);
+    long revision = doc->revision;
+    char hash_hex[16];
+    doc_hash_format(doc->live_hash, hash_hex);
+    lock_release(&doc->lock);
+    broadcast_file_saved(tenant, path, revision, hash_hex);
+    return 0;
+}
+
+// POST /api/import[?path=dir]: unpacks a tar archive, plain or gzip-compressed,
+// into the workspace (under dir) while it is being received; only one file at
+// a time is held in memory. Regular files are stored, folders come with them,
+// and other entries, files over IMPORT_MAX_FILE, invalid paths and files the
+// user may not write are skipped.
+void import_archive(int socket, Tenant* tenant, const char* headers, const char* url, const char* user,
+                    const char* body, long body_len, long body_pending) {
+    char root[256];
+    query_param(url, "path", root, sizeof(root));
+    if ((root[0] && !valid_path(root)) || body_len + body_pending == 0) {
+        send_response(socket, "400 Bad Request", "application/json",
+            root[0] && !valid_path(root) ? "{\"error\":\"Invalid path\"}" : "{\"error\":\"Empty archive\"}");
+        return;
+    }
+    
+    ImportStream* s = mem_calloc(MEM_HTTP, 1, sizeof(ImportStream));
+    s->socket = socket;
+    s->head = (const unsigned char*)body;
+    s->head_len = body_len;
+    s->pending = body_pending;
+    char expect[32];
+    if (header_value(headers, "Expect", expect, sizeof(expect)) == 0 && strcasecmp(expect, "100-continue") == 0) {
+        send_all(socket, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
+    
+    // The first two bytes tell gzip from a plain tar, which then gets them back
+    long had = s->head_len, peeked = 0;
+    while (peeked < 2) {
+        long n = import_read_raw(s, s->in + peeked, 2 - peeked);
+        if (n == 0) break;
+        peeked += n;
+    }
+    s->gzip = peeked == 2 && s->in[0] == 0x1f && s->in[1] == 0x8b;
+    const char* error = NULL;
+    if (s->gzip && inflateInit2(&s->z, 15 + 16) != Z_OK) {
+        // Answered like a broken archive once the body is read
+        error = "Could not decompress archive";
+        s->gzip = 0;
+    } else if (s->gzip) {
+        s->z.next_in = s->in;
+        s->z.avail_in = peeked;
+    } else if (had >= 2) {
+        s->head -= 2;
+        s->head_len += 2;
+    } else {
+        s->head = s->in;
+        s->head_len = peeked;
+    }
+    
+    long files = 0, bytes = 0, skipped = 0;
+    long long start = now_ms();
+    char long_name[1024] = "";
+    unsigned char block[512];
+    while (!error) {
+        if (import_read(s, block, 512) != 0) {
+            error = "Truncated archive";
+            break;
+        }
+        unsigned sum = 0;
+        int empty = 1;
+        for (int i = 0; i < 512; i++) {
+            sum += i >= 148 && i < 156 ? ' ' : block[i];
+            if (block[i]) empty = 0;
+        }
+        if (empty) break;
+        if (sum != tar_number(block + 148, 8)) {
+            error = "Invalid tar header";
+            break;
+        }
+        
+        long size = tar_number(block + 124, 12);
+        long padded = (size + 511) & ~511L;
+        char type = block[156];
+        char name[1024];
+        if (long_name[0]) {
+            snprintf(name, sizeof(name), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (block[345]) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", (const char*)block + 345, (const char*)block);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", (const char*)block);
+        }
+        
+        int is_file = type == '0' || type == '\0' || type == '7';
+        int wanted = is_file || type == 'x' || type == 'L';
+        if (!wanted || size < 0 || size > (type == 'x' || type == 'L' ? 65536 : IMPORT_MAX_FILE)) {
+            // Skipped in pieces, however large
+            if (type != '5' && type != 'g') skipped++;
+            unsigned char scratch[4096];
+            for (long left = padded; left > 0 && !error;) {
+                long n = left < (long)sizeof(scratch) ? left : (long)sizeof(scratch);
+                if (import_read(s, scratch, n) != 0) error = "Truncated archive";
+                left -= n;
+            }
+            continue;
+        }
+        char* data = mem_alloc(MEM_HTTP, padded + 1);
+        if (import_read(s, (unsigned char*)data, padded) != 0) {
+            mem_free(data);
+            error = "Truncated archive";
+            break;
+        }
+        data[size] = '\0';
+        
+        if (type == 'L') {
+            snprintf(long_name, sizeof(long_name), "%s", data);
+        } else if (type == 'x') {
+            // Records are "<length> <key>=<value>\n"; only path matters here
+            for (long off = 0; off < size;) {
+                long rec_len = atol(data + off);
+                const char* key = strchr(data + off, ' ');
+                if (rec_len <= 0 || off + rec_len > size || !key) break;
+                if (strncmp(key + 1, "path=", 5) == 0) {
+                    snprintf(long_name, sizeof(long_name), "%.*s", (int)(data + off + rec_len - 1 - key - 6), key + 6);
+                }
+                off += rec_len;
+            }
+        } else {
+            const char* rel = name;
+            while (strncmp(rel, "./", 2) == 0) rel += 2;
+            char path[1300];
+            snprintf(path, sizeof(path), "%s%s%s", root, root[0] ? "/" : "", rel);
+            if (strlen(path) < 256 && valid_path(path) && (acl_perms(user, path) & PERM_WRITE) &&
+                import_store(tenant, path, data, size) == 0) {
+                files++;
+                bytes += size;
+            } else {
+                skipped++;
+            }
+        }
+        mem_free(data);
+    }
+    // The rest (zero blocks, record padding, or what followed an error) is
+    // read so that the client gets to see the reply
+    while (import_read_raw(s, s->in, sizeof(s->in)) > 0) {}
+    if (s->gzip) inflateEnd(&s->z);
+    mem_free(s);
+    
+    printf("Import %s:%s: %ld files, %ld bytes, %ld skipped in %lld ms%s%s\n", tenant->name, root[0] ? root : "/",
+        files, bytes, skipped, now_ms() - start, error ? ": " : "", error ? error : "");
+    char reply[256];
+    snprintf(reply, sizeof(reply), "{\"success\":%s,\"files\":%ld,\"bytes\":%ld,\"skipped\":%ld%s%s%s}",
+        error ? "false" : "true", files, bytes, skipped, error ? ",\"error\":\"" : "", error ? error : "", error ? "\"" : "");
+    send_response(socket, error ? "400 Bad Request" : "200 OK", "application/json", reply);
+}
+
+// Caller holds room->lock (or is creating the room). Grows the index file to
+// slots entries and maps it.
+static int chat_map_index(ChatRoom* room, long slots) {
+    if (ftruncate(room->index_fd, slots * sizeof(uint64_t)) != 0) return -1;
+    uint64_t* index = mmap(NULL, slots * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, room->index_fd, 0);
+    if (index == MAP_FAILED) return -1;
+    if (room->index) munmap(room->index, room->index_slots * sizeof(uint64_t));
+    room->index = index;
+    room->index_slots = slots;
+    return 0;
+}
+
+static int chat_open_segment(ChatRoom* room, uint32_t segment, int flags) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%08x.log", room->dir, segment);
+    return open(path, flags, 0644);
+}
+
+// A room can only be started for a file that exists, on disk or as unsaved
+// live edits
+static int chat_room_allowed(Tenant* tenant, const char* name) {
+    struct stat st;
+    if (!valid_path(name)) return 0;
+    if (tenant->storage->stat(tenant, name, &st) == 0) return 1;
+    
+    lock_acquire(&tenant->documents_mutex, LOCK_DOCUMENTS);
+    Document* doc = tenant->documents;
+    while (doc && strcmp(doc->name, name) != 0) doc = doc->next;
+    lock_release(&tenant->documents_mutex);
+    if (!doc) return 0;
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    int dirty = doc->dirty;
+    lock_release(&doc->lock);
+    return dirty;
+}
+
+// Finds or opens the chat log of a room. Without create, only a log that
+// already exists is opened, so reads cannot leave rooms behind. Returns NULL
+// if there is no such room or it cannot be created.
+ChatRoom* get_chat_room(Tenant* tenant, const char* name, int create) {
+    pthread_mutex_lock(&tenant->chat_rooms_mutex);
+    ChatRoom* room = tenant->chat_rooms;
+    while (room && strcmp(room->name, name) != 0) room = room->next;
+    if (!room) {
+        char dir[192], path[256];
+        snprintf(dir, sizeof(dir), "%s/%016llx", tenant->chat_dir, (unsigned long long)xxh64(name, strlen(name), 0));
+        snprintf(path, sizeof(path), "%s/index", dir);
+        if (create) {
+            mkdir(tenant->chat_dir, 0755);
+            mkdir(dir, 0755);
+        }
+        int index_fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+        if (index_fd < 0 && !create) {
+            pthread_mutex_unlock(&tenant->chat_rooms_mutex);
+            return NULL;
+        }
+        
+        room = mem_calloc(MEM_OTHER, 1, sizeof(ChatRoom));
+        snprintf(room->name, sizeof(room->name), "%s", name);
+        snprintf(room->dir, sizeof(room->dir), "%s", dir);
+        room->index_fd = index_fd;
+        struct stat st;
+        long slots = CHAT_INDEX_SLOTS;
+        if (room->index_fd >= 0 && fstat(room->index_fd, &st) == 0 && st.st_size / (long)sizeof(uint64_t) > slots) {
+            slots = st.st_size / sizeof(uint64_t);
+        }
+        if (room->index_fd < 0 || chat_map_index(room, slots) != 0) {
+            printf("Chat log unavailable for %s: %s\n", name, strerror(errno));
+            if (room->index_fd >= 0) close(room->index_fd);
+            mem_free(room);
+            pthread_mutex_unlock(&tenant->chat_rooms_mutex);
+            return NULL;
+        }
+        uint64_t count = room->index[0];
+        room->segment = count ? (uint32_t)(room->index[count] >> 32) : 0;
+        room->segment_fd = chat_open_segment(room, room->segment, O_WRONLY | O_CREAT);
+        room->segment_size = room->segment_fd >= 0 ? lseek(room->segment_fd, 0, SEEK_END) : 0;
+        pthread_mutex_init(&room->lock, NULL);
+        room->next = tenant->chat_rooms;
+        tenant->chat_rooms = room;
+    }
+    pthread_mutex_unlock(&tenant->chat_rooms_mutex);
+    return room;
+}
+
+// Appends a message (username and text already JSON-escaped) and returns its
+// record, malloc'd and without the trailing newline, or NULL on failure.
+char* chat_append(ChatRoom* room, const char* username, const char* text, long long time_ms) {
+    pthread_mutex_lock(&room->lock);
+    uint64_t seq = room->index[0];
+    long cap = strlen(username) + strlen(text) + 128;
+    char* record = mem_alloc(MEM_OTHER, cap);
+    long len = snprintf(record, cap, "{\"seq\":%llu,\"username\":\"%s\",\"text\":\"%s\",\"time\":%lld}\n",
+        (unsigned long long)seq, username, text, time_ms);
+    
+    if (room->segment_size > 0 && room->segment_size + len > CHAT_SEGMENT_BYTES) {
+        int fd = chat_open_segment(room, room->segment + 1, O_WRONLY | O_CREAT | O_TRUNC);
+        if (fd >= 0) {
+            close(room->segment_fd);
+            room->segment_fd = fd;
+            room->segment++;
+            room->segment_size = 0;
+        }
+    }
+    if ((long)seq + 2 > room->index_slots && chat_map_index(room, room->index_slots * 2) != 0) {
+        pthread_mutex_unlock(&room->lock);
+        mem_free(record);
+        return NULL;
+    }
+    if (room->segment_fd < 0 || pwrite_all(room->segment_fd, record, len, room->segment_size) != 0) {
+        pthread_mutex_unlock(&room->lock);
+        mem_free(record);
+        return NULL;
+    }
+    // The record is written before the index slot and count that expose it
+    room->index[seq + 1] = (uint64_t)room->segment << 32 | (uint64_t)room->segment_size;
+    room->index[0] = seq + 1;
+    room->segment_size += len;
+    pthread_mutex_unlock(&room->lock);
+    
+    record[len - 1] = '\0';
+    return record;
+}
+
+// GET /api/chat?room=...&before=N&limit=M: up to M messages preceding sequence
+// number N (default: the newest), oldest first.
+void chat_history(int socket, Tenant* tenant, const char* url) {
+    char name[256], before_param[32], limit_param[32];
+    query_param(url, "room", name, sizeof(name));
+    query_param(url, "before", before_param, sizeof(before_param));
+    query_param(url, "limit", limit_param, sizeof(limit_param));
+    long limit = limit_param[0] ? atol(limit_param) : 50;
+    if (limit <= 0 || limit > CHAT_PAGE_LIMIT) limit = CHAT_PAGE_LIMIT;
+    
+    // A room nobody has written to has no history
+    ChatRoom* room = get_chat_room(tenant, name, 0);
+    
+    // The page's record locations are copied under the lock; records are never
+    // rewritten once indexed, so they are read after it is released
+    long count = 0, first = 0, before = 0;
+    struct {
+        uint32_t segment;
+        long offset;
+        long end;
+    }* spans = NULL;
+    if (room) {
+        pthread_mutex_lock(&room->lock);
+        count = room->index[0];
+        before = before_param[0] ? atol(before_param) : count;
+        if (before < 0 || before > count) before = count;
+        first = before > limit ? before - limit : 0;
+        spans = mem_alloc(MEM_HTTP, (before - first + 1) * sizeof(*spans));
+        for (long i = first; i < before; i++) {
+            uint32_t segment = room->index[i + 1] >> 32;
+            long offset = room->index[i + 1] & 0xFFFFFFFF;
+            long end;
+            if (i + 1 < count && (uint32_t)(room->index[i + 2] >> 32) == segment) {
+                end = room->index[i + 2] & 0xFFFFFFFF;
+            } else if (segment == room->segment) {
+                end = room->segment_size;
+            } else {
+                end = offset + CHAT_MAX_TEXT * 2 + 512;
+            }
+            spans[i - first].segment = segment;
+            spans[i - first].offset = offset;
+            spans[i - first].end = end;
+        }
+        pthread_mutex_unlock(&room->lock);
+    }
+    
+    ByteBuffer out = {0};
+    char head[2048];
+    char escaped_name[256 * 6 + 1];
+    *json_escape(name, strlen(name), escaped_name) = '\0';
+    snprintf(head, sizeof(head), "{\"room\":\"%s\",\"first\":%ld,\"count\":%ld,\"messages\":[", escaped_name, first, count);
+    byte_buffer_append(&out, head, strlen(head));
+    
+    int fd = -1;
+    uint32_t fd_segment = 0;
+    for (long i = first; i < before; i++) {
+        uint32_t segment = spans[i - first].segment;
+        long offset = spans[i - first].offset;
+        long end = spans[i - first].end;
+        if (fd < 0 || fd_segment != segment) {
+            if (fd >= 0) close(fd);
+            fd = chat_open_segment(room, segment, O_RDONLY);
+            fd_segment = segment;
+            if (fd < 0) break;
+        }
+        char* record = mem_alloc(MEM_HTTP, end - offset);
+        long got = pread(fd, record, end - offset, offset);
+        char* newline = got > 0 ? memchr(record, '\n', got) : NULL;
+        if (newline) {
+            if (i > first) byte_buffer_append(&out, ",", 1);
+            byte_buffer_append(&out, record, newline - record);
+        }
+        mem_free(record);
+    }
+    if (fd >= 0) close(fd);
+    mem_free(spans);
+    
+    byte_buffer_append(&out, "]}", 3);
+    send_response(socket, "200 OK", "application/json", (const char*)out.data);
+    mem_free(out.data);
+}
+
+void base64_encode(const unsigned char* input, int length, char* output) {
+    const char* b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i = 0, j = 0;
+    
+    for (i = 0; i < length - 2; i += 3) {
+        output[j++] = b64[(input[i] >> 2) & 0x3F];
+        output[j++] = b64[((input[i] & 0x3) << 4) | ((input[i+1] & 0xF0) >> 4)];
+        output[j++] = b64[((input[i+1] & 0xF) << 2) | ((input[i+2] & 0xC0) >> 6)];
+        output[j++] = b64[input[i+2] & 0x3F];
+    }
+    
+    if (i < length) {
+        output[j++] = b64[(input[i] >> 2) & 0x3F];
+        if (i == length - 1) {
+            output[j++] = b64[((input[i] & 0x3) << 4)];
+            output[j++] = '=';
+        } else {
+            output[j++] = b64[((input[i] & 0x3) << 4) | ((input[i+1] & 0xF0) >> 4)];
+            output[j++] = b64[((input[i+1] & 0xF) << 2)];
+        }
+        output[j++] = '=';
+    }
+    output[j] = '\0';
+}
+
+char* ws_handshake(const char* key) {
+    char combined[256];
+    snprintf(combined, sizeof(combined), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
+    
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1((unsigned char*)combined, strlen(combined), hash);
+    
+    char base64[64];
+    base64_encode(hash, SHA_DIGEST_LENGTH, base64);
+    
+    char* response = mem_alloc(MEM_CONNECTIONS, 512);
+    snprintf(response, 512,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", base64);
+    
+    return response;
+}
+
+// Decodes one complete frame from the start of buffer. Returns the unmasked
+// payload (malloc'd, NUL-terminated) and sets *consumed, or NULL when more
+// bytes are needed (*consumed == 0) or the frame is too large (*consumed < 0).
+char* ws_read_frame(unsigned char* buffer, long bytes, long* out_len, long* consumed, int* opcode, int* fin) {
+    *consumed = 0;
+    *out_len = 0;
+    if (bytes < 2) return NULL;
+    
+    *opcode = buffer[0] & 0x0F;
+    *fin = (buffer[0] & 0x80) != 0;
+    int masked = buffer[1] & 0x80;
+    uint64_t len = buffer[1] & 0x7F;
+    long idx = 2;
+    
+    if (len == 126) {
+        if (bytes < 4) return NULL;
+        len = (buffer[2] << 8) | buffer[3];
+        idx = 4;
+    } else if (len == 127) {
+        if (bytes < 10) return NULL;
+        len = 0;
+        for (int i = 0; i < 8; i++) {
+            len = (len << 8) | buffer[2 + i];
+        }
+        idx = 10;
+    }
+    if (len > MAX_REQUEST_SIZE) {
+        *consumed = -1;
+        return NULL;
+    }
+    
+    unsigned char mask[4];
+    if (masked) {
+        if (bytes < idx + 4) return NULL;
+        memcpy(mask, &buffer[idx], 4);
+        idx += 4;
+    }
+    
+    if (bytes < idx + (long)len) return NULL;
+    
+    char* message = mem_alloc(MEM_FRAMES, len + 1);
+    for (uint64_t i = 0; i < len; i++) {
+        message[i] = masked ? (buffer[idx + i] ^ mask[i % 4]) : buffer[idx + i];
+    }
+    message[len] = '\0';
+    *out_len = len;
+    *consumed = idx + len;
+    
+    return message;
+}
+
+void send_to_client(Client* client, const char* message) {
+    Frame* frame = ws_frame(0x1, message, strlen(message));
+    lock_acquire(&client->lock, LOCK_CLIENT);
+    client_enqueue(client, frame);
+    lock_release(&client->lock);
+    frame_release(frame);
+}
+
+// escaped is the JSON-escaped document; it goes last so it can be copied as is
+char* content_update_message(const char* uname, const char* fname, long revision, const char* hash_hex,
+                             const char* extra, const char* escaped, long escaped_len) {
+    long cap = escaped_len + 1024;
+    char* msg = mem_alloc(MEM_FRAMES, cap);
+    int n = snprintf(msg, cap,
+        "{\"type\":\"content_update\",\"username\":\"%s\",\"file\":\"%s\",\"revision\":%ld,\"hash\":\"%s\"%s,\"content\":\"",
+        uname, fname, revision, hash_hex, extra);
+    memcpy(msg + n, escaped, escaped_len);
+    strcpy(msg + n + escaped_len, "\"}");
+    return msg;
+}
+
+// Returns 1 if the sender holds perm on file, otherwise tells them why not
+int require_perm(Client* client, const char* file, int perm) {
+    lock_acquire(&client->lock, LOCK_CLIENT);
+    int allowed = (client_perms(client, file) & perm) == perm;
+    if (!allowed) {
+        char error_msg[512];
+        snprintf(error_msg, sizeof(error_msg), "{\"type\":\"error\",\"message\":\"No %s access to %s\"}",
+            perm & PERM_WRITE ? "write" : "read", file);
+        Frame* frame = ws_frame(0x1, error_msg, strlen(error_msg));
+        client_enqueue(client, frame);
+        frame_release(frame);
+    }
+    lock_release(&client->lock);
+    return allowed;
+}
+
+// content_change carries the sender's whole document. It becomes the live
+// document as a single splice, and the new revision and rolling hash go back to
+// the sender as an ack and out to everyone else with the content.
+void handle_content_change(Client* client, const char* message) {
+    long long parse_start = trace_now();
+    char uname[64], fname[256];
+    const char* content = strstr(message, "\"content\":\"");
+    if (json_string_field(message, "username", uname, sizeof(uname)) != 0 ||
+        json_string_field(message, "file", fname, sizeof(fname)) != 0 || !content) {
+        return;
+    }
+    content += 11;
+    const char* cend = json_string_end(content);
+    if (!cend || (fname[0] && !valid_path(fname)) || !require_perm(client, fname, PERM_WRITE)) return;
+    
+    long revision = 0;
+    char hash_hex[16] = "";
+    Document* doc = NULL;
+    if (fname[0]) {
+        long len;
+        char* text = json_unescape(content, cend, &len);
+        mem_retag(text, MEM_FRAMES);
+        trace_span("parse", parse_start);
+        long long dispatch_start = trace_now();
+        doc = get_document(client->tenant, fname);
+        lock_acquire(&doc->lock, LOCK_DOCUMENT);
+        if (document_ensure(doc, fname) != 0 || document_reserve(doc, len + 1 - doc->capacity) != 0 ||
+            document_grow(doc, len) != 0) {
+            lock_release(&doc->lock);
+            mem_free(text);
+            send_to_client(client, "{\"type\":\"error\",\"message\":\"Memory quota exceeded\"}");
+            return;
+        }
+        trace_span("room_dispatch", dispatch_start);
+        long long apply_start = trace_now();
+        if (document_replace(doc, text, len, client->undo_key) > 0) doc->dirty = 1;
+        revision = doc->revision;
+        doc_hash_format(doc->live_hash, hash_hex);
+        lock_release(&doc->lock);
+        mem_free(text);
+        trace_span("apply", apply_start);
+    }
+    
+    long long fanout_start = trace_now();
+    char* forward_msg = content_update_message(uname, fname, revision, hash_hex, "", content, cend - content);
+    broadcast_file(client->tenant, fname, doc, revision, forward_msg, client->socket);
+    mem_free(forward_msg);
+    trace_span("fanout", fanout_start);
+    if (doc) room_enforce(doc);
+    
+    if (fname[0]) {
+        char ack_msg[512];
+        snprintf(ack_msg, sizeof(ack_msg), "{\"type\":\"ack\",\"file\":\"%s\",\"revision\":%ld,\"hash\":\"%s\"}",
+            fname, revision, hash_hex);
+        send_to_client(client, ack_msg);
+    }
+}
+
+// hash_report: a client's hash of its copy at a revision, checked against the
+// document's recent revision hashes. A mismatch, or a revision
+// too old to check, tells the client to resync.
+void handle_hash_report(Client* client, const char* message) {
+    char fname[256], reported[32];
+    const char* rev = strstr(message, "\"revision\":");
+    if (json_string_field(message, "file", fname, sizeof(fname)) != 0 || !fname[0] ||
+        json_string_field(message, "hash", reported, sizeof(reported)) != 0 || !rev) {
+        return;
+    }
+    long revision = atol(rev + 11);
+    
+    Document* doc = get_document(client->tenant, fname);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    DocHash expected;
+    char expected_hex[16] = "";
+    int known = document_hash_at(doc, revision, &expected) == 0;
+    if (known) doc_hash_format(expected, expected_hex);
+    long current = doc->revision;
+    lock_release(&doc->lock);
+    
+    if (known && strcmp(expected_hex, reported) == 0) return;
+    
+    printf("Divergence on %s: %s reported %s at revision %ld\n", fname, client->username, reported, revision);
+    char resync_msg[512];
+    snprintf(resync_msg, sizeof(resync_msg), "{\"type\":\"resync\",\"file\":\"%s\",\"revision\":%ld}", fname, current);
+    send_to_client(client, resync_msg);
+}
+
+// undo / redo: applies the sender's newest history entry for the file. The
+// result goes to everyone, the sender included, since it did not originate in
+// their editor.
+void handle_undo(Client* client, const char* message, int redo) {
+    char uname[64], fname[256];
+    if (json_string_field(message, "username", uname, sizeof(uname)) != 0 ||
+        json_string_field(message, "file", fname, sizeof(fname)) != 0 || !valid_path(fname) ||
+        !require_perm(client, fname, PERM_WRITE)) {
+        return;
+    }
+    
+    Document* doc = get_document(client->tenant, fname);
+    lock_acquire(&doc->lock, LOCK_DOCUMENT);
+    int undone = document_ensure(doc, fname) == 0 ? document_undo(doc, client->undo_key, redo) : -1;
+    if (undone < 0) {
+        lock_release(&doc->lock);
+        send_to_client(client, "{\"type\":\"error\",\"message\":\"Memory quota exceeded\"}");
+        return;
+    }
+    if (!undone) {
+        lock_release(&doc->lock);
+        char empty_msg[512];
+        snprintf(empty_msg, sizeof(empty_msg), "{\"type\":\"undo_empty\",\"file\":\"%s\",\"redo\":%s}",
+            fname, redo ? "true" : "false");
+        send_to_client(client, empty_msg);
+        return;
+    }
+    doc->dirty = 1;
+    char hash_hex[16];
+    doc_hash_format(doc->live_hash, hash_hex);
+    char* escaped = mem_alloc(MEM_FRAMES, doc->length * 6 + 1);
+    long escaped_len = json_escape(doc->content, doc->length, escaped) - escaped;
+    long revision = doc->revision;
+    lock_release(&doc->lock);
+    
+    char* update_msg = content_update_message(uname, fname, revision, hash_hex, ",\"undo\":true", escaped, escaped_len);
+    broadcast_file(client->tenant, fname, doc, revision, update_msg, -1);
+    mem_free(update_msg);
+    mem_free(escaped);
+    room_enforce(doc);
+}
+
+// chat: appended to the room's log, then sent to everyone in the room
+void handle_chat(Client* client, const char* message) {
+    char uname[64], fname[256];
+    const char* text = strstr(message, "\"text\":\"");
+    if (json_string_field(message, "username", uname, sizeof(uname)) != 0 ||
+        json_string_field(message, "file", fname, sizeof(fname)) != 0 || !text) {
+        return;
+    }
+    text += 8;
+    const char* text_end = json_string_end(text);
+    if (!text_end || text_end == text || text_end - text > CHAT_MAX_TEXT) return;
+    // Records are newline-framed, so the text must be JSON-escaped already
+    for (const char* c = text; c < text_end; c++) {
+        if ((unsigned char)*c < 0x20) return;
+    }
+    if (!require_perm(client, fname, PERM_READ)) return;
+    
+    long name_len;
+    char* room_name = json_unescape(fname, fname + strlen(fname), &name_len);
+    mem_retag(room_name, MEM_FRAMES);
+    ChatRoom* room = chat_room_allowed(client->tenant, room_name) ? get_chat_room(client->tenant, room_name, 1) : NULL;
+    mem_free(room_name);
+    if (!room) return;
+    
+    // The username is re-escaped from its decoded form, whatever the client sent
+    long uname_len;
+    char* raw_uname = json_unescape(uname, uname + strlen(uname), &uname_len);
+    char escaped_uname[64 * 6 + 1];
+    *json_escape(raw_uname, uname_len, escaped_uname) = '\0';
+    mem_free(raw_uname);
+    
+    char* raw_text = mem_strndup(MEM_FRAMES, text, text_end - text);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    char* record = chat_append(room, escaped_uname, raw_text, (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    mem_free(raw_text);
+    if (!record) {
+        printf("Failed to append chat message for %s: %s\n", fname, strerror(errno));
+        return;
+    }
+    
+    long cap = strlen(record) + strlen(fname) + 64;
+    char* chat_msg = mem_alloc(MEM_FRAMES, cap);
+    snprintf(chat_msg, cap, "{\"type\":\"chat\",\"room\":\"%s\",%s", fname, record + 1);
+    broadcast_room(client->tenant, fname, chat_msg);
+    mem_free(chat_msg);
+    mem_free(record);
+}
+
+void handle_ws_message(Client* client, char* message) {
+    long long now = now_ms();
+    __atomic_store_n(&client->last_active_ms, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->msgs_in, client->msgs_in + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->bytes_in, client->bytes_in + strlen(message), __ATOMIC_RELAXED);
+    rate_count(&client->in_rate, now, 1);
+    
+    // With authentication on, the name comes from the token and cannot be
+    // claimed, so one that is present must parse and match
+    char uname[sizeof(client->username)];
+    int has_uname = json_string_field(message, "username", uname, sizeof(uname)) == 0;
+    if (auth_enabled && (has_uname ? strcmp(uname, client->username) != 0 : strstr(message, "\"username\":") != NULL)) {
+        return;
+    }
+    if (strstr(message, "\"type\":\"join\"")) {
+        // A client rejoining after a reconnect is back in the room it had open
+        char fname[sizeof(client->current_file)];
+        int has_file = json_string_field(message, "file", fname, sizeof(fname)) == 0;
+        lock_acquire(&client->lock, LOCK_CLIENT);
+        if (has_uname && !auth_enabled) strcpy(client->username, uname);
+        if (has_file) strcpy(client->current_file, fname);
+        lock_release(&client->lock);
+    }
+    else if (strstr(message, "\"type\":\"content_change\"")) {
+        handle_content_change(client, message);
+    }
+    else if (strstr(message, "\"type\":\"hash_report\"")) {
+        handle_hash_report(client, message);
+    }
+    else if (strstr(message, "\"type\":\"chat\"")) {
+        handle_chat(client, message);
+    }
+    else if (strstr(message, "\"type\":\"undo\"")) {
+        handle_undo(client, message, 0);
+    }
+    else if (strstr(message, "\"type\":\"redo\"")) {
+        handle_undo(client, message, 1);
+    }
+    else if (strstr(message, "\"type\":\"cursor_move\"")) {
+        char* pos = strstr(message, "\"position\":");
+        char fname[sizeof(client->current_file)];
+        
+        if (pos && has_uname && json_string_field(message, "file", fname, sizeof(fname)) == 0) {
+            pos += 11;
+            int position = atoi(pos);
+            
+            lock_acquire(&client->lock, LOCK_CLIENT);
+            client->cursor_pos = position;
+            strcpy(client->current_file, fname);
+            if (!auth_enabled) strcpy(client->username, uname);
+            lock_release(&client->lock);
+            
+            char cursor_msg[512];
+            snprintf(cursor_msg, sizeof(cursor_msg),
+                "{\"type\":\"cursor_update\",\"username\":\"%s\",\"position\":%d,\"color\":\"%s\",\"file\":\"%s\"}",
+                client->username, position, client->color, client->current_file);
+            broadcast_message(client->tenant, cursor_msg, client->socket);
+        }
+    }
+    else if (strstr(message, "\"type\":\"file_change\"")) {
+        char fname[sizeof(client->current_file)];
+        if (json_string_field(message, "file", fname, sizeof(fname)) == 0) {
+            lock_acquire(&client->lock, LOCK_CLIENT);
+            strcpy(client->current_file, fname);
+            lock_release(&client->lock);
+        }
+    }
+}
+
+// Handles one complete message, charged to the workspace's CPU time and
+// possibly traced. received_us is when its last bytes arrived.
+static void dispatch_ws_message(Client* client, char* message, long len, long long received_us) {
+    flight_event(FLIGHT_MESSAGE, client->socket, len, message, len);
+    long long cpu = tenant_cpu_begin(client->tenant);
+    trace_begin();
+    trace_span("receive", received_us);
+    long long handle_start = trace_now();
+    handle_ws_message(client, message);
+    if (trace_current) {
+        char type[24];
+        if (json_string_field(message, "type", type, sizeof(type)) != 0) strcpy(type, "message");
+        trace_span(type, handle_start);
+    }
+    trace_end();
+    tenant_cpu_end(client->tenant, cpu);
+}
+
+void* handle_websocket(void* arg) {
+    Client* client = (Client*)arg;
+    int socket = client->socket;
+    thread_role("websocket");
+    flight_event(FLIGHT_CONNECT, socket, 0, client->username, strlen(client->username));
+    
+    printf("WebSocket client connected: %s\n", client->username);
+    
+    char init_msg[256];
+    snprintf(init_msg, sizeof(init_msg), "{\"type\":\"init\",\"color\":\"%s\"}", client->color);
+    send_to_client(client, init_msg);
+    
+    char join_msg[512];
+    snprintf(join_msg, sizeof(join_msg), "{\"type\":\"user_joined\",\"username\":\"%s\"}", client->username);
+    broadcast_message(client->tenant, join_msg, socket);
+    
+    lock_acquire(&clients_mutex, LOCK_CLIENTS);
+    char users_msg[BUFFER_SIZE] = "{\"type\":\"users_list\",\"users\":[";
+    Client* curr = clients;
+    int first = 1;
+    while (curr) {
+        if (curr->active && !curr->follower && curr->tenant == client->tenant) {
+            if (!first) strcat(users_msg, ",");
+            char user_data[512];
+            snprintf(user_data, sizeof(user_data), 
+                "{\"username\":\"%s\",\"color\":\"%s\",\"file\":\"%s\",\"cursor_pos\":%d}",
+                curr->username, curr->color, curr->current_file, curr->cursor_pos);
+            strcat(users_msg, user_data);
+            first = 0;
+        }
+        curr = curr->next;
+    }
+    strcat(users_msg, "]}");
+    lock_release(&clients_mutex);
+    
+    send_to_client(client, users_msg);
+    
+    // Frames may span several recv() calls and messages several frames
+    long capacity = BUFFER_SIZE;
+    long used = 0;
+    unsigned char* buffer = mem_alloc(MEM_CONNECTIONS, capacity);
+    char* pending = NULL;
+    long pending_len = 0;
+    int closing = 0;
+    
+    while (!closing) {
+        if (used == capacity) {
+            capacity *= 2;
+            buffer = mem_realloc(MEM_CONNECTIONS, buffer, capacity);
+        }
+        thread_wait("recv");
+        long bytes = tls_recv(socket, buffer + used, capacity - used);
+        thread_state("handle");
+        flight_event(FLIGHT_RECV, socket, bytes, NULL, 0);
+        if (bytes <= 0) {
+            printf("Client disconnected: %s\n", client->username);
+            break;
+        }
+        long long received_us = now_us();
+        used += bytes;
+        
+        long offset = 0;
+        while (!closing) {
+            long msg_len = 0, consumed;
+            int opcode, fin;
+            char* frame = ws_read_frame(buffer + offset, used - offset, &msg_len, &consumed, &opcode, &fin);
+            if (consumed < 0 || (frame && pending_len + msg_len > MAX_REQUEST_SIZE)) {
+                mem_free(frame);
+                closing = 1;
+                break;
+            }
+            if (!frame) break;
+            offset += consumed;
+            
+            if (opcode == 0x8) {
+                closing = 1;
+            } else if (opcode == 0x9) {
+                Frame* pong = ws_frame(0xA, frame, msg_len);
+                lock_acquire(&client->lock, LOCK_CLIENT);
+                client_enqueue(client, pong);
+                lock_release(&client->lock);
+                frame_release(pong);
+            } else if (opcode == 0x1 || opcode == 0x0) {
+                if (!pending && fin) {
+                    dispatch_ws_message(client, frame, msg_len, received_us);
+                } else {
+                    pending = mem_realloc(MEM_CONNECTIONS, pending, pending_len + msg_len + 1);
+                    memcpy(pending + pending_len, frame, msg_len);
+                    pending_len += msg_len;
+                    pending[pending_len] = '\0';
+                    if (fin) {
+                        dispatch_ws_message(client, pending, pending_len, received_us);
+                        mem_free(pending);
+                        pending = NULL;
+                        pending_len = 0;
+                    }
+                }
+            }
+            mem_free(frame);
+        }
+        memmove(buffer, buffer + offset, used - offset);
+        used -= offset;
+    }
+    mem_free(buffer);
+    mem_free(pending);
+    
+    char leave_msg[512];
+    snprintf(leave_msg, sizeof(leave_msg), "{\"type\":\"user_left\",\"username\":\"%s\"}", client->username);
+    broadcast_message(client->tenant, leave_msg, socket);
+    flight_event(FLIGHT_DISCONNECT, socket, 0, client->username, strlen(client->username));
+    
+    remove_client(socket);
+    return NULL;
+}
+
+void send_html(int socket);
+
+// Reads a whole request, following Content-Length across as many recv() calls
+// as the body needs. Returns a NUL-terminated malloc'd buffer with the headers
+// terminated at the blank line; *body / *body_len describe the body.
+char* read_http_request(int socket, char** body, long* body_len, long* body_pending) {
+    long capacity = BUFFER_SIZE;
+    long used = 0;
+    char* buffer = mem_alloc(MEM_HTTP, capacity + 1);
+    char* header_end = NULL;
+    
+    while (!header_end) {
+        if (used == capacity) {
+            mem_free(buffer);
+            return NULL;
+        }
+        long bytes = tls_recv(socket, buffer + used, capacity - used);
+        if (bytes <= 0) {
+            mem_free(buffer);
+            return NULL;
+        }
+        used += bytes;
+        buffer[used] = '\0';
+        header_end = strstr(buffer, "\r\n\r\n");
+    }
+    
+    long header_len = header_end + 4 - buffer;
+    long content_length = 0;
+    char value[32];
+    if (header_value(buffer, "Content-Length", value, sizeof(value)) == 0) content_length = atol(value);
+    // An import is unpacked as it arrives; only what came with the headers is
+    // returned, and body_pending is what is still to be received
+    int streamed = strncmp(buffer, "POST /api/import", 16) == 0;
+    if (content_length < 0 || (!streamed && header_len + content_length > MAX_REQUEST_SIZE)) {
+        mem_free(buffer);
+        return NULL;
+    }
+    *body_pending = 0;
+    if (streamed) {
+        if (used > header_len + content_length) used = header_len + content_length;
+        *body_pending = header_len + content_length - used;
+        content_length = used - header_len;
+    }
+    
+    if (header_len + content_length > capacity) {
+        capacity = header_len + content_length;
+        buffer = mem_realloc(MEM_HTTP, buffer, capacity + 1);
+    }
+    while (used < header_len + content_length) {
+        long bytes = tls_recv(socket, buffer + used, header_len + content_length - used);
+        if (bytes <= 0) break;
+        used += bytes;
+    }
+    buffer[used] = '\0';
+    buffer[header_len - 2] = '\0';
+    *body = buffer + header_len;
+    *body_len = used - header_len;
+    return buffer;
+}
+
+// Reads one HTTP/1.1 request from socket and answers it
+static void http_serve_request(int socket) {
+    char* body;
+    long body_len, body_pending;
+    char* buffer = read_http_request(socket, &body, &body_len, &body_pending);
+    if (!buffer) return;
+    
+    char method[16], path[512];
+    sscanf(buffer, "%15s %511s", method, path);
+    thread_state("handle");
+    const char* line_end = strpbrk(buffer, "\r\n");
+    flight_event(FLIGHT_HTTP, socket, body_len, buffer, line_end ? line_end - buffer : (long)strlen(buffer));
+    
+    char if_match[64];
+    if (header_value(buffer, "If-Match", if_match, sizeof(if_match)) == 0) {
+        char* start = if_match;
+        while (*start == '"') start++;
+        memmove(if_match, start, strlen(start) + 1);
+        char* quote = strchr(if_match, '"');
+        if (quote) *quote = '\0';
+    }
+    
+    // The target file is parsed once, from ?name= or a JSON body's "filename",
+    // and the same string is authorized and handed to the handler. A request
+    // naming two different files is rejected.
+    char content_type[128] = {0};
+    header_value(buffer, "Content-Type", content_type, sizeof(content_type));
+    char filename[256] = {0};
+    int name_conflict = 0;
+    if (strncmp(path, "/api/file", 9) == 0 || strncmp(path, "/api/stream", 11) == 0) {
+        char body_name[256] = {0};
+        int json_body = body && strncmp(path, "/api/file/sync", 14) != 0 &&
+            (strcmp(method, "PATCH") != 0 || strstr(content_type, "json"));
+        if (json_body) json_string_field(body, "filename", body_name, sizeof(body_name));
+        if (query_param(path, "name", filename, sizeof(filename)) != 0) {
+            snprintf(filename, sizeof(filename), "%s", body_name);
+        } else if (body_name[0] && strcmp(body_name, filename) != 0) {
+            name_conflict = 1;
+        }
+    }
+    int bad_path = strncmp(path, "/api/files", 10) != 0 && filename[0] && !valid_path(filename);
+    
+    // Every API call but login carries a session token when authentication is on
+    char user[64];
+    Tenant* tenant = request_tenant(buffer, path);
+    long long cpu = tenant ? tenant_cpu_begin(tenant) : 0;
+    
+    if (strcmp(method, "OPTIONS") == 0) {
+        send_response(socket, "200 OK", "text/plain", "");
+    }
+    else if (strcmp(method, "GET") == 0 && (strcmp(path, "/") == 0 || strncmp(path, "/?", 2) == 0)) {
+        send_html(socket);
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/admin/", 7) == 0 && !request_from_localhost(socket)) {
+        send_response(socket, "403 Forbidden", "application/json", "{\"error\":\"Only available from localhost\"}");
+    }
+    else if (strcmp(method, "GET") == 0 && strcmp(path, "/admin/state") == 0) {
+        admin_state(socket);
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/admin/profile", 14) == 0) {
+        admin_profile(socket, path);
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/admin/trace", 12) == 0) {
+        admin_trace(socket, path);
+    }
+    else if (strcmp(method, "GET") == 0 && strcmp(path, "/admin/metrics") == 0) {
+        admin_metrics(socket);
+    }
+    else if (bad_path) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid file path\"}");
+    }
+    else if (name_conflict) {
+        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Conflicting file names\"}");
+    }
+    else if (strncmp(path, "/api/login", 10) == 0) {
+        login_handler(socket, method, body);
+    }
+    else if (!tenant) {
+        send_response(socket, "404 Not Found", "application/json", "{\"error\":\"Unknown workspace\"}");
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/workspace", 14) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, NULL, 0, user, sizeof(user)) == 0) workspace_info(socket, tenant);
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/files", 10) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, NULL, 0, user, sizeof(user)) == 0) list_files(socket, tenant, user);
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/tree", 9) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, NULL, 0, user, sizeof(user)) == 0) list_tree(socket, tenant, path, user);
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/export", 11) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, NULL, 0, user, sizeof(user)) == 0) {
+            export_archive(socket, tenant, path, user);
+        }
+    }
+    else if (strcmp(method, "POST") == 0 && strncmp(path, "/api/import", 11) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, NULL, 0, user, sizeof(user)) == 0) {
+            import_archive(socket, tenant, buffer, path, user, body, body_len, body_pending);
+        }
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/chat?", 10) == 0) {
+        char room[256];
+        query_param(path, "room", room, sizeof(room));
+        if (authorize_request(socket, buffer, path, tenant, room, PERM_READ, user, sizeof(user)) == 0) {
+            chat_history(socket, tenant, path);
+        }
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/file?name=", 15) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, filename, PERM_READ, user, sizeof(user)) == 0) {
+            read_file(socket, tenant, filename);
+        }
+    }
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/stream?", 12) == 0) {
+        if (!filename[0]) {
+            send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Missing file name\"}");
+        } else if (authorize_request(socket, buffer, path, tenant, filename, PERM_READ, user, sizeof(user)) == 0) {
+            follow_file(socket, tenant, buffer, filename, user);
+        }
+    }
+    else if (strcmp(method, "POST") == 0 && strncmp(path, "/api/file/sync?", 15) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, filename, PERM_READ, user, sizeof(user)) == 0) {
+            sync_file(socket, tenant, filename, body, body_len);
+        }
+    }
+    else if (strcmp(method, "POST") == 0 && strncmp(path, "/api/file", 9) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, filename, PERM_WRITE, user, sizeof(user)) == 0) {
+            write_file(socket, tenant, filename, body, if_match[0] ? if_match : NULL);
+        }
+    }
+    else if (strcmp(method, "PATCH") == 0 && strncmp(path, "/api/file", 9) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, filename, PERM_WRITE, user, sizeof(user)) == 0) {
+            patch_file(socket, tenant, filename, path, content_type, if_match[0] ? if_match : NULL, body, body_len);
+        }
+    }
+    else if (strcmp(method, "DELETE") == 0 && strncmp(path, "/api/file?name=", 15) == 0) {
+        if (authorize_request(socket, buffer, path, tenant, filename, PERM_WRITE, user, sizeof(user)) == 0) {
+            delete_file_handler(socket, tenant, filename);
+        }
+    }
+    else {
+        send_response(socket, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");
+    }
+    
+    if (tenant) tenant_cpu_end(tenant, cpu);
+    mem_free(buffer);
+}
+
+// HTTP/2 on the HTTP port, with prior knowledge in cleartext (h2c) or chosen
+// through ALPN over TLS, so a page and its API calls share one connection.
+// Each stream is replayed as an HTTP/1.1 request to http_serve_request on one
+// end of a socketpair, in a thread of its own as if it were a connection; a
+// pump thread per stream turns the response read from the other end into
+// HEADERS and DATA frames, within the peer's flow-control windows. The
+// connection thread reads frames, decodes headers and forwards request
+// bodies, granting the peer more credit once the socketpair has taken them.
+// Frames go out under the connection lock.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_MAX 16384
+#define H2_MAX_STREAMS 100
+#define H2_TABLE_SIZE 4096
+#define H2_DEFAULT_WINDOW 65535
+#define H2_CONN_WINDOW (1L << 20)
+#define H2_WINDOW_MAX 0x7fffffffL
+
+enum { H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION };
+enum { H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED,
+       H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR };
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+// HPACK (RFC 7541). Each direction keeps a dynamic table of recent fields,
+// newest first; an entry costs its name and value plus 32 bytes.
+static const char* hpack_static[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""},
+    {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+    {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const uint32_t hpack_huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t hpack_huffman_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+typedef struct HpackEntry {
+    char* name;
+    char* value;
+} HpackEntry;
+
+typedef struct HpackTable {
+    HpackEntry entries[H2_TABLE_SIZE / 32];
+    int count;
+    long size;
+    long limit;
+} HpackTable;
+
+static void hpack_evict(HpackTable* table, long limit) {
+    while (table->count && table->size > limit) {
+        HpackEntry* e = &table->entries[--table->count];
+        table->size -= strlen(e->name) + strlen(e->value) + 32;
+        mem_free(e->name);
+        mem_free(e->value);
+    }
+}
+
+static void hpack_insert(HpackTable* table, const char* name, const char* value) {
+    long size = strlen(name) + strlen(value) + 32;
+    hpack_evict(table, table->limit - size);
+    if (size > table->limit) return;
+    memmove(&table->entries[1], &table->entries[0], table->count * sizeof(HpackEntry));
+    table->entries[0] = (HpackEntry){mem_strdup(MEM_HTTP, name), mem_strdup(MEM_HTTP, value)};
+    table->count++;
+    table->size += size;
+}
+
+static int hpack_lookup(HpackTable* table, long index, const char** name, const char** value) {
+    if (index >= 1 && index <= 61) {
+        *name = hpack_static[index - 1][0];
+        *value = hpack_static[index - 1][1];
+        return 0;
+    }
+    if (index < 62 || index - 62 >= table->count) return -1;
+    *name = table->entries[index - 62].name;
+    *value = table->entries[index - 62].value;
+    return 0;
+}
+
+// Index of the field, or of any field called name if value is NULL; 0 if none
+static int hpack_find(HpackTable* table, const char* name, const char* value) {
+    for (int i = 0; i < 61; i++) {
+        if (strcmp(hpack_static[i][0], name) == 0 && (!value || strcmp(hpack_static[i][1], value) == 0)) return i + 1;
+    }
+    for (int i = 0; i < table->count; i++) {
+        if (strcmp(table->entries[i].name, name) == 0 && (!value || strcmp(table->entries[i].value, value) == 0)) return i + 62;
+    }
+    return 0;
+}
+
+// Reads an integer with a bits-bit prefix. Returns -1 if it is cut short or too large.
+static long hpack_int(const unsigned char** p, const unsigned char* end, int bits) {
+    if (*p >= end) return -1;
+    long max = (1 << bits) - 1;
+    long value = *(*p)++ & max;
+    if (value < max) return value;
+    for (int shift = 0; shift < 28; shift += 7) {
+        if (*p >= end) return -1;
+        unsigned char b = *(*p)++;
+        value += (long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return value;
+    }
+    return -1;
+}
+
+static void hpack_put_int(ByteBuffer* out, int pattern, int bits, long value) {
+    long max = (1 << bits) - 1;
+    unsigned char b = pattern | (value < max ? value : max);
+    byte_buffer_append(out, &b, 1);
+    if (value < max) return;
+    for (value -= max; value >= 128; value >>= 7) {
+        b = (value & 0x7f) | 0x80;
+        byte_buffer_append(out, &b, 1);
+    }
+    b = value;
+    byte_buffer_append(out, &b, 1);
+}
+
+static void hpack_put_string(ByteBuffer* out, const char* s) {
+    long len = strlen(s);
+    hpack_put_int(out, 0, 7, len);
+    byte_buffer_append(out, s, len);
+}
+
+// Decoding tree of the Huffman code: children are node indexes, or a symbol
+// s as -(s + 1)
+static int16_t huffman_tree[256][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_build(void) {
+    int nodes = 1;
+    for (int sym = 0; sym < 257; sym++) {
+        int node = 0;
+        for (int i = hpack_huffman_bits[sym] - 1; i > 0; i--) {
+            int bit = hpack_huffman_codes[sym] >> i & 1;
+            if (!huffman_tree[node][bit]) huffman_tree[node][bit] = nodes++;
+            node = huffman_tree[node][bit];
+        }
+        huffman_tree[node][hpack_huffman_codes[sym] & 1] = -(sym + 1);
+    }
+}
+
+// Returns NULL unless the code ends in at most 7 bits of EOS padding. NUL and
+// EOS are rejected as symbols.
+static char* huffman_decode(const unsigned char* in, long len) {
+    pthread_once(&huffman_once, huffman_build);
+    // The shortest code is 5 bits
+    char* out = mem_alloc(MEM_HTTP, len * 8 / 5 + 1);
+    long n = 0;
+    int node = 0, depth = 0, ones = 1;
+    for (long i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = in[i] >> b & 1;
+            int next = huffman_tree[node][bit];
+            depth++;
+            ones &= bit;
+            if (next > 0) {
+                node = next;
+                continue;
+            }
+            int sym = -next - 1;
+            if (next == 0 || sym == 0 || sym == 256) {
+                mem_free(out);
+                return NULL;
+            }
+            out[n++] = sym;
+            node = depth = 0;
+            ones = 1;
+        }
+    }
+    if (depth > 7 || !ones) {
+        mem_free(out);
+        return NULL;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static char* hpack_string(const unsigned char** p, const unsigned char* end) {
+    if (*p >= end) return NULL;
+    int huffman = **p & 0x80;
+    long len = hpack_int(p, end, 7);
+    if (len < 0 || len > end - *p) return NULL;
+    const unsigned char* s = *p;
+    *p += len;
+    if (huffman) return huffman_decode(s, len);
+    return memchr(s, '\0', len) ? NULL : mem_strndup(MEM_HTTP, (const char*)s, len);
+}
+
+// Turns a request header block into an HTTP/1.1 request head, without the
+// blank line. Returns -1 if the block cannot be decoded, which ends the
+// connection since the tables are then out of step; 1 if the request is
+// malformed; else 0.
+static int hpack_request_head(HpackTable* table, const unsigned char* p, long len, ByteBuffer* head, long* content_length) {
+    const unsigned char* end = p + len;
+    char* pseudo[3] = {NULL, NULL, NULL};
+    static const char* pseudo_names[3] = {":method", ":path", ":authority"};
+    ByteBuffer fields = {0};
+    int malformed = 0, failed = 0;
+    *content_length = -1;
+    while (p < end && !failed) {
+        char* name = NULL;
+        char* value = NULL;
+        const char* entry_name;
+        const char* entry_value;
+        if (*p & 0x80) {
+            long index = hpack_int(&p, end, 7);
+            if (hpack_lookup(table, index, &entry_name, &entry_value) != 0) {
+                failed = 1;
+                break;
+            }
+            name = mem_strdup(MEM_HTTP, entry_name);
+            value = mem_strdup(MEM_HTTP, entry_value);
+        } else if ((*p & 0xe0) == 0x20) {
+            long size = hpack_int(&p, end, 5);
+            if (size < 0 || size > H2_TABLE_SIZE) failed = 1;
+            else hpack_evict(table, table->limit = size);
+            continue;
+        } else {
+            int indexed = (*p & 0x40) != 0;
+            long index = hpack_int(&p, end, indexed ? 6 : 4);
+            if (index > 0 && hpack_lookup(table, index, &entry_name, &entry_value) == 0) name = mem_strdup(MEM_HTTP, entry_name);
+            else if (index == 0) name = hpack_string(&p, end);
+            if (name) value = hpack_string(&p, end);
+            if (!name || !value) {
+                mem_free(name);
+                mem_free(value);
+                failed = 1;
+                break;
+            }
+            if (indexed) hpack_insert(table, name, value);
+        }
+        
+        if (strpbrk(name, "\r\n") || strpbrk(value, "\r\n") || strcmp(name, "connection") == 0) malformed = 1;
+        if (name[0] == ':') {
+            int known = 0;
+            for (int i = 0; i < 3; i++) {
+                if (strcmp(name, pseudo_names[i]) == 0 && !pseudo[i]) {
+                    pseudo[i] = value;
+                    value = NULL;
+                    known = 1;
+                }
+            }
+            if (!known && strcmp(name, ":scheme") != 0) malformed = 1;
+        } else {
+            if (strcmp(name, "content-length") == 0) *content_length = atol(value);
+            if (strcmp(name, "host") != 0 || !pseudo[2]) {
+                byte_buffer_append(&fields, name, strlen(name));
+                byte_buffer_append(&fields, ": ", 2);
+                byte_buffer_append(&fields, value, strlen(value));
+                byte_buffer_append(&fields, "\r\n", 2);
+            }
+        }
+        mem_free(name);
+        mem_free(value);
+    }
+    if (!failed && !malformed && pseudo[0] && pseudo[1]) {
+        byte_buffer_append(head, pseudo[0], strlen(pseudo[0]));
+        byte_buffer_append(head, " ", 1);
+        byte_buffer_append(head, pseudo[1], strlen(pseudo[1]));
+        byte_buffer_append(head, " HTTP/1.1\r\n", 11);
+        if (pseudo[2]) {
+            byte_buffer_append(head, "Host: ", 6);
+            byte_buffer_append(head, pseudo[2], strlen(pseudo[2]));
+            byte_buffer_append(head, "\r\n", 2);
+        }
+        if (fields.len) byte_buffer_append(head, fields.data, fields.len);
+    } else if (!failed) {
+        malformed = 1;
+    }
+    for (int i = 0; i < 3; i++) mem_free(pseudo[i]);
+    mem_free(fields.data);
+    return failed ? -1 : malformed;
+}
+
+// Appends a response field. Values that change with every response are not
+// worth a table entry; everything else is indexed, so repeated headers shrink
+// to a byte or two.
+static void hpack_encode(HpackTable* table, ByteBuffer* out, const char* name, const char* value) {
+    int index = hpack_find(table, name, value);
+    if (index) {
+        hpack_put_int(out, 0x80, 7, index);
+        return;
+    }
+    index = hpack_find(table, name, NULL);
+    int varies = strcmp(name, "content-length") == 0 || strcmp(name, "etag") == 0 || strcmp(name, "content-disposition") == 0;
+    hpack_put_int(out, varies ? 0x00 : 0x40, varies ? 4 : 6, index);
+    if (!index) hpack_put_string(out, name);
+    hpack_put_string(out, value);
+    if (!varies) hpack_insert(table, name, value);
+}
+
+typedef struct H2Stream {
+    uint32_t id;
+    // Our end of the socketpair: the request goes in, the response comes out
+    int fd;
+    // One reference for the connection thread while the request is still
+    // arriving (request_open) and one for the pump until the response is sent
+    int refs;
+    int request_open;
+    int reset;
+    long send_window;
+    // A request body of unknown length is collected and sent with a
+    // Content-Length once the stream ends
+    ByteBuffer head;
+    ByteBuffer body;
+    struct H2Conn* conn;
+    struct H2Stream* next;
+} H2Stream;
+
+typedef struct H2Conn {
+    int socket;
+    // Guards everything below and the order of frames on the socket
+    pthread_mutex_t lock;
+    // Signalled when a window opens, a stream is reset or a stream ends
+    pthread_cond_t cond;
+    H2Stream* streams;
+    int stream_count;
+    uint32_t last_stream;
+    long send_window;
+    long initial_window;
+    int closing;
+    HpackTable decoder;
+    HpackTable encoder;
+    // The peer's header table size, announced at the start of our next block
+    long encoder_limit;
+} H2Conn;
+
+// Caller holds conn->lock
+static int h2_write_frame(H2Conn* conn, int type, int flags, uint32_t stream, const void* payload, long len) {
+    unsigned char frame[9 + H2_FRAME_MAX] = {
+        len >> 16, len >> 8, len, type, flags, (stream >> 24) & 0x7f, stream >> 16, stream >> 8, stream,
+    };
+    if (len) memcpy(frame + 9, payload, len);
+    if (conn->closing || send_all(conn->socket, (const char*)frame, 9 + len) == 0) return 0;
+    // The connection thread sees the socket fail and tears everything down
+    conn->closing = 1;
+    shutdown(conn->socket, SHUT_RDWR);
+    return -1;
 }
 
-void ws_send_frame(int socket, const char* message) {
-    int len = strlen(message);
-    unsigned char frame[BUFFER_SIZE];
-    int idx = 0;
-    
-    frame[idx++] = 0x81;
-    
-    if (len < 126) {
-        frame[idx++] = len;
-    } else if (len < 65536) {
-        frame[idx++] = 126;
-        frame[idx++] = (len >> 8) & 0xFF;
-        frame[idx++] = len & 0xFF;
-    } else {
-        frame[idx++] = 127;
-        for (int i = 7; i >= 0; i--) {
-            frame[idx++] = (len >> (i * 8)) & 0xFF;
-        }
-    }
-    
-    memcpy(&frame[idx], message, len);
-    int result = send(socket, frame, idx + len, MSG_NOSIGNAL);
-    
-    if (result < 0) {
-        printf("Failed to send WebSocket frame: %s\n", strerror(errno));
+// Caller holds conn->lock
+static void h2_write_u32(H2Conn* conn, int type, uint32_t stream, uint32_t value) {
+    unsigned char payload[4] = {value >> 24, value >> 16, value >> 8, value};
+    h2_write_frame(conn, type, 0, stream, payload, 4);
+}
+
+// Caller holds conn->lock. Drops a reference; the last one frees the stream.
+static void h2_stream_release(H2Conn* conn, H2Stream* stream) {
+    if (--stream->refs > 0) return;
+    H2Stream** s = &conn->streams;
+    while (*s != stream) s = &(*s)->next;
+    *s = stream->next;
+    conn->stream_count--;
+    close(stream->fd);
+    mem_free(stream->head.data);
+    mem_free(stream->body.data);
+    mem_free(stream);
+    pthread_cond_broadcast(&conn->cond);
+}
+
+// Caller holds conn->lock. Ends the stream without waiting for either side.
+static void h2_stream_reset(H2Conn* conn, H2Stream* stream) {
+    stream->reset = 1;
+    shutdown(stream->fd, SHUT_RDWR);
+    pthread_cond_broadcast(&conn->cond);
+    if (stream->request_open) {
+        stream->request_open = 0;
+        h2_stream_release(conn, stream);
     }
 }
 
-void broadcast_message(const char* message, int exclude_socket) {
-    pthread_mutex_lock(&clients_mutex);
-    Client* curr = clients;
-    int count = 0;
-    while (curr) {
-        if (curr->socket != exclude_socket && curr->active) {
-            pthread_mutex_lock(&curr->lock);
-            ws_send_frame(curr->socket, message);
-            count++;
-            pthread_mutex_unlock(&curr->lock);
-        }
-        curr = curr->next;
+static H2Stream* h2_stream_find(H2Conn* conn, uint32_t id) {
+    H2Stream* stream = conn->streams;
+    while (stream && stream->id != id) stream = stream->next;
+    return stream;
+}
+
+static int recv_exact(int socket, void* buf, long len) {
+    for (long got = 0; got < len; ) {
+        long n = tls_recv(socket, (char*)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
     }
-    pthread_mutex_unlock(&clients_mutex);
-    printf("Broadcast to %d clients: %.100s\n", count, message);
+    return 0;
 }
 
-void send_response(int socket, const char* status, const char* content_type, const char* body) {
-    char header[BUFFER_SIZE];
-    snprintf(header, sizeof(header),
-        "HTTP/1.1 %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %ld\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-        "Access-Control-Allow-Headers: Content-Type\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        status, content_type, strlen(body));
-    
-    send(socket, header, strlen(header), 0);
-    send(socket, body, strlen(body), 0);
+static void* h2_stream_handler(void* arg) {
+    int socket = *(int*)arg;
+    mem_free(arg);
+    thread_role("http");
+    http_serve_request(socket);
+    http_origins[socket] = 0;
+    close(socket);
+    thread_wait("done");
+    return NULL;
 }
 
-void list_files(int socket) {
-    DIR* dir = opendir("./files");
-    if (!dir) {
-        mkdir("./files", 0755);
-        dir = opendir("./files");
+// Sends the response head as HEADERS (and CONTINUATION) frames. Caller holds
+// conn->lock, which keeps the encoder's table in step with what is sent.
+static void h2_send_head(H2Conn* conn, H2Stream* stream, int status, char* headers, int end_stream) {
+    ByteBuffer block = {0};
+    if (conn->encoder.limit != conn->encoder_limit) {
+        hpack_evict(&conn->encoder, conn->encoder.limit = conn->encoder_limit);
+        hpack_put_int(&block, 0x20, 5, conn->encoder_limit);
     }
-    
-    char json[BUFFER_SIZE] = "[";
-    struct dirent* entry;
-    int first = 1;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            if (!first) strcat(json, ",");
-            strcat(json, "\"");
-            strcat(json, entry->d_name);
-            strcat(json, "\"");
-            first = 0;
+    char status_text[16];
+    snprintf(status_text, sizeof(status_text), "%d", status);
+    hpack_encode(&conn->encoder, &block, ":status", status_text);
+    for (char* line = headers; line && *line; ) {
+        char* next = strstr(line, "\r\n");
+        if (next) *next = '\0';
+        char* colon = strchr(line, ':');
+        if (colon) {
+            *colon = '\0';
+            char* value = colon + 1;
+            while (*value == ' ') value++;
+            for (char* c = line; *c; c++) *c = tolower((unsigned char)*c);
+            if (strcmp(line, "connection") != 0 && strcmp(line, "keep-alive") != 0 && strcmp(line, "transfer-encoding") != 0) {
+                hpack_encode(&conn->encoder, &block, line, value);
+            }
         }
+        line = next ? next + 2 : NULL;
     }
-    strcat(json, "]");
-    closedir(dir);
-    
-    send_response(socket, "200 OK", "application/json", json);
+    long offset = 0;
+    do {
+        long chunk = block.len - offset > H2_FRAME_MAX ? H2_FRAME_MAX : block.len - offset;
+        int last = offset + chunk == block.len;
+        h2_write_frame(conn, offset ? H2_CONTINUATION : H2_HEADERS, (last ? H2_END_HEADERS : 0) | (!offset && end_stream ? H2_END_STREAM : 0),
+            stream->id, block.data + offset, chunk);
+        offset += chunk;
+    } while (offset < block.len);
+    mem_free(block.data);
 }
 
-void read_file(int socket, const char* filename) {
-    char path[512];
-    snprintf(path, sizeof(path), "./files/%s", filename);
-    
-    FILE* fp = fopen(path, "r");
-    if (!fp) {
-        send_response(socket, "404 Not Found", "application/json", "{\"content\":\"\"}");
-        return;
+// Relays the handler's HTTP/1.1 response on the stream: the head as HEADERS,
+// the body as DATA frames as far as the windows allow
+static void* h2_stream_pump(void* arg) {
+    H2Stream* stream = arg;
+    H2Conn* conn = stream->conn;
+    thread_role("http");
+    char* buffer = mem_alloc(MEM_HTTP, BUFFER_SIZE + 1);
+    buffer[0] = '\0';
+    long used = 0;
+    char* head_end = NULL;
+    int status = 0;
+    // 1xx interim responses (100 Continue) are dropped
+    while (status < 200) {
+        while (!(head_end = strstr(buffer, "\r\n\r\n"))) {
+            thread_wait("recv");
+            long n = used < BUFFER_SIZE ? recv(stream->fd, buffer + used, BUFFER_SIZE - used, 0) : -1;
+            if (n <= 0) break;
+            used += n;
+            buffer[used] = '\0';
+        }
+        if (!head_end) break;
+        status = atoi(buffer + 9);
+        if (status < 200) {
+            used -= head_end + 4 - buffer;
+            memmove(buffer, head_end + 4, used + 1);
+        }
     }
+    thread_state("send");
     
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    char* content = malloc(size + 1);
-    fread(content, 1, size, fp);
-    content[size] = '\0';
-    fclose(fp);
+    pthread_mutex_lock(&conn->lock);
+    if (!head_end || status < 200) {
+        if (!stream->reset) h2_write_u32(conn, H2_RST_STREAM, stream->id, H2_INTERNAL_ERROR);
+        h2_stream_release(conn, stream);
+        pthread_mutex_unlock(&conn->lock);
+        mem_free(buffer);
+        return NULL;
+    }
+    char length_text[32];
+    long remaining = -1;
+    head_end[2] = '\0';
+    if (header_value(buffer, "Content-Length", length_text, sizeof(length_text)) == 0) remaining = atol(length_text);
+    char* headers = strstr(buffer, "\r\n");
+    if (!stream->reset) h2_send_head(conn, stream, status, headers ? headers + 2 : NULL, remaining == 0);
+    pthread_mutex_unlock(&conn->lock);
     
-    char* escaped = malloc(size * 2 + 1024);
-    char* p = escaped + sprintf(escaped, "{\"content\":\"");
-    for (char* c = content; *c; c++) {
-        if (*c == '"' || *c == '\\') *p++ = '\\';
-        if (*c == '\n') { *p++ = '\\'; *p++ = 'n'; continue; }
-        if (*c == '\r') { *p++ = '\\'; *p++ = 'r'; continue; }
-        if (*c == '\t') { *p++ = '\\'; *p++ = 't'; continue; }
-        *p++ = *c;
+    // What came in with the head is the start of the body
+    char* data = head_end + 4;
+    long pending = used - (data - buffer);
+    while (remaining != 0 && !stream->reset) {
+        if (pending == 0) {
+            thread_wait("recv");
+            long want = remaining > 0 && remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
+            pending = recv(stream->fd, buffer, want, 0);
+            thread_state("send");
+            data = buffer;
+            if (pending <= 0) break;
+        }
+        pthread_mutex_lock(&conn->lock);
+        while (!stream->reset && !conn->closing && (conn->send_window <= 0 || stream->send_window <= 0)) {
+            thread_wait("window");
+            pthread_cond_wait(&conn->cond, &conn->lock);
+            thread_state("send");
+        }
+        long chunk = pending;
+        if (chunk > H2_FRAME_MAX) chunk = H2_FRAME_MAX;
+        if (chunk > conn->send_window) chunk = conn->send_window;
+        if (chunk > stream->send_window) chunk = stream->send_window;
+        if (!stream->reset && !conn->closing) {
+            conn->send_window -= chunk;
+            stream->send_window -= chunk;
+            if (remaining > 0) remaining -= chunk;
+            h2_write_frame(conn, H2_DATA, remaining == 0 ? H2_END_STREAM : 0, stream->id, data, chunk);
+        }
+        pthread_mutex_unlock(&conn->lock);
+        data += chunk;
+        pending -= chunk;
     }
-    strcpy(p, "\"}");
     
-    send_response(socket, "200 OK", "application/json", escaped);
-    free(content);
-    free(escaped);
+    pthread_mutex_lock(&conn->lock);
+    // A body without a length ends when the handler closes its end
+    if (!stream->reset && remaining < 0) h2_write_frame(conn, H2_DATA, H2_END_STREAM, stream->id, NULL, 0);
+    else if (!stream->reset && remaining > 0) h2_write_u32(conn, H2_RST_STREAM, stream->id, H2_INTERNAL_ERROR);
+    h2_stream_release(conn, stream);
+    pthread_mutex_unlock(&conn->lock);
+    mem_free(buffer);
+    return NULL;
 }
 
-void write_file(int socket, const char* body) {
-    char filename[256] = {0};
-    char* content_start = strstr(body, "\"content\":\"");
-    char* filename_start = strstr(body, "\"filename\":\"");
-    
-    if (!filename_start || !content_start) {
-        send_response(socket, "400 Bad Request", "application/json", "{\"error\":\"Invalid request\"}");
-        return;
+// Called by the connection thread once the whole request has arrived
+static void h2_request_end(H2Conn* conn, H2Stream* stream) {
+    if (stream->head.data) {
+        char length[48];
+        int n = snprintf(length, sizeof(length), "Content-Length: %ld\r\n\r\n", stream->body.len);
+        byte_buffer_append(&stream->head, length, n);
+        if (send_all(stream->fd, (const char*)stream->head.data, stream->head.len) == 0 && stream->body.len) {
+            send_all(stream->fd, (const char*)stream->body.data, stream->body.len);
+        }
     }
+    // A handler expecting more body than came sees it end here
+    shutdown(stream->fd, SHUT_WR);
+    pthread_mutex_lock(&conn->lock);
+    if (stream->request_open) {
+        stream->request_open = 0;
+        h2_stream_release(conn, stream);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Starts serving a new stream whose request head is in head. Returns an error
+// code to reset the stream with, or 0.
+static int h2_stream_open(H2Conn* conn, uint32_t id, ByteBuffer* head, long content_length, int end_stream) {
+    int pair[2];
+    if (conn->stream_count >= H2_MAX_STREAMS) return H2_REFUSED_STREAM;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) return H2_REFUSED_STREAM;
+    if (pair[1] >= TLS_MAX_FDS) {
+        close(pair[0]);
+        close(pair[1]);
+        return H2_REFUSED_STREAM;
+    }
+    H2Stream* stream = mem_calloc(MEM_CONNECTIONS, 1, sizeof(H2Stream));
+    stream->id = id;
+    stream->fd = pair[0];
+    stream->conn = conn;
+    stream->refs = 2;
+    stream->request_open = 1;
     
-    filename_start += 12;
-    char* filename_end = strchr(filename_start, '"');
-    strncpy(filename, filename_start, filename_end - filename_start);
-    
-    content_start += 11;
-    char* content_end = strstr(content_start, "\"}");
-    
-    char path[512];
-    snprintf(path, sizeof(path), "./files/%s", filename);
+    pthread_mutex_lock(&conn->lock);
+    stream->send_window = conn->initial_window;
+    stream->next = conn->streams;
+    conn->streams = stream;
+    conn->stream_count++;
+    pthread_mutex_unlock(&conn->lock);
     
-    FILE* fp = fopen(path, "w");
-    if (!fp) {
-        send_response(socket, "500 Internal Server Error", "application/json", "{\"error\":\"Could not write file\"}");
-        return;
-    }
+    http_origins[pair[1]] = conn->socket + 1;
+    int* handler_socket = mem_alloc(MEM_HTTP, sizeof(int));
+    *handler_socket = pair[1];
+    pthread_t thread;
+    pthread_create(&thread, NULL, h2_stream_handler, handler_socket);
+    pthread_detach(thread);
+    pthread_create(&thread, NULL, h2_stream_pump, stream);
+    pthread_detach(thread);
     
-    for (char* p = content_start; p < content_end; p++) {
-        if (*p == '\\' && *(p+1) == 'n') { fputc('\n', fp); p++; }
-        else if (*p == '\\' && *(p+1) == 'r') { fputc('\r', fp); p++; }
-        else if (*p == '\\' && *(p+1) == 't') { fputc('\t', fp); p++; }
-        else if (*p == '\\' && (*(p+1) == '"' || *(p+1) == '\\')) { fputc(*(++p), fp); }
-        else fputc(*p, fp);
+    if (content_length < 0 && !end_stream) {
+        stream->head = *head;
+        *head = (ByteBuffer){0};
+        return 0;
     }
-    
-    fclose(fp);
-    send_response(socket, "200 OK", "application/json", "{\"success\":true}");
+    byte_buffer_append(head, "\r\n", 2);
+    send_all(stream->fd, (const char*)head->data, head->len);
+    if (end_stream) h2_request_end(conn, stream);
+    return 0;
 }
 
-void delete_file_handler(int socket, const char* filename) {
-    char path[512];
-    snprintf(path, sizeof(path), "./files/%s", filename);
-    
-    if (remove(path) == 0) {
-        send_response(socket, "200 OK", "application/json", "{\"success\":true}");
+// A complete header block: a new request, or trailers, which are dropped
+static int h2_headers(H2Conn* conn, uint32_t id, int flags, ByteBuffer* block) {
+    ByteBuffer head = {0};
+    long content_length;
+    int rc = hpack_request_head(&conn->decoder, block->data, block->len, &head, &content_length);
+    block->len = 0;
+    int error = 0;
+    if (rc < 0) {
+        error = H2_COMPRESSION_ERROR;
+    } else if (id <= conn->last_stream) {
+        pthread_mutex_lock(&conn->lock);
+        H2Stream* stream = h2_stream_find(conn, id);
+        int open = stream && stream->request_open;
+        pthread_mutex_unlock(&conn->lock);
+        if (open && (flags & H2_END_STREAM)) h2_request_end(conn, stream);
     } else {
-        send_response(socket, "404 Not Found", "application/json", "{\"error\":\"File not found\"}");
+        conn->last_stream = id;
+        int reset = rc > 0 ? H2_PROTOCOL_ERROR : h2_stream_open(conn, id, &head, content_length, flags & H2_END_STREAM);
+        if (reset) {
+            pthread_mutex_lock(&conn->lock);
+            h2_write_u32(conn, H2_RST_STREAM, id, reset);
+            pthread_mutex_unlock(&conn->lock);
+        }
     }
+    mem_free(head.data);
+    return error;
 }
 
-void base64_encode(const unsigned char* input, int length, char* output) {
-    const char* b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    int i = 0, j = 0;
-    
-    for (i = 0; i < length - 2; i += 3) {
-        output[j++] = b64[(input[i] >> 2) & 0x3F];
-        output[j++] = b64[((input[i] & 0x3) << 4) | ((input[i+1] & 0xF0) >> 4)];
-        output[j++] = b64[((input[i+1] & 0xF) << 2) | ((input[i+2] & 0xC0) >> 6)];
-        output[j++] = b64[input[i+2] & 0x3F];
-    }
-    
-    if (i < length) {
-        output[j++] = b64[(input[i] >> 2) & 0x3F];
-        if (i == length - 1) {
-            output[j++] = b64[((input[i] & 0x3) << 4)];
-            output[j++] = '=';
-        } else {
-            output[j++] = b64[((input[i] & 0x3) << 4) | ((input[i+1] & 0xF0) >> 4)];
-            output[j++] = b64[((input[i+1] & 0xF) << 2)];
+static int h2_settings(H2Conn* conn, int flags, const unsigned char* p, long len) {
+    if (flags & H2_ACK) return len ? H2_FRAME_SIZE_ERROR : 0;
+    if (len % 6) return H2_FRAME_SIZE_ERROR;
+    pthread_mutex_lock(&conn->lock);
+    int error = 0;
+    for (long i = 0; i < len && !error; i += 6) {
+        int id = p[i] << 8 | p[i + 1];
+        uint32_t value = (uint32_t)p[i + 2] << 24 | p[i + 3] << 16 | p[i + 4] << 8 | p[i + 5];
+        if (id == 1) {
+            conn->encoder_limit = value < H2_TABLE_SIZE ? value : H2_TABLE_SIZE;
+        } else if (id == 4 && value > H2_WINDOW_MAX) {
+            error = H2_FLOW_CONTROL_ERROR;
+        } else if (id == 4) {
+            for (H2Stream* s = conn->streams; s; s = s->next) s->send_window += (long)value - conn->initial_window;
+            conn->initial_window = value;
+        } else if (id == 5 && (value < H2_FRAME_MAX || value > 0xffffff)) {
+            error = H2_PROTOCOL_ERROR;
         }
-        output[j++] = '=';
     }
-    output[j] = '\0';
+    if (!error) h2_write_frame(conn, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+    return error;
 }
 
-char* ws_handshake(const char* key) {
-    char combined[256];
-    snprintf(combined, sizeof(combined), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
-    
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char*)combined, strlen(combined), hash);
-    
-    char base64[64];
-    base64_encode(hash, SHA_DIGEST_LENGTH, base64);
-    
-    char* response = malloc(512);
-    snprintf(response, 512,
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n\r\n", base64);
-    
-    return response;
+static int h2_window_update(H2Conn* conn, uint32_t id, const unsigned char* p, long len) {
+    if (len != 4) return H2_FRAME_SIZE_ERROR;
+    long increment = ((uint32_t)p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    int error = 0;
+    pthread_mutex_lock(&conn->lock);
+    H2Stream* stream = id ? h2_stream_find(conn, id) : NULL;
+    long* window = id ? (stream ? &stream->send_window : NULL) : &conn->send_window;
+    if (window && (increment == 0 || *window + increment > H2_WINDOW_MAX)) {
+        int code = increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR;
+        if (!id) error = code;
+        else {
+            h2_write_u32(conn, H2_RST_STREAM, id, code);
+            h2_stream_reset(conn, stream);
+        }
+    } else if (window) {
+        *window += increment;
+        pthread_cond_broadcast(&conn->cond);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return error;
 }
 
-char* ws_read_frame(unsigned char* buffer, int bytes, int* out_len) {
-    if (bytes < 2) return NULL;
-    
-    int opcode = buffer[0] & 0x0F;
-    if (opcode == 0x8) return NULL;
-    
-    int masked = buffer[1] & 0x80;
-    int len = buffer[1] & 0x7F;
-    int idx = 2;
+static int h2_data(H2Conn* conn, uint32_t id, int flags, const unsigned char* p, long len) {
+    long frame_len = len, pad = 0;
+    if (flags & H2_PADDED) {
+        if (len < 1 || p[0] >= len) return H2_PROTOCOL_ERROR;
+        pad = p[0];
+        p++;
+        len -= 1 + pad;
+    }
+    pthread_mutex_lock(&conn->lock);
+    H2Stream* stream = id ? h2_stream_find(conn, id) : NULL;
+    if (stream && !stream->request_open) stream = NULL;
+    pthread_mutex_unlock(&conn->lock);
+    if (!id || id > conn->last_stream) return H2_PROTOCOL_ERROR;
     
-    if (len == 126) {
-        if (bytes < 4) return NULL;
-        len = (buffer[2] << 8) | buffer[3];
-        idx = 4;
-    } else if (len == 127) {
-        if (bytes < 10) return NULL;
-        len = 0;
-        for (int i = 0; i < 8; i++) {
-            len = (len << 8) | buffer[2 + i];
+    // The connection thread's reference keeps an open stream alive
+    if (stream && stream->head.data) {
+        if (stream->head.len + stream->body.len + len > MAX_REQUEST_SIZE) {
+            pthread_mutex_lock(&conn->lock);
+            h2_write_u32(conn, H2_RST_STREAM, id, H2_CANCEL);
+            h2_stream_reset(conn, stream);
+            pthread_mutex_unlock(&conn->lock);
+            stream = NULL;
+        } else {
+            byte_buffer_append(&stream->body, p, len);
         }
-        idx = 10;
+    } else if (stream && len) {
+        thread_wait("forward");
+        send_all(stream->fd, (const char*)p, len);
+        thread_state("handle");
     }
     
-    unsigned char mask[4];
-    if (masked) {
-        if (bytes < idx + 4) return NULL;
-        memcpy(mask, &buffer[idx], 4);
-        idx += 4;
+    pthread_mutex_lock(&conn->lock);
+    if (frame_len) {
+        h2_write_u32(conn, H2_WINDOW_UPDATE, 0, frame_len);
+        if (stream && !(flags & H2_END_STREAM)) h2_write_u32(conn, H2_WINDOW_UPDATE, id, frame_len);
     }
-    
-    if (bytes < idx + len) return NULL;
-    
-    char* message = malloc(len + 1);
-    for (int i = 0; i < len; i++) {
-        message[i] = masked ? (buffer[idx + i] ^ mask[i % 4]) : buffer[idx + i];
+    pthread_mutex_unlock(&conn->lock);
+    if (stream && (flags & H2_END_STREAM)) h2_request_end(conn, stream);
+    return 0;
+}
+
+// Whether the client on socket speaks HTTP/2: chosen with ALPN over TLS, or
+// announced by the connection preface in cleartext
+static int h2_requested(int socket) {
+    TlsConn* conn = socket < TLS_MAX_FDS ? tls_conns[socket] : NULL;
+    if (conn) {
+        const unsigned char* protocol;
+        unsigned int len;
+        SSL_get0_alpn_selected(conn->ssl, &protocol, &len);
+        return len == 2 && memcmp(protocol, "h2", 2) == 0;
     }
-    message[len] = '\0';
-    *out_len = len;
-    
-    return message;
+    char peek[3];
+    return recv(socket, peek, 3, MSG_PEEK | MSG_WAITALL) == 3 && memcmp(peek, "PRI", 3) == 0;
 }
 
-void* handle_websocket(void* arg) {
-    Client* client = (Client*)arg;
-    int socket = client->socket;
-    
-    printf("WebSocket client connected: %s\n", client->username);
-    
-    char init_msg[256];
-    snprintf(init_msg, sizeof(init_msg), "{\"type\":\"init\",\"color\":\"%s\"}", client->color);
-    ws_send_frame(socket, init_msg);
+static void h2_serve(int socket) {
+    char preface[24];
+    if (recv_exact(socket, preface, 24) != 0 || memcmp(preface, H2_PREFACE, 24) != 0) return;
+    H2Conn* conn = mem_calloc(MEM_CONNECTIONS, 1, sizeof(H2Conn));
+    conn->socket = socket;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->cond, NULL);
+    conn->send_window = conn->initial_window = H2_DEFAULT_WINDOW;
+    conn->decoder.limit = conn->encoder.limit = conn->encoder_limit = H2_TABLE_SIZE;
     
-    char join_msg[512];
-    snprintf(join_msg, sizeof(join_msg), "{\"type\":\"user_joined\",\"username\":\"%s\"}", client->username);
-    broadcast_message(join_msg, socket);
+    pthread_mutex_lock(&conn->lock);
+    unsigned char settings[6] = {0, 3, 0, 0, 0, H2_MAX_STREAMS};
+    h2_write_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    h2_write_u32(conn, H2_WINDOW_UPDATE, 0, H2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+    pthread_mutex_unlock(&conn->lock);
     
-    pthread_mutex_lock(&clients_mutex);
-    char users_msg[BUFFER_SIZE] = "{\"type\":\"users_list\",\"users\":[";
-    Client* curr = clients;
-    int first = 1;
-    while (curr) {
-        if (curr->active) {
-            if (!first) strcat(users_msg, ",");
-            char user_data[512];
-            snprintf(user_data, sizeof(user_data), 
-                "{\"username\":\"%s\",\"color\":\"%s\",\"file\":\"%s\",\"cursor_pos\":%d}",
-                curr->username, curr->color, curr->current_file, curr->cursor_pos);
-            strcat(users_msg, user_data);
-            first = 0;
+    unsigned char header[9];
+    unsigned char* payload = mem_alloc(MEM_HTTP, H2_FRAME_MAX);
+    ByteBuffer block = {0};
+    uint32_t block_stream = 0;
+    int block_flags = 0;
+    int error = 0;
+    while (!error) {
+        thread_wait("read");
+        if (recv_exact(socket, header, 9) != 0) break;
+        long len = header[0] << 16 | header[1] << 8 | header[2];
+        int type = header[3], flags = header[4];
+        uint32_t id = ((uint32_t)header[5] & 0x7f) << 24 | header[6] << 16 | header[7] << 8 | header[8];
+        if (len > H2_FRAME_MAX) {
+            error = H2_FRAME_SIZE_ERROR;
+            break;
         }
-        curr = curr->next;
-    }
-    strcat(users_msg, "]}");
-    pthread_mutex_unlock(&clients_mutex);
-    
-    ws_send_frame(socket, users_msg);
-    
-    unsigned char buffer[BUFFER_SIZE];
-    while (1) {
-        int bytes = recv(socket, buffer, sizeof(buffer), 0);
-        if (bytes <= 0) {
-            printf("Client disconnected: %s\n", client->username);
+        if (recv_exact(socket, payload, len) != 0) break;
+        thread_state("handle");
+        if (block_stream && (type != H2_CONTINUATION || id != block_stream)) {
+            error = H2_PROTOCOL_ERROR;
             break;
         }
         
-        int msg_len;
-        char* message = ws_read_frame(buffer, bytes, &msg_len);
-        if (!message) continue;
-        
-        if (strstr(message, "\"type\":\"join\"")) {
-            char* name = strstr(message, "\"username\":\"");
-            if (name) {
-                name += 12;
-                char* end = strchr(name, '"');
-                if (end) {
-                    pthread_mutex_lock(&client->lock);
-                    strncpy(client->username, name, end - name);
-                    client->username[end - name] = '\0';
-                    pthread_mutex_unlock(&client->lock);
-                }
+        if (type == H2_HEADERS || type == H2_CONTINUATION) {
+            long offset = 0, pad = 0;
+            if (type == H2_HEADERS) {
+                if (!id || !(id & 1)) error = H2_PROTOCOL_ERROR;
+                if ((flags & H2_PADDED) && len > 0) pad = payload[offset++];
+                else if (flags & H2_PADDED) error = H2_PROTOCOL_ERROR;
+                if (flags & H2_PRIORITY_FLAG) offset += 5;
+                if (offset + pad > len) error = H2_PROTOCOL_ERROR;
+                block_stream = id;
+                block_flags = flags;
+            } else if (!block_stream) {
+                error = H2_PROTOCOL_ERROR;
+            }
+            if (error) break;
+            if (block.len + len > MAX_REQUEST_SIZE / 16) {
+                error = H2_PROTOCOL_ERROR;
+                break;
+            }
+            byte_buffer_append(&block, payload + offset, len - offset - pad);
+            if (flags & H2_END_HEADERS) {
+                error = h2_headers(conn, block_stream, block_flags, &block);
+                block_stream = 0;
+            }
+        } else if (type == H2_DATA) {
+            error = h2_data(conn, id, flags, payload, len);
+        } else if (type == H2_SETTINGS) {
+            error = id ? H2_PROTOCOL_ERROR : h2_settings(conn, flags, payload, len);
+        } else if (type == H2_WINDOW_UPDATE) {
+            error = h2_window_update(conn, id, payload, len);
+        } else if (type == H2_PING) {
+            if (len != 8) error = H2_FRAME_SIZE_ERROR;
+            else if (!(flags & H2_ACK)) {
+                pthread_mutex_lock(&conn->lock);
+                h2_write_frame(conn, H2_PING, H2_ACK, 0, payload, 8);
+                pthread_mutex_unlock(&conn->lock);
             }
+        } else if (type == H2_RST_STREAM) {
+            if (len != 4) error = H2_FRAME_SIZE_ERROR;
+            pthread_mutex_lock(&conn->lock);
+            H2Stream* stream = h2_stream_find(conn, id);
+            if (stream && !error) h2_stream_reset(conn, stream);
+            pthread_mutex_unlock(&conn->lock);
+        } else if (type == H2_PUSH_PROMISE) {
+            error = H2_PROTOCOL_ERROR;
         }
-        else if (strstr(message, "\"type\":\"content_change\"")) {
-            char forward_msg[BUFFER_SIZE];
-            char* username = strstr(message, "\"username\":\"");
-            char* file = strstr(message, "\"file\":\"");
-            char* content = strstr(message, "\"content\":\"");
-            
-            if (username && file && content) {
-                username += 12;
-                char* uend = strchr(username, '"');
-                
-                file += 8;
-                char* fend = strchr(file, '"');
-                
-                char uname[64], fname[256];
-                strncpy(uname, username, uend - username);
-                uname[uend - username] = '\0';
-                strncpy(fname, file, fend - file);
-                fname[fend - file] = '\0';
-                
-                content += 11;
-                char* cend = strstr(content, "\",\"");
-                if (!cend) cend = strstr(content, "\"}");
-                
-                snprintf(forward_msg, sizeof(forward_msg), 
-                    "{\"type\":\"content_update\",\"username\":\"%s\",\"file\":\"%s\",\"content\":\"", 
-                    uname, fname);
-                strncat(forward_msg, content, cend - content);
-                strcat(forward_msg, "\"}");
-                
-                broadcast_message(forward_msg, socket);
-            }
-        }
-        else if (strstr(message, "\"type\":\"cursor_move\"")) {
-            char* pos = strstr(message, "\"position\":");
-            char* file = strstr(message, "\"file\":\"");
-            char* username = strstr(message, "\"username\":\"");
-            
-            if (pos && file && username) {
-                pos += 11;
-                int position = atoi(pos);
-                
-                pthread_mutex_lock(&client->lock);
-                client->cursor_pos = position;
-                
-                file += 8;
-                char* fend = strchr(file, '"');
-                strncpy(client->current_file, file, fend - file);
-                client->current_file[fend - file] = '\0';
-                
-                username += 12;
-                char* uend = strchr(username, '"');
-                strncpy(client->username, username, uend - username);
-                client->username[uend - username] = '\0';
-                pthread_mutex_unlock(&client->lock);
-                
-                char cursor_msg[512];
-                snprintf(cursor_msg, sizeof(cursor_msg),
-                    "{\"type\":\"cursor_update\",\"username\":\"%s\",\"position\":%d,\"color\":\"%s\",\"file\":\"%s\"}",
-                    client->username, position, client->color, client->current_file);
-                broadcast_message(cursor_msg, socket);
-            }
-        }
-        else if (strstr(message, "\"type\":\"file_change\"")) {
-            char* file = strstr(message, "\"file\":\"");
-            if (file) {
-                file += 8;
-                char* fend = strchr(file, '"');
-                pthread_mutex_lock(&client->lock);
-                strncpy(client->current_file, file, fend - file);
-                client->current_file[fend - file] = '\0';
-                pthread_mutex_unlock(&client->lock);
-            }
-        }
-        
-        free(message);
+        // PRIORITY, GOAWAY and unknown frames need nothing; after a GOAWAY the
+        // peer closes the connection once its streams are done
     }
     
-    char leave_msg[512];
-    snprintf(leave_msg, sizeof(leave_msg), "{\"type\":\"user_left\",\"username\":\"%s\"}", client->username);
-    broadcast_message(leave_msg, socket);
+    pthread_mutex_lock(&conn->lock);
+    if (error) {
+        printf("HTTP/2 connection error %d after stream %u\n", error, conn->last_stream);
+        unsigned char goaway[8] = {conn->last_stream >> 24, conn->last_stream >> 16, conn->last_stream >> 8, conn->last_stream, 0, 0, 0, error};
+        h2_write_frame(conn, H2_GOAWAY, 0, 0, goaway, sizeof(goaway));
+    }
+    conn->closing = 1;
+    for (H2Stream* stream = conn->streams; stream; ) {
+        H2Stream* next = stream->next;
+        h2_stream_reset(conn, stream);
+        stream = next;
+    }
+    thread_wait("done");
+    while (conn->stream_count) pthread_cond_wait(&conn->cond, &conn->lock);
+    pthread_mutex_unlock(&conn->lock);
     
-    remove_client(socket);
-    return NULL;
+    hpack_evict(&conn->decoder, 0);
+    hpack_evict(&conn->encoder, 0);
+    mem_free(block.data);
+    mem_free(payload);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+    mem_free(conn);
 }
 
-void send_html(int socket);
-
 void* handle_http_client(void* arg) {
     int socket = *(int*)arg;
-    free(arg);
-    
-    char buffer[BUFFER_SIZE];
-    int bytes = recv(socket, buffer, sizeof(buffer) - 1, 0);
-    if (bytes <= 0) {
+    mem_free(arg);
+    thread_role("http");
+    thread_wait("read");
+    if (tls_accept(tls_ctx, socket, 1) != 0) {
         close(socket);
         return NULL;
     }
-    buffer[bytes] = '\0';
-    
-    char method[16], path[512];
-    sscanf(buffer, "%s %s", method, path);
-    
-    if (strcmp(method, "OPTIONS") == 0) {
-        send_response(socket, "200 OK", "text/plain", "");
-    }
-    else if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
-        send_html(socket);
-    }
-    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/files", 10) == 0) {
-        list_files(socket);
-    }
-    else if (strcmp(method, "GET") == 0 && strncmp(path, "/api/file?name=", 15) == 0) {
-        char filename[256];
-        sscanf(path + 15, "%[^&]", filename);
-        char* p = filename;
-        while (*p) {
-            if (*p == '+') *p = ' ';
-            if (*p == '%' && *(p+1) && *(p+2)) {
-                char hex[3] = {*(p+1), *(p+2), 0};
-                *p = (char)strtol(hex, NULL, 16);
-                memmove(p+1, p+3, strlen(p+3)+1);
-            }
-            p++;
-        }
-        read_file(socket, filename);
-    }
-    else if (strcmp(method, "POST") == 0 && strncmp(path, "/api/file", 9) == 0) {
-        char* body = strstr(buffer, "\r\n\r\n");
-        if (body) write_file(socket, body + 4);
-    }
-    else if (strcmp(method, "DELETE") == 0 && strncmp(path, "/api/file?name=", 15) == 0) {
-        char filename[256];
-        sscanf(path + 15, "%[^&]", filename);
-        char* p = filename;
-        while (*p) {
-            if (*p == '+') *p = ' ';
-            if (*p == '%' && *(p+1) && *(p+2)) {
-                char hex[3] = {*(p+1), *(p+2), 0};
-                *p = (char)strtol(hex, NULL, 16);
-                memmove(p+1, p+3, strlen(p+3)+1);
-            }
-            p++;
-        }
-        delete_file_handler(socket, filename);
-    }
-    else {
-        send_response(socket, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");
-    }
-    
-    close(socket);
+    if (h2_requested(socket)) h2_serve(socket);
+    else http_serve_request(socket);
+    tls_close(socket);
+    thread_wait("done");
     return NULL;
 }
 
@@ -551,41 +8065,79 @@ void* websocket_server(void* arg) {
     
     listen(server_fd, 10);
     printf("WebSocket server running on port %d\n", WS_PORT);
+    thread_role("ws-accept");
+    unsigned long connection_count = 0;
     
     while (1) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
+        thread_wait("accept");
         int client_socket = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
         
         if (client_socket < 0) continue;
+        thread_state("handshake");
+        if (tls_accept(tls_ctx, client_socket, 0) != 0) {
+            close(client_socket);
+            continue;
+        }
         
         char buffer[BUFFER_SIZE];
-        int bytes = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+        int bytes = tls_recv(client_socket, buffer, sizeof(buffer) - 1);
         if (bytes <= 0) {
-            close(client_socket);
+            tls_close(client_socket);
             continue;
         }
         buffer[bytes] = '\0';
         
-        char* key = strstr(buffer, "Sec-WebSocket-Key: ");
+        char* key = strcasestr(buffer, "Sec-WebSocket-Key: ");
         if (!key) {
-            close(client_socket);
+            tls_close(client_socket);
             continue;
         }
         
         key += 19;
         char ws_key[64];
-        sscanf(key, "%[^\r\n]", ws_key);
+        sscanf(key, "%63[^\r\n]", ws_key);
+        
+        char url[1024] = "", token[512], user[64] = "";
+        sscanf(buffer, "%*s %1023s", url);
+        Tenant* tenant = request_tenant(buffer, url);
+        const char* denied = NULL;
+        if (auth_enabled && (request_token(buffer, url, token, sizeof(token)) != 0 ||
+                             auth_verify_token(token, user, sizeof(user)) != 0)) {
+            denied = "401 Unauthorized";
+        } else if (!tenant) {
+            denied = "404 Not Found";
+        } else if (!tenant_admits(tenant, user)) {
+            denied = "403 Forbidden";
+        } else if (tenant_connect(tenant) != 0) {
+            printf("Workspace %s is at its connection limit\n", tenant->name);
+            denied = "503 Service Unavailable";
+        }
+        if (denied) {
+            char reply[128];
+            snprintf(reply, sizeof(reply), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", denied);
+            tls_send(client_socket, reply, strlen(reply), MSG_NOSIGNAL);
+            tls_close(client_socket);
+            continue;
+        }
         
         char* response = ws_handshake(ws_key);
-        send(client_socket, response, strlen(response), 0);
-        free(response);
+        send_all(client_socket, response, strlen(response));
+        mem_free(response);
         
-        Client* client = malloc(sizeof(Client));
+        Client* client = mem_calloc(MEM_CONNECTIONS, 1, sizeof(Client));
         client->socket = client_socket;
-        sprintf(client->username, "User%d", rand() % 10000);
+        client->connected_ms = client->last_active_ms = now_ms();
+        client->tenant = tenant;
+        if (user[0]) strcpy(client->username, user);
+        else sprintf(client->username, "User%d", rand() % 10000);
+        if (auth_enabled && user[0]) snprintf(client->undo_key, sizeof(client->undo_key), "%s", user);
+        else snprintf(client->undo_key, sizeof(client->undo_key), "#%lu", ++connection_count);
         client->current_file[0] = '\0';
         client->cursor_pos = 0;
+        client->perms = acl_perms(client->username, "");
+        client->perms_file[0] = '\0';
         
         add_client(client);
         
@@ -599,38 +8151,114 @@ void* websocket_server(void* arg) {
 }
 
 void send_html(int socket) {
-    FILE *f = fopen("editor.html", "r");
-    if (f) {
-        fseek(f, 0, SEEK_END);
-        long size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        char *html = malloc(size + 1);
-        fread(html, 1, size, f);
-        html[size] = '\0';
-        fclose(f);
-        send_response(socket, "200 OK", "text/html", html);
-        free(html);
+    int fd = open("editor.html", O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        char header[BUFFER_SIZE];
+        format_response_header(header, sizeof(header), "200 OK", "text/html", "", st.st_size);
+        if (send_all(socket, header, strlen(header)) == 0) send_file(socket, fd, st.st_size);
+        close(fd);
         return;
     }
+    if (fd >= 0) close(fd);
     
     const char* html = "<!DOCTYPE html><html><head><title>Collaborative Editor</title></head><body><h1>Real-time Collaborative Text Editor</h1><p>WebSocket collaboration enabled!</p></body></html>";
     send_response(socket, "200 OK", "text/html", html);
 }
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc == 4 && strcmp(argv[1], "--add-user") == 0) {
+        return auth_add_user(argv[2], argv[3]) == 0 ? 0 : 1;
+    }
+    const char* tls_cert = NULL;
+    const char* tls_key = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "kv") == 0) {
+                storage_backend = &kv_storage;
+            } else if (strcmp(name, "fs") != 0) {
+                printf("Unknown storage backend %s (expected fs or kv)\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--read-flight") == 0 && i + 1 < argc) {
+            return flight_read(argv[i + 1]);
+        } else if (strcmp(argv[i], "--mem-accounting") == 0) {
+            mem_accounting = 1;
+        } else if (strcmp(argv[i], "--room-budget") == 0 && i + 1 < argc) {
+            room_budget = atol(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--stall-ms") == 0 && i + 1 < argc) {
+            stall_threshold_ms = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-rate") == 0 && i + 1 < argc) {
+            double rate = atof(argv[++i]);
+            if (rate < 0 || rate > 1) {
+                printf("--trace-rate must be between 0 and 1\n");
+                return 1;
+            }
+            trace_threshold = (uint32_t)(rate * UINT32_MAX);
+        } else if (strcmp(argv[i], "--bench-storage") == 0) {
+            return storage_bench(i + 1 < argc ? atoi(argv[i + 1]) : 10000);
+        } else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) {
+            tls_cert = argv[++i];
+        } else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc) {
+            tls_key = argv[++i];
+        } else if (strcmp(argv[i], "--bench-tls") == 0) {
+            return tls_bench(tls_cert, tls_key, i + 1 < argc ? atoi(argv[i + 1]) : 256);
+        }
+    }
+    // SSL_write and sendfile cannot pass MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+    if (tls_cert || tls_key) {
+        if (!tls_cert || !tls_key || !(tls_ctx = tls_context(tls_cert, tls_key, 1))) {
+            if (!tls_cert || !tls_key) printf("TLS needs both --tls-cert and --tls-key\n");
+            return 1;
+        }
+    }
+    
+    // Stop signals are taken by index_checkpointer, so every thread blocks them
+    static sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    
+    thread_role("main");
+    flight_install();
     srand(time(NULL));
-    mkdir("./files", 0755);
+    if (tenant_load() != 0) return 1;
+    auth_load();
     
     printf("Starting Collaborative Text Editor Server...\n");
     
+    pthread_t sched_thread;
+    if (pthread_create(&sched_thread, NULL, outbound_scheduler, NULL) != 0) {
+        printf("Failed to create outbound scheduler thread\n");
+        return 1;
+    }
+    
+    pthread_t checkpoint_thread;
+    if (pthread_create(&checkpoint_thread, NULL, index_checkpointer, &stop_signals) != 0) {
+        printf("Failed to create index checkpoint thread\n");
+        return 1;
+    }
+    
+    if (stall_watchdog_start() != 0) {
+        printf("Failed to create stall watchdog thread\n");
+        return 1;
+    }
+    
+    pthread_t packer_thread;
+    if (pthread_create(&packer_thread, NULL, idle_packer, NULL) != 0) {
+        printf("Failed to create idle packer thread\n");
+        return 1;
+    }
+    
     pthread_t ws_thread;
     if (pthread_create(&ws_thread, NULL, websocket_server, NULL) != 0) {
         printf("Failed to create WebSocket thread\n");
         return 1;
     }
     
-    sleep(1);
-    
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     int opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
@@ -645,10 +8273,13 @@ int main() {
         return 1;
     }
     
-    listen(server_fd, 10);
+    // Followers reconnect all at once after a restart
+    listen(server_fd, SOMAXCONN);
     
-    printf("HTTP server running on http://0.0.0.0:%d\n", PORT);
+    printf("HTTP server running on %s://0.0.0.0:%d\n", tls_ctx ? "https" : "http", PORT);
     printf("Access from other devices using your IP address\n");
+    thread_role("http-accept");
+    thread_wait("accept");
     
     while (1) {
         struct sockaddr_in client_addr;
@@ -657,7 +8288,7 @@ int main() {
         
         if (client_socket < 0) continue;
         
-        int* socket_ptr = malloc(sizeof(int));
+        int* socket_ptr = mem_alloc(MEM_HTTP, sizeof(int));
         *socket_ptr = client_socket;
         
         pthread_t thread;